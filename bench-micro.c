@@ -0,0 +1,437 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+/* Times the hot functions of utils.c in isolation. Each benchmark is
+ * run in batches long enough to time reliably, and the ns/op of the
+ * batches give the percentiles. Allocations are counted by wrapping
+ * malloc(), so they include those done in GLib and OpenSSL. Build with
+ * "make bench-micro". */
+
+#include "config.h"
+
+#include "utils.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static int opt_samples = 100;
+static int opt_batch_usec = 200;
+static char *opt_dir;
+static char *opt_filter;
+
+static GOptionEntry entries[]
+    = { { "samples", 'n', 0, G_OPTION_ARG_INT, &opt_samples, "Number of batches to time", "N" },
+        { "batch-usec", 0, 0, G_OPTION_ARG_INT, &opt_batch_usec,
+          "Minimum duration of a batch in microseconds", "USEC" },
+        { "dir", 0, 0, G_OPTION_ARG_FILENAME, &opt_dir,
+          "Create the test files in DIR, defaults to the temporary directory", "DIR" },
+        { "filter", 'f', 0, G_OPTION_ARG_STRING, &opt_filter,
+          "Only run the benchmarks whose name contains STRING", "STRING" },
+        { NULL } };
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gboolean count_allocs;
+static guint64 n_allocs;
+
+static inline void
+add_alloc (void)
+{
+  if (__atomic_load_n (&count_allocs, __ATOMIC_RELAXED))
+    __atomic_add_fetch (&n_allocs, 1, __ATOMIC_RELAXED);
+}
+
+void *
+malloc (size_t size)
+{
+  add_alloc ();
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  add_alloc ();
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  add_alloc ();
+  return __libc_realloc (ptr, size);
+}
+
+#define HAVE_ALLOC_COUNT 1
+
+static void
+set_count_allocs (gboolean enabled)
+{
+  __atomic_store_n (&count_allocs, enabled, __ATOMIC_RELAXED);
+}
+#else
+static guint64 n_allocs;
+
+static void
+set_count_allocs (gboolean enabled)
+{
+}
+#endif
+
+/* Runs one operation, returns FALSE with errno set if it failed */
+typedef gboolean (*BenchFunc) (gpointer data);
+
+typedef struct
+{
+  char *rel_path;
+  guchar digest[64];
+  GPtrArray *signatures; /* GBytes, one by each key in keys */
+  guint next_signature;
+  KeySet *keys;
+  EVP_PKEY *pkey;
+} SignBench;
+
+typedef struct
+{
+  char *path;
+  int fd;
+  int to_fd;
+  guint methods;
+} FileBench;
+
+static int
+compare_double (gconstpointer a, gconstpointer b)
+{
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+  return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static double
+percentile (const double *sorted, int n, int p)
+{
+  return sorted[MIN (n - 1, (n * p) / 100)];
+}
+
+static gboolean
+run_batch (BenchFunc func, gpointer data, guint64 iterations, gint64 *usec_out)
+{
+  gint64 start = g_get_monotonic_time ();
+  for (guint64 i = 0; i < iterations; i++)
+    if (!func (data))
+      return FALSE;
+  *usec_out = g_get_monotonic_time () - start;
+  return TRUE;
+}
+
+static void
+report_failure (const char *name)
+{
+  g_print ("%-28s %12s\n", name, errno == EOPNOTSUPP ? "unsupported" : "failed");
+}
+
+static void
+bench (const char *name, BenchFunc func, gpointer data)
+{
+  if (opt_filter && strstr (name, opt_filter) == NULL)
+    return;
+
+  /* Double the batch until it takes long enough for the clock */
+  guint64 iterations = 1;
+  gint64 usec;
+  while (TRUE)
+    {
+      if (!run_batch (func, data, iterations, &usec))
+        {
+          report_failure (name);
+          return;
+        }
+      if (usec >= opt_batch_usec || iterations >= G_MAXUINT32)
+        break;
+      iterations *= 2;
+    }
+
+  g_autofree double *samples = g_new (double, opt_samples);
+  guint64 total_ops = 0;
+  gint64 total_usec = 0;
+
+  n_allocs = 0;
+  set_count_allocs (TRUE);
+  for (int i = 0; i < opt_samples; i++)
+    {
+      if (!run_batch (func, data, iterations, &usec))
+        {
+          set_count_allocs (FALSE);
+          report_failure (name);
+          return;
+        }
+      samples[i] = usec * 1000.0 / iterations;
+      total_ops += iterations;
+      total_usec += usec;
+    }
+  set_count_allocs (FALSE);
+
+  qsort (samples, opt_samples, sizeof (double), compare_double);
+
+#ifdef HAVE_ALLOC_COUNT
+  g_autofree char *allocs = g_strdup_printf ("%.1f", n_allocs / (double)total_ops);
+#else
+  const char *allocs = "-";
+#endif
+  g_print ("%-28s %12.1f %12.1f %12.1f %12.1f %10s\n", name, total_usec * 1000.0 / total_ops,
+           percentile (samples, opt_samples, 50), percentile (samples, opt_samples, 90),
+           percentile (samples, opt_samples, 99), allocs);
+}
+
+static gboolean
+bench_has_path_prefix (gpointer data)
+{
+  /* The result is not used, keep the calls from being optimized away */
+  volatile gboolean res;
+  res = has_path_prefix ("etc/validator/keys/default.pub", "etc/validator");
+  res = has_path_prefix ("etc/validator/keys/default.pub", "etc/validatorkeys");
+  (void)res;
+  return TRUE;
+}
+
+static gboolean
+bench_make_sign_blob (gpointer data)
+{
+  SignBench *sb = data;
+  gsize len;
+  g_autofree guchar *blob
+      = make_sign_blob (sb->rel_path, S_IFREG, sb->digest, sizeof (sb->digest), &len, NULL);
+  return blob != NULL;
+}
+
+static gboolean
+bench_validate_data (gpointer data)
+{
+  SignBench *sb = data;
+  gsize signature_len;
+  const char *signature
+      = g_bytes_get_data (g_ptr_array_index (sb->signatures, sb->next_signature), &signature_len);
+
+  /* The verifier starts with the key that matched last time, so going
+   * backwards through the keys makes it try all of them every time */
+  sb->next_signature = (sb->next_signature + sb->signatures->len - 1) % sb->signatures->len;
+
+  return validate_data (sb->rel_path, S_IFREG, sb->digest, sizeof (sb->digest),
+                        (char *)signature, signature_len, sb->keys, NULL);
+}
+
+static gboolean
+bench_sign_data (gpointer data)
+{
+  SignBench *sb = data;
+  g_autofree guchar *signature = NULL;
+  gsize signature_len;
+  return sign_data (S_IFREG, sb->rel_path, sb->digest, sizeof (sb->digest), sb->pkey, &signature,
+                    &signature_len, NULL);
+}
+
+static gboolean
+bench_sha512 (gpointer data)
+{
+  FileBench *fb = data;
+  if (lseek (fb->fd, 0, SEEK_SET) < 0)
+    return FALSE;
+
+  gsize digest_len;
+  g_autofree char *digest = sha512_fd (fb->fd, -1, SHA512_FD_NONE, fb->path, &digest_len, NULL);
+  return digest != NULL;
+}
+
+static gboolean
+bench_copy_fd (gpointer data)
+{
+  FileBench *fb = data;
+  if (lseek (fb->fd, 0, SEEK_SET) < 0 || ftruncate (fb->to_fd, 0) < 0
+      || lseek (fb->to_fd, 0, SEEK_SET) < 0)
+    return FALSE;
+
+  return copy_fd_with_methods (fb->fd, fb->to_fd, fb->methods, NULL) == 0;
+}
+
+static EVP_PKEY *
+generate_key (void)
+{
+  EVP_PKEY *key = EVP_PKEY_Q_keygen (NULL, NULL, "ED25519");
+  if (key == NULL)
+    {
+      g_printerr ("Can't generate key\n");
+      exit (EXIT_FAILURE);
+    }
+  return key;
+}
+
+static char *
+create_file (const char *dir, const char *name, gsize size, GError **error)
+{
+  g_autofree char *path = g_build_filename (dir, name, NULL);
+  g_autofree char *content = g_malloc (size);
+  for (gsize i = 0; i < size; i++)
+    content[i] = i * 31 + (i >> 8);
+
+  if (!g_file_set_contents (path, content, size, error))
+    return NULL;
+  return g_steal_pointer (&path);
+}
+
+static void
+bench_signatures (void)
+{
+  const int n_keys[] = { 1, 8, 64 };
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GRand) rand = g_rand_new_with_seed (42);
+
+  SignBench sb = { "usr/lib/validator/example/file.conf" };
+  for (gsize i = 0; i < sizeof (sb.digest); i++)
+    sb.digest[i] = g_rand_int (rand) & 0xff;
+
+  bench ("has_path_prefix", bench_has_path_prefix, &sb);
+  bench ("make_sign_blob", bench_make_sign_blob, &sb);
+
+  sb.pkey = generate_key ();
+  bench ("sign_data", bench_sign_data, &sb);
+  EVP_PKEY_free (sb.pkey);
+  sb.pkey = NULL;
+
+  for (gsize i = 0; i < G_N_ELEMENTS (n_keys); i++)
+    {
+      g_autoptr (KeySet) keys = key_set_new ();
+      g_autoptr (GPtrArray) signatures
+          = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+      for (int j = 0; j < n_keys[i]; j++)
+        {
+          g_autoptr (EVP_PKEY) key = generate_key ();
+          key_set_add (keys, key);
+
+          guchar *signature = NULL;
+          gsize signature_len;
+          if (!sign_data (S_IFREG, sb.rel_path, sb.digest, sizeof (sb.digest), key, &signature,
+                          &signature_len, &error))
+            {
+              g_printerr ("%s\n", error->message);
+              exit (EXIT_FAILURE);
+            }
+          g_ptr_array_add (signatures, g_bytes_new_take (signature, signature_len));
+        }
+      sb.signatures = signatures;
+      sb.next_signature = 0;
+      sb.keys = keys;
+
+      g_autofree char *name = g_strdup_printf ("validate_data/%d-keys", n_keys[i]);
+      bench (name, bench_validate_data, &sb);
+    }
+}
+
+static void
+bench_files (const char *dir)
+{
+  const gsize sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+  g_autoptr (GError) error = NULL;
+
+  g_autofree char *to_path = g_build_filename (dir, "copy", NULL);
+  int to_fd = open (to_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (to_fd < 0)
+    {
+      g_printerr ("Can't create %s: %s\n", to_path, strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+
+  for (gsize i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      g_autofree char *size_str = sizes[i] >= 1024 * 1024
+                                      ? g_strdup_printf ("%" G_GSIZE_FORMAT "M", sizes[i] >> 20)
+                                      : g_strdup_printf ("%" G_GSIZE_FORMAT "K", sizes[i] >> 10);
+      g_autofree char *name = g_strdup_printf ("file-%" G_GSIZE_FORMAT, sizes[i]);
+      g_autofree char *path = create_file (dir, name, sizes[i], &error);
+      if (path == NULL)
+        {
+          g_printerr ("%s\n", error->message);
+          exit (EXIT_FAILURE);
+        }
+
+      FileBench fb = { path, open (path, O_RDONLY | O_CLOEXEC), to_fd };
+      if (fb.fd < 0)
+        {
+          g_printerr ("Can't open %s: %s\n", path, strerror (errno));
+          exit (EXIT_FAILURE);
+        }
+
+      g_autofree char *sha512_name = g_strdup_printf ("sha512_fd/%s", size_str);
+      bench (sha512_name, bench_sha512, &fb);
+
+      for (CopyMethod method = 0; method < N_COPY_METHODS; method++)
+        {
+          g_autofree char *copy_name
+              = g_strdup_printf ("copy_fd/%s/%s", copy_method_to_string (method), size_str);
+          fb.methods = 1 << method;
+          bench (copy_name, bench_copy_fd, &fb);
+        }
+
+      close (fb.fd);
+      unlink (path);
+    }
+
+  close (to_fd);
+  unlink (to_path);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GOptionContext) context = g_option_context_new ("- benchmark utility functions");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (opt_samples <= 0 || opt_batch_usec <= 0)
+    {
+      g_printerr ("--samples and --batch-usec must be positive\n");
+      return EXIT_FAILURE;
+    }
+
+  g_autofree char *dir = g_build_filename (opt_dir ? opt_dir : g_get_tmp_dir (),
+                                           "bench-micro-XXXXXX", NULL);
+  if (mkdtemp (dir) == NULL)
+    {
+      g_printerr ("Can't create %s: %s\n", dir, strerror (errno));
+      return EXIT_FAILURE;
+    }
+
+  g_print ("%-28s %12s %12s %12s %12s %10s\n", "", "mean ns/op", "p50", "p90", "p99",
+           "allocs/op");
+
+  bench_signatures ();
+  bench_files (dir);
+
+  rmdir (dir);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,432 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+/* Times validator sign, validate and install on a generated tree, with
+ * the file data in the page cache (warm) and dropped from it (cold).
+ * The tree is the same for the same options and seed, so results can be
+ * compared between builds. Build with "make bench-tree", the results are
+ * printed as JSON. */
+
+#include "config.h"
+
+#include "utils.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <openssl/pem.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static char *opt_validator = "./validator";
+static char *opt_dir;
+static gboolean opt_keep;
+static int opt_files = 2000;
+static int opt_min_size = 128;
+static int opt_max_size = 256 * 1024;
+static double opt_symlink_ratio = 0.1;
+static int opt_depth = 3;
+static int opt_fanout = 4;
+static int opt_keys = 1;
+static int opt_seed = 42;
+static int opt_runs = 3;
+static int opt_jobs = 1;
+
+static GOptionEntry entries[]
+    = { { "validator", 0, 0, G_OPTION_ARG_FILENAME, &opt_validator, "Validator binary to time",
+          "PATH" },
+        { "dir", 0, 0, G_OPTION_ARG_FILENAME, &opt_dir,
+          "Generate the tree in this empty directory (default: a temporary one)", "DIR" },
+        { "keep", 0, 0, G_OPTION_ARG_NONE, &opt_keep, "Don't remove the tree afterwards", NULL },
+        { "files", 'n', 0, G_OPTION_ARG_INT, &opt_files, "Number of files", "N" },
+        { "min-size", 0, 0, G_OPTION_ARG_INT, &opt_min_size, "Smallest regular file", "BYTES" },
+        { "max-size", 0, 0, G_OPTION_ARG_INT, &opt_max_size, "Largest regular file", "BYTES" },
+        { "symlink-ratio", 0, 0, G_OPTION_ARG_DOUBLE, &opt_symlink_ratio,
+          "Fraction of files that are symlinks", "RATIO" },
+        { "depth", 0, 0, G_OPTION_ARG_INT, &opt_depth, "Depth of the directory tree", "N" },
+        { "fanout", 0, 0, G_OPTION_ARG_INT, &opt_fanout, "Subdirectories per directory", "N" },
+        { "keys", 'k', 0, G_OPTION_ARG_INT, &opt_keys, "Number of trusted keys", "N" },
+        { "seed", 0, 0, G_OPTION_ARG_INT, &opt_seed, "Seed of the generated tree", "N" },
+        { "runs", 0, 0, G_OPTION_ARG_INT, &opt_runs, "Timed runs of each phase", "N" },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Threads for sign and validate", "N" },
+        { NULL } };
+
+typedef struct
+{
+  int n_files;
+  int n_symlinks;
+  int n_dirs;
+  guint64 n_bytes;
+} TreeStats;
+
+typedef struct
+{
+  double wall;
+  double user;
+  double sys;
+} RunTime;
+
+static gboolean
+write_key_files (EVP_PKEY *key, const char *secret_path, const char *public_path)
+{
+  g_autoptr (FILE) secret = fopen (secret_path, "w");
+  g_autoptr (FILE) public = fopen (public_path, "w");
+
+  return secret != NULL && public != NULL
+         && PEM_write_PrivateKey (secret, key, NULL, NULL, 0, NULL, NULL) == 1
+         && PEM_write_PUBKEY (public, key) == 1;
+}
+
+/* Signing is done with the last key, as in bench-verify */
+static gboolean
+generate_keys (const char *dir, GError **error)
+{
+  g_autofree char *key_dir = g_build_filename (dir, "keys", NULL);
+  if (g_mkdir_with_parents (key_dir, 0755) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't create %s: %s",
+                   key_dir, strerror (errno));
+      return FALSE;
+    }
+
+  for (int i = 0; i < opt_keys; i++)
+    {
+      g_autoptr (EVP_PKEY) key = EVP_PKEY_Q_keygen (NULL, NULL, "ED25519");
+      g_autofree char *secret_path = g_build_filename (dir, "secret.pem", NULL);
+      g_autofree char *public_path = g_strdup_printf ("%s/key%d.pem", key_dir, i);
+      if (key == NULL || !write_key_files (key, secret_path, public_path))
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't generate key");
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* File sizes are log-uniform between the smallest and largest size, so
+ * that there are many small files and a few large ones, as in /etc */
+static gsize
+random_size (GRand *rand)
+{
+  double min = log (opt_min_size > 0 ? opt_min_size : 1);
+  double max = log (opt_max_size > opt_min_size ? opt_max_size : opt_min_size + 1);
+  return (gsize)exp (min + g_rand_double (rand) * (max - min));
+}
+
+static gboolean
+generate_tree (const char *root, TreeStats *stats, GError **error)
+{
+  g_autoptr (GRand) rand = g_rand_new_with_seed (opt_seed);
+  g_autoptr (GPtrArray) dirs = g_ptr_array_new_with_free_func (g_free);
+
+  g_ptr_array_add (dirs, g_strdup (root));
+  guint level_start = 0;
+  for (int depth = 0; depth < opt_depth; depth++)
+    {
+      guint level_end = dirs->len;
+      for (guint i = level_start; i < level_end; i++)
+        for (int j = 0; j < opt_fanout; j++)
+          g_ptr_array_add (dirs, g_strdup_printf ("%s/dir%d", (char *)dirs->pdata[i], j));
+      level_start = level_end;
+    }
+
+  for (guint i = 0; i < dirs->len; i++)
+    if (g_mkdir_with_parents (dirs->pdata[i], 0755) < 0)
+      {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't create %s: %s",
+                     (char *)dirs->pdata[i], strerror (errno));
+        return FALSE;
+      }
+  stats->n_dirs = dirs->len;
+
+  g_autofree guchar *buf = g_malloc (MAX (opt_max_size, opt_min_size) + 1);
+  for (int i = 0; i < opt_files; i++)
+    {
+      const char *dir = dirs->pdata[g_rand_int_range (rand, 0, dirs->len)];
+      g_autofree char *path = g_strdup_printf ("%s/file%d", dir, i);
+
+      if (i > 0 && g_rand_double (rand) < opt_symlink_ratio)
+        {
+          g_autofree char *target = g_strdup_printf ("file%d", g_rand_int_range (rand, 0, i));
+          if (symlink (target, path) < 0)
+            {
+              g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                           "Can't create %s: %s", path, strerror (errno));
+              return FALSE;
+            }
+          stats->n_symlinks++;
+          continue;
+        }
+
+      gsize size = random_size (rand);
+      for (gsize j = 0; j < size; j++)
+        buf[j] = g_rand_int (rand) & 0xff;
+      if (!g_file_set_contents (path, (char *)buf, size, error))
+        return FALSE;
+
+      stats->n_files++;
+      stats->n_bytes += size;
+    }
+
+  return TRUE;
+}
+
+/* Drops the data of all files under path from the page cache. Only
+ * clean pages can be dropped, so everything is synced first. Inodes and
+ * directories stay cached, which only root could change. */
+static void
+drop_tree_cache (const char *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  const char *name;
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *child = g_build_filename (path, name, NULL);
+      struct stat st;
+      if (lstat (child, &st) < 0)
+        continue;
+
+      if (S_ISDIR (st.st_mode))
+        drop_tree_cache (child);
+      else if (S_ISREG (st.st_mode))
+        {
+          autofd int fd = open (child, O_RDONLY | O_CLOEXEC);
+          if (fd >= 0)
+            (void)posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+    }
+}
+
+static void
+remove_tree (const char *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  if (dir != NULL)
+    {
+      const char *name;
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          g_autofree char *child = g_build_filename (path, name, NULL);
+          struct stat st;
+          if (lstat (child, &st) == 0 && S_ISDIR (st.st_mode))
+            remove_tree (child);
+          else
+            unlink (child);
+        }
+    }
+  rmdir (path);
+}
+
+static gboolean
+dir_is_empty (const char *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  return dir != NULL && g_dir_read_name (dir) == NULL;
+}
+
+static gboolean
+run_validator (char **argv, RunTime *time_out)
+{
+  gint64 start = g_get_monotonic_time ();
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    return FALSE;
+  if (pid == 0)
+    {
+      execv (argv[0], argv);
+      _exit (127);
+    }
+
+  int status;
+  struct rusage usage;
+  if (wait4 (pid, &status, 0, &usage) < 0)
+    return FALSE;
+
+  time_out->wall = (g_get_monotonic_time () - start) / (double)G_USEC_PER_SEC;
+  time_out->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / (double)G_USEC_PER_SEC;
+  time_out->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / (double)G_USEC_PER_SEC;
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      g_printerr ("'%s %s' failed\n", argv[0], argv[1]);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gint
+cmp_wall (gconstpointer a, gconstpointer b)
+{
+  const RunTime *ta = a;
+  const RunTime *tb = b;
+  return ta->wall < tb->wall ? -1 : ta->wall > tb->wall;
+}
+
+/* Times opt_runs runs of argv, after one untimed run when warm, and
+ * appends the results as a JSON object */
+static gboolean
+bench_phase (GString *json, const char *phase, gboolean cold, char **argv, const char *tree,
+             const char *destination, const TreeStats *stats)
+{
+  g_autoptr (GArray) runs = g_array_new (FALSE, FALSE, sizeof (RunTime));
+
+  for (int i = cold ? 0 : -1; i < opt_runs; i++)
+    {
+      if (destination)
+        remove_tree (destination);
+      sync ();
+      if (cold)
+        drop_tree_cache (tree);
+
+      RunTime run;
+      if (!run_validator (argv, &run))
+        return FALSE;
+      if (i >= 0)
+        g_array_append_val (runs, run);
+    }
+
+  g_array_sort (runs, cmp_wall);
+  RunTime *median = &g_array_index (runs, RunTime, runs->len / 2);
+  int n_entries = stats->n_files + stats->n_symlinks;
+
+  g_printerr ("%-8s %-4s %8.3f s %10.0f files/s %8.1f MB/s\n", phase, cold ? "cold" : "warm",
+              median->wall, n_entries / median->wall, stats->n_bytes / 1e6 / median->wall);
+
+  if (json->str[json->len - 1] == '}')
+    g_string_append (json, ",");
+  g_string_append_printf (json,
+                          "\n    {\"phase\": \"%s\", \"cache\": \"%s\", \"seconds\": %.6f, "
+                          "\"user_seconds\": %.6f, \"system_seconds\": %.6f, "
+                          "\"files_per_second\": %.1f, \"mb_per_second\": %.3f, \"runs\": [",
+                          phase, cold ? "cold" : "warm", median->wall, median->user, median->sys,
+                          n_entries / median->wall, stats->n_bytes / 1e6 / median->wall);
+  for (guint i = 0; i < runs->len; i++)
+    g_string_append_printf (json, "%s%.6f", i > 0 ? ", " : "",
+                            g_array_index (runs, RunTime, i).wall);
+  g_string_append (json, "]}");
+
+  return TRUE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GOptionContext) context
+      = g_option_context_new ("- benchmark sign, validate and install");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (opt_files <= 0 || opt_keys <= 0 || opt_runs <= 0 || opt_depth < 0 || opt_fanout <= 0
+      || opt_min_size < 0 || opt_max_size < 0)
+    {
+      g_printerr ("Invalid tree options\n");
+      return EXIT_FAILURE;
+    }
+
+  g_autofree char *validator = g_canonicalize_filename (opt_validator, NULL);
+  g_autofree char *dir = NULL;
+  if (opt_dir)
+    {
+      /* Only what we generate is removed afterwards, so there must be
+       * nothing else in there */
+      dir = g_canonicalize_filename (opt_dir, NULL);
+      if (g_mkdir_with_parents (dir, 0755) < 0 || !dir_is_empty (dir))
+        {
+          g_printerr ("'%s' is not an empty directory\n", dir);
+          return EXIT_FAILURE;
+        }
+    }
+  else
+    {
+      dir = g_dir_make_tmp ("validator-bench-XXXXXX", &error);
+      if (dir == NULL)
+        {
+          g_printerr ("%s\n", error->message);
+          return EXIT_FAILURE;
+        }
+    }
+
+  g_autofree char *tree = g_build_filename (dir, "tree", NULL);
+  g_autofree char *destination = g_build_filename (dir, "installed", NULL);
+  g_autofree char *key_arg = g_strdup_printf ("--key=%s/secret.pem", dir);
+  g_autofree char *key_dir_arg = g_strdup_printf ("--key-dir=%s/keys", dir);
+  g_autofree char *jobs_arg = g_strdup_printf ("--jobs=%d", opt_jobs);
+
+  g_printerr ("Generating %d files in %s\n", opt_files, tree);
+  TreeStats stats = { 0 };
+  remove_tree (tree);
+  if (!generate_keys (dir, &error) || !generate_tree (tree, &stats, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  char *sign_argv[] = { validator, "sign", "-r", "-f", key_arg, jobs_arg, tree, NULL };
+  char *validate_argv[] = { validator, "validate", "-r", key_dir_arg, jobs_arg, tree, NULL };
+  char *install_argv[] = { validator, "install", "-r", key_dir_arg, tree, destination, NULL };
+
+  g_autoptr (GString) json = g_string_new ("");
+  g_string_append_printf (json,
+                          "{\n  \"tree\": {\"files\": %d, \"symlinks\": %d, \"dirs\": %d, "
+                          "\"bytes\": %" G_GUINT64_FORMAT ", \"keys\": %d, \"seed\": %d, "
+                          "\"min_size\": %d, \"max_size\": %d, \"depth\": %d, \"fanout\": %d},\n"
+                          "  \"jobs\": %d,\n  \"runs\": %d,\n  \"phases\": [",
+                          stats.n_files, stats.n_symlinks, stats.n_dirs, stats.n_bytes, opt_keys,
+                          opt_seed, opt_min_size, opt_max_size, opt_depth, opt_fanout, opt_jobs,
+                          opt_runs);
+
+  gboolean res = TRUE;
+  for (int cold = 0; cold <= 1 && res; cold++)
+    {
+      res = bench_phase (json, "sign", cold, sign_argv, tree, NULL, &stats)
+            && bench_phase (json, "validate", cold, validate_argv, tree, NULL, &stats)
+            && bench_phase (json, "install", cold, install_argv, tree, destination, &stats);
+    }
+  g_string_append (json, "\n  ]\n}\n");
+
+  if (!opt_keep && opt_dir)
+    {
+      g_autofree char *key_dir = g_build_filename (dir, "keys", NULL);
+      g_autofree char *secret_path = g_build_filename (dir, "secret.pem", NULL);
+      remove_tree (tree);
+      remove_tree (destination);
+      remove_tree (key_dir);
+      unlink (secret_path);
+    }
+  else if (!opt_keep)
+    remove_tree (dir);
+
+  if (!res)
+    return EXIT_FAILURE;
+
+  g_print ("%s", json->str);
+  return EXIT_SUCCESS;
+}
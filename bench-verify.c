@@ -0,0 +1,150 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+/* Compares the ways of checking many signatures: one validate_data()
+ * call per file, and a shared Verifier. Build with "make bench-verify". */
+
+#include "config.h"
+
+#include "utils.h"
+
+static int opt_files = 10000;
+static int opt_keys = 8;
+
+static GOptionEntry entries[]
+    = { { "files", 'n', 0, G_OPTION_ARG_INT, &opt_files, "Number of signatures to check", "N" },
+        { "keys", 'k', 0, G_OPTION_ARG_INT, &opt_keys, "Number of trusted keys", "N" },
+        { NULL } };
+
+typedef struct
+{
+  char *rel_path;
+  guchar digest[64];
+  guchar *signature;
+  gsize signature_len;
+} BenchFile;
+
+static void
+report (const char *name, gint64 usec, int n_valid)
+{
+  g_print ("%-24s %10.0f ns/signature %8.0f signatures/s (%d valid)\n", name,
+           usec * 1000.0 / opt_files, opt_files / (usec / (double)G_USEC_PER_SEC), n_valid);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GOptionContext) context = g_option_context_new ("- benchmark signature checks");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (opt_files <= 0 || opt_keys <= 0)
+    {
+      g_printerr ("--files and --keys must be positive\n");
+      return EXIT_FAILURE;
+    }
+
+  g_autoptr (KeySet) keys = key_set_new ();
+  g_autoptr (EVP_PKEY) signing_key = NULL;
+  for (int i = 0; i < opt_keys; i++)
+    {
+      g_autoptr (EVP_PKEY) key = EVP_PKEY_Q_keygen (NULL, NULL, "ED25519");
+      if (key == NULL)
+        {
+          g_printerr ("Can't generate key\n");
+          return EXIT_FAILURE;
+        }
+      key_set_add (keys, key);
+
+      /* Sign with the last key, so the first check tries every key. After
+       * that the verifier starts with the key that matched. */
+      if (i == opt_keys - 1)
+        signing_key = g_steal_pointer (&key);
+    }
+
+  g_autoptr (Signer) signer = signer_new (signing_key, FALSE, &error);
+  if (signer == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  g_autoptr (GRand) rand = g_rand_new_with_seed (42);
+  BenchFile *files = g_new0 (BenchFile, opt_files);
+  for (int i = 0; i < opt_files; i++)
+    {
+      BenchFile *file = &files[i];
+      file->rel_path = g_strdup_printf ("dir%d/file%d.conf", i % 100, i);
+      for (gsize j = 0; j < sizeof (file->digest); j++)
+        file->digest[j] = g_rand_int (rand) & 0xff;
+
+      if (!signer_sign (signer, S_IFREG, file->rel_path, file->digest, sizeof (file->digest),
+                        &file->signature, &file->signature_len, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          return EXIT_FAILURE;
+        }
+    }
+
+  g_print ("%d signatures, %d keys\n", opt_files, opt_keys);
+
+  int n_valid = 0;
+  gint64 start = g_get_monotonic_time ();
+  for (int i = 0; i < opt_files; i++)
+    {
+      BenchFile *file = &files[i];
+      if (validate_data (file->rel_path, S_IFREG, file->digest, sizeof (file->digest),
+                         (char *)file->signature, file->signature_len, keys, NULL))
+        n_valid++;
+    }
+  report ("validate_data", g_get_monotonic_time () - start, n_valid);
+
+  g_autoptr (Verifier) verifier = verifier_new (keys, &error);
+  if (verifier == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  n_valid = 0;
+  start = g_get_monotonic_time ();
+  for (int i = 0; i < opt_files; i++)
+    {
+      BenchFile *file = &files[i];
+      if (verifier_verify (verifier, file->rel_path, S_IFREG, file->digest, sizeof (file->digest),
+                           (char *)file->signature, file->signature_len, NULL))
+        n_valid++;
+    }
+  report ("verifier_verify", g_get_monotonic_time () - start, n_valid);
+
+  for (int i = 0; i < opt_files; i++)
+    {
+      g_free (files[i].rel_path);
+      g_free (files[i].signature);
+    }
+  g_free (files);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "utils.h"
+
+#include "cache.h"
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+#define CACHE_HEADER_LEN (VALIDATOR_CACHE_MAGIC_LEN + 16)
+#define CACHE_HMAC_LEN 32
+#define CACHE_KEY_LEN 32
+
+G_STATIC_ASSERT (sizeof (ValidationCacheRecord) == 144);
+G_STATIC_ASSERT (sizeof (ValidationCacheTree) == 96);
+
+struct _ValidationCache
+{
+  char *path;
+  char *key;
+  gsize key_len;
+
+  /* As loaded, records point into data */
+  char *data;
+  const ValidationCacheRecord *records;
+  guint32 n_records;
+  const ValidationCacheTree *trees;
+  guint32 n_trees;
+
+  /* Records that were hit or added in this run, which are the ones
+   * that are saved. For the same file or tree the last one wins. */
+  GMutex lock;
+  GArray *kept;
+  GArray *kept_trees;
+
+  gint hits;
+  gint misses;
+};
+
+/* Loads the cache key. A missing key is an error unless create is set,
+ * as silently starting over with a new key would hide that the old one
+ * was removed. New keys are random and only readable by us. */
+static gboolean
+load_cache_key (const char *key_path, gboolean create, char **key_out, gsize *key_len_out,
+                GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  if (g_file_get_contents (key_path, key_out, key_len_out, &local_error))
+    {
+      if (*key_len_out < CACHE_KEY_LEN)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Cache key '%s' is too short",
+                       key_path);
+          g_clear_pointer (key_out, g_free);
+          return FALSE;
+        }
+      return TRUE;
+    }
+
+  if (!create || !g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  g_autofree char *key = g_malloc (CACHE_KEY_LEN);
+  if (RAND_bytes ((guchar *)key, CACHE_KEY_LEN) != 1)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't generate cache key");
+      return FALSE;
+    }
+
+  if (!g_file_set_contents_full (key_path, key, CACHE_KEY_LEN, G_FILE_SET_CONTENTS_CONSISTENT,
+                                 0600, error))
+    return FALSE;
+
+  g_printerr ("Created new cache key '%s'\n", key_path);
+
+  *key_out = g_steal_pointer (&key);
+  *key_len_out = CACHE_KEY_LEN;
+  return TRUE;
+}
+
+static gboolean
+compute_hmac (ValidationCache *cache, const char *data, gsize len, guchar *hmac_out)
+{
+  gsize hmac_len = 0;
+  if (EVP_Q_mac (NULL, "HMAC", NULL, "SHA256", NULL, cache->key, cache->key_len,
+                 (const guchar *)data, len, hmac_out, CACHE_HMAC_LEN, &hmac_len)
+      == NULL)
+    return FALSE;
+  return hmac_len == CACHE_HMAC_LEN;
+}
+
+static gboolean
+cache_parse (ValidationCache *cache, char *data, gsize len)
+{
+  if (len < CACHE_HEADER_LEN + CACHE_HMAC_LEN
+      || memcmp (data, VALIDATOR_CACHE_MAGIC, VALIDATOR_CACHE_MAGIC_LEN) != 0)
+    return FALSE;
+
+  guint32 header[4];
+  memcpy (header, data + VALIDATOR_CACHE_MAGIC_LEN, sizeof (header));
+  guint32 n_records = header[0], n_trees = header[2];
+  guint64 records_len = (guint64)n_records * sizeof (ValidationCacheRecord);
+  guint64 trees_len = (guint64)n_trees * sizeof (ValidationCacheTree);
+  if (header[1] != sizeof (ValidationCacheRecord) || header[3] != sizeof (ValidationCacheTree)
+      || len != CACHE_HEADER_LEN + records_len + trees_len + CACHE_HMAC_LEN)
+    return FALSE;
+
+  guchar hmac[CACHE_HMAC_LEN];
+  if (!compute_hmac (cache, data, len - CACHE_HMAC_LEN, hmac)
+      || CRYPTO_memcmp (hmac, data + len - CACHE_HMAC_LEN, CACHE_HMAC_LEN) != 0)
+    return FALSE;
+
+  cache->data = data;
+  cache->records = (const ValidationCacheRecord *)(data + CACHE_HEADER_LEN);
+  cache->n_records = n_records;
+  cache->trees = (const ValidationCacheTree *)(data + CACHE_HEADER_LEN + records_len);
+  cache->n_trees = n_trees;
+  return TRUE;
+}
+
+/* A missing or invalid cache file is not an error, it is just empty */
+ValidationCache *
+validation_cache_load (const char *path, const char *key_path, gboolean create_key,
+                       GError **error)
+{
+  g_autoptr (ValidationCache) cache = g_new0 (ValidationCache, 1);
+  cache->path = g_strdup (path);
+  g_mutex_init (&cache->lock);
+  cache->kept = g_array_new (FALSE, FALSE, sizeof (ValidationCacheRecord));
+  cache->kept_trees = g_array_new (FALSE, FALSE, sizeof (ValidationCacheTree));
+
+  if (!load_cache_key (key_path, create_key, &cache->key, &cache->key_len, error))
+    return NULL;
+
+  g_autoptr (GError) local_error = NULL;
+  g_autofree char *data = NULL;
+  gsize len;
+  if (!g_file_get_contents (path, &data, &len, &local_error))
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                      "Can't load cache '%s': ", path);
+          return NULL;
+        }
+    }
+  else if (!cache_parse (cache, data, len))
+    g_printerr ("Ignoring invalid cache '%s'\n", path);
+  else
+    g_steal_pointer (&data);
+
+  g_info ("Loaded cache '%s' with %u records and %u trees", path, cache->n_records,
+          cache->n_trees);
+
+  return g_steal_pointer (&cache);
+}
+
+static gint
+record_cmp (gconstpointer a, gconstpointer b)
+{
+  const ValidationCacheRecord *ra = a;
+  const ValidationCacheRecord *rb = b;
+
+  if (ra->dev != rb->dev)
+    return ra->dev < rb->dev ? -1 : 1;
+  if (ra->ino != rb->ino)
+    return ra->ino < rb->ino ? -1 : 1;
+  return 0;
+}
+
+static gint
+tree_cmp (gconstpointer a, gconstpointer b)
+{
+  const ValidationCacheTree *ta = a;
+  const ValidationCacheTree *tb = b;
+
+  return memcmp (ta->id, tb->id, sizeof (ta->id));
+}
+
+/* Sorts array, keeping the last of the elements with the same key */
+static void
+sort_unique (GArray *array, gsize element_size, GCompareFunc cmp)
+{
+  g_array_sort (array, cmp);
+
+  guint n = 0;
+  for (guint i = 0; i < array->len; i++)
+    {
+      char *element = array->data + i * element_size;
+      if (n > 0 && cmp (array->data + (n - 1) * element_size, element) == 0)
+        n--;
+      memmove (array->data + n++ * element_size, element, element_size);
+    }
+  g_array_set_size (array, n);
+}
+
+static gboolean
+has_tree (ValidationCache *cache, const ValidationCacheTree *tree)
+{
+  const ValidationCacheTree *cached
+      = bsearch (tree, cache->trees, cache->n_trees, sizeof (ValidationCacheTree), tree_cmp);
+  return cached != NULL && memcmp (cached, tree, sizeof (ValidationCacheTree)) == 0;
+}
+
+/* Writes the records that were used or added in this run, if that
+ * differs from what was loaded. Everything else is dropped, so the cache
+ * doesn't keep growing with files that were removed, or are no longer
+ * validated with it. Newly installed trees are only added with
+ * add_trees, i.e. if the whole run succeeded. */
+gboolean
+validation_cache_save (ValidationCache *cache, gboolean add_trees, GError **error)
+{
+  g_autoptr (GArray) records = g_array_new (FALSE, FALSE, sizeof (ValidationCacheRecord));
+  g_array_append_vals (records, cache->kept->data, cache->kept->len);
+  sort_unique (records, sizeof (ValidationCacheRecord), record_cmp);
+
+  g_autoptr (GArray) trees = g_array_new (FALSE, FALSE, sizeof (ValidationCacheTree));
+  for (guint i = 0; i < cache->kept_trees->len; i++)
+    {
+      const ValidationCacheTree *tree
+          = &g_array_index (cache->kept_trees, ValidationCacheTree, i);
+      if (add_trees || has_tree (cache, tree))
+        g_array_append_val (trees, *tree);
+    }
+  sort_unique (trees, sizeof (ValidationCacheTree), tree_cmp);
+
+  gsize records_len = (gsize)records->len * sizeof (ValidationCacheRecord);
+  gsize trees_len = (gsize)trees->len * sizeof (ValidationCacheTree);
+  if (records->len == cache->n_records && trees->len == cache->n_trees
+      && (records_len == 0 || memcmp (records->data, cache->records, records_len) == 0)
+      && (trees_len == 0 || memcmp (trees->data, cache->trees, trees_len) == 0))
+    return TRUE;
+
+  guint32 header[4] = { records->len, sizeof (ValidationCacheRecord), trees->len,
+                        sizeof (ValidationCacheTree) };
+
+  g_autoptr (GString) s
+      = g_string_sized_new (CACHE_HEADER_LEN + records_len + trees_len + CACHE_HMAC_LEN);
+  g_string_append_len (s, VALIDATOR_CACHE_MAGIC, VALIDATOR_CACHE_MAGIC_LEN);
+  g_string_append_len (s, (const char *)header, sizeof (header));
+  g_string_append_len (s, records->data, records_len);
+  g_string_append_len (s, trees->data, trees_len);
+
+  guchar hmac[CACHE_HMAC_LEN];
+  if (!compute_hmac (cache, s->str, s->len, hmac))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't compute cache hmac");
+      return FALSE;
+    }
+  g_string_append_len (s, (const char *)hmac, CACHE_HMAC_LEN);
+
+  if (!g_file_set_contents_full (cache->path, s->str, s->len, G_FILE_SET_CONTENTS_CONSISTENT,
+                                 0600, error))
+    return FALSE;
+
+  g_info ("Wrote cache '%s' with %u records and %u trees", cache->path, records->len,
+          trees->len);
+
+  return TRUE;
+}
+
+void
+validation_cache_free (ValidationCache *cache)
+{
+  g_array_unref (cache->kept_trees);
+  g_array_unref (cache->kept);
+  g_mutex_clear (&cache->lock);
+  g_free (cache->data);
+  g_free (cache->key);
+  g_free (cache->path);
+  g_free (cache);
+}
+
+void
+validation_cache_record_init (ValidationCacheRecord *record, const struct stat *st, KeySet *keys,
+                              const char *rel_path, const char *signature, gsize signature_len)
+{
+  memset (record, 0, sizeof (*record));
+  record->dev = st->st_dev;
+  record->ino = st->st_ino;
+  record->size = st->st_size;
+  record->mtime_sec = st->st_mtim.tv_sec;
+  record->mtime_nsec = st->st_mtim.tv_nsec;
+  record->ctime_sec = st->st_ctim.tv_sec;
+  record->ctime_nsec = st->st_ctim.tv_nsec;
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new ();
+  if (ctx == NULL || EVP_DigestInit_ex (ctx, EVP_sha256 (), NULL) != 1
+      || EVP_DigestUpdate (ctx, key_set_get_fingerprint (keys), VALIDATOR_KEY_ID_LEN) != 1
+      || EVP_DigestUpdate (ctx, rel_path, strlen (rel_path) + 1) != 1
+      || EVP_DigestUpdate (ctx, signature, signature_len) != 1
+      || EVP_DigestFinal_ex (ctx, record->signature_hash, NULL) != 1)
+    oom ();
+  EVP_MD_CTX_free (ctx);
+}
+
+/* Returns TRUE if the file of record (from validation_cache_record_init())
+ * was already validated, and sets its digest. */
+gboolean
+validation_cache_lookup (ValidationCache *cache, ValidationCacheRecord *record)
+{
+  guint32 lo = 0, hi = cache->n_records;
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      const ValidationCacheRecord *cached = &cache->records[mid];
+
+      int cmp = record_cmp (record, cached);
+      if (cmp == 0)
+        {
+          /* Everything but the digest must match */
+          if (memcmp (cached, record, G_STRUCT_OFFSET (ValidationCacheRecord, digest)) != 0)
+            break;
+
+          *record = *cached;
+          g_atomic_int_inc (&cache->hits);
+
+          g_mutex_lock (&cache->lock);
+          g_array_append_val (cache->kept, *record);
+          g_mutex_unlock (&cache->lock);
+          return TRUE;
+        }
+      else if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  g_atomic_int_inc (&cache->misses);
+  return FALSE;
+}
+
+/* Records that the file of a missed lookup was validated */
+void
+validation_cache_add (ValidationCache *cache, ValidationCacheRecord *record,
+                      const guchar *digest, gsize digest_len)
+{
+  g_assert (digest_len == sizeof (record->digest));
+  memmove (record->digest, digest, digest_len);
+
+  g_mutex_lock (&cache->lock);
+  g_array_append_val (cache->kept, *record);
+  g_mutex_unlock (&cache->lock);
+}
+
+/* Returns TRUE if the tree was last installed with the same roots */
+gboolean
+validation_cache_lookup_tree (ValidationCache *cache, const ValidationCacheTree *tree)
+{
+  if (!has_tree (cache, tree))
+    return FALSE;
+
+  g_mutex_lock (&cache->lock);
+  g_array_append_val (cache->kept_trees, *tree);
+  g_mutex_unlock (&cache->lock);
+  return TRUE;
+}
+
+/* Records that the tree was installed */
+void
+validation_cache_add_tree (ValidationCache *cache, const ValidationCacheTree *tree)
+{
+  g_mutex_lock (&cache->lock);
+  g_array_append_val (cache->kept_trees, *tree);
+  g_mutex_unlock (&cache->lock);
+}
+
+void
+validation_cache_get_stats (ValidationCache *cache, guint *hits_out, guint *misses_out)
+{
+  *hits_out = g_atomic_int_get (&cache->hits);
+  *misses_out = g_atomic_int_get (&cache->misses);
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <sys/stat.h>
+
+/* The validation cache remembers which regular files were validated, so
+ * that unchanged files don't have to be read, hashed and verified again.
+ *
+ * A file is identified by its device and inode, and considered unchanged
+ * if its size, mtime and ctime are the same. A result only applies to the
+ * same signature, relative path and set of trusted keys, which are hashed
+ * together into the record.
+ *
+ * It also remembers the roots of whole trees that were installed (see
+ * install.c), by an id for the source, destination and options.
+ *
+ * Only the records used or added by the last run are kept, so the files
+ * of a tree that was skipped as a whole have to be hashed again the next
+ * time it changes.
+ *
+ * The file is VALIDATOR_CACHE_MAGIC, the number and size of the file
+ * records and of the tree records, followed by the file records sorted by
+ * device and inode, the tree records sorted by id, and finally an
+ * HMAC-SHA256 of all that with the cache key. A cache that fails the HMAC
+ * check is ignored. Integers are in host byte order, as a cache is never
+ * moved to another machine. */
+
+#define VALIDATOR_CACHE_MAGIC "VALIDCA\002"
+#define VALIDATOR_CACHE_MAGIC_LEN 8
+
+typedef struct
+{
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+  gint64 mtime_sec;
+  gint64 ctime_sec;
+  guint32 mtime_nsec;
+  guint32 ctime_nsec;
+  /* sha256 of the key set fingerprint, relative path and signature */
+  guchar signature_hash[32];
+  /* The validated sha512 of the content */
+  guchar digest[64];
+} ValidationCacheRecord;
+
+typedef struct
+{
+  guchar id[32];
+  guchar source_root[32];
+  guchar destination_root[32];
+} ValidationCacheTree;
+
+typedef struct _ValidationCache ValidationCache;
+
+ValidationCache *validation_cache_load (const char *path, const char *key_path,
+                                        gboolean create_key, GError **error);
+gboolean validation_cache_save (ValidationCache *cache, gboolean add_trees, GError **error);
+void validation_cache_free (ValidationCache *cache);
+void validation_cache_record_init (ValidationCacheRecord *record, const struct stat *st,
+                                   KeySet *keys, const char *rel_path, const char *signature,
+                                   gsize signature_len);
+gboolean validation_cache_lookup (ValidationCache *cache, ValidationCacheRecord *record);
+void validation_cache_add (ValidationCache *cache, ValidationCacheRecord *record,
+                           const guchar *digest, gsize digest_len);
+gboolean validation_cache_lookup_tree (ValidationCache *cache, const ValidationCacheTree *tree);
+void validation_cache_add_tree (ValidationCache *cache, const ValidationCacheTree *tree);
+void validation_cache_get_stats (ValidationCache *cache, guint *hits_out, guint *misses_out);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ValidationCache, validation_cache_free)
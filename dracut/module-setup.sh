@@ -36,6 +36,12 @@ install() {
     for r in /usr/lib /etc; do
         inst_multiple -o "$r/validator/boot.d/*.conf" "$r/validator/keys/*"
     done
+    # Configs are compiled in the same order as the service reads them
+    mkdir -p "${initdir}/usr/lib/validator"
+    if ! /usr/bin/validator compile-plan --config-dir=/etc/validator/boot.d \
+         --config-dir=/usr/lib/validator/boot.d "${initdir}/usr/lib/validator/boot.plan"; then
+        dwarn "validator: Can't compile boot plan, config files will be used at boot"
+    fi
     inst_simple "${moddir}/validator-boot.service" "${systemdsystemunitdir}/validator-boot.service"
     $SYSTEMCTL -q --root "$initdir" add-wants initrd.target validator-boot.service
 }
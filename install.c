@@ -21,7 +21,14 @@
 #include "config.h"
 #include "main.h"
 
+#include "jobs.h"
+#include "manifest.h"
+#include "plan.h"
+#include "probes.h"
+#include "walk.h"
+
 #include <fcntl.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
 typedef struct
@@ -30,95 +37,455 @@ typedef struct
   gboolean force;
   char *path_relative;
   char *path_prefix;
-  GList *public_keys;
+  KeySet *public_keys; /* Loaded from keys and key_dirs when first needed */
+  char **keys;
+  char **key_dirs;
+  char *manifest_path;
+  /* Only set while installing */
+  Verifier *verifier;
+  Manifest *manifest;
+  Schedule *schedule;
 } InstallOptions;
 
+/* Number of files copied with each CopyMethod */
+static gint copy_method_counts[N_COPY_METHODS];
+
+static void
+count_copy (const char *destination_file, CopyMethod method)
+{
+  g_atomic_int_inc (&copy_method_counts[method]);
+  g_debug ("Copied '%s' using %s", destination_file, copy_method_to_string (method));
+}
+
+/* Number of files installed, and of existing files left as they were */
+static gint installed_count;
+
+/* Mode of installed regular files, before the umask */
+#define INSTALLED_FILE_MODE 0644
+
+/* Installed regular files are tagged with the digest they were validated
+ * for, and the key that signed it. Anyone who can write the file can
+ * change its data without touching the xattr, and restore the mtime
+ * afterwards, so the xattr can only tell that a file differs from what
+ * is about to be installed. A match is always confirmed by hashing the
+ * file. Only privileged processes can set trusted xattrs. */
+#define INSTALLED_XATTR "trusted.validator.installed"
+
+typedef struct
+{
+  guchar digest[64];
+  /* All zeros if not known */
+  guchar key_id[VALIDATOR_KEY_ID_LEN];
+} InstalledXattr;
+
+/* Errors are ignored, as the xattr is only an optimization and not all
+ * filesystems or users can set it */
+static void
+set_installed_xattr (int fd, const char *path, const guchar *digest, const guchar *key_id)
+{
+  InstalledXattr xattr = { { 0 } };
+  memcpy (xattr.digest, digest, sizeof (xattr.digest));
+  if (key_id)
+    memcpy (xattr.key_id, key_id, sizeof (xattr.key_id));
+
+  if (fsetxattr (fd, INSTALLED_XATTR, &xattr, sizeof (xattr), 0) < 0)
+    g_debug ("Can't set %s on '%s': %s", INSTALLED_XATTR, path, strerror (errno));
+}
+
+/* Gets the key that the last file was validated with, all zeros if
+ * unknown. With a manifest that is the key that signed the manifest. */
+static void
+get_signed_by (InstallOptions *opt, guchar *key_id_out)
+{
+  if (!verifier_get_signed_by (opt->verifier, key_id_out))
+    memset (key_id_out, 0, VALIDATOR_KEY_ID_LEN);
+}
+
+/* Opens destination_file if it is a regular file with no more
+ * permissions or another owner than installing it would give it, which
+ * is the only kind of file that can be left in place. Returns -1
+ * otherwise. */
+static int
+open_destination (const char *destination_file)
+{
+  autofd int fd = open (destination_file, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))
+    return -1;
+
+  if ((st.st_mode & 07777 & ~INSTALLED_FILE_MODE) != 0 || st.st_uid != geteuid ()
+      || st.st_gid != getegid ())
+    return -1;
+
+  return steal_fd (&fd);
+}
+
+/* Checks if fd, from open_destination(), has the sha512 digest. Files
+ * whose xattr has another digest are known to differ without reading
+ * them. */
+static gboolean
+destination_has_digest (int fd, const char *destination_file, const guchar *digest,
+                        const guchar *key_id)
+{
+  InstalledXattr xattr;
+  gboolean tagged = fgetxattr (fd, INSTALLED_XATTR, &xattr, sizeof (xattr)) == sizeof (xattr);
+  if (tagged && memcmp (xattr.digest, digest, sizeof (xattr.digest)) != 0)
+    return FALSE;
+
+  gsize digest_len = 0;
+  g_autofree guchar *destination_digest
+      = (guchar *)sha512_fd (fd, -1, SHA512_FD_NONE, destination_file, &digest_len, NULL);
+  if (destination_digest == NULL || memcmp (destination_digest, digest, digest_len) != 0)
+    return FALSE;
+
+  /* So that a new version of the source is noticed without reading this */
+  if (!tagged)
+    set_installed_xattr (fd, destination_file, digest, key_id);
+  return TRUE;
+}
+
+/* Checks if the existing destination_file already is what would be
+ * installed, with content and type as validated. For regular files
+ * destination_fd is from open_destination(). */
+static gboolean
+destination_is_unchanged (const char *destination_file, int destination_fd, int type,
+                          const guchar *content, gsize content_len, const guchar *key_id)
+{
+  if (type == S_IFLNK)
+    {
+      g_autofree char *target = g_file_read_link (destination_file, NULL);
+      return target != NULL && strlen (target) == content_len
+             && memcmp (target, content, content_len) == 0;
+    }
+
+  return destination_fd >= 0
+         && destination_has_digest (destination_fd, destination_file, content, key_id);
+}
+
+/* Checks the loaded file against the manifest if there is one, and
+ * otherwise against its signature */
+static gboolean
+check_file (InstallOptions *opt, const char *rel_path, int type, const guchar *content,
+            gsize content_len, const char *signature, gsize signature_len, GError **error)
+{
+  if (opt->manifest)
+    return manifest_check (opt->manifest, rel_path, type, content, content_len, error);
+
+  return verifier_verify (opt->verifier, rel_path, type, content, content_len, signature,
+                          signature_len, error);
+}
+
+/* Files with fs-verity enabled can be checked against the digest the
+ * kernel keeps for them, without reading them. Returns FALSE if fd
+ * doesn't have fs-verity, or isn't signed for its fs-verity digest. */
 static gboolean
-replace_file (const char *destination_file, int content_fd, GError **error)
+check_file_verity (InstallOptions *opt, int fd, const char *path, const char *rel_path,
+                   const char *signature, gsize signature_len)
+{
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+  if (!get_verity_digest (path, fd, &content, &content_len, NULL))
+    return FALSE;
+
+  if (!check_file (opt, rel_path, VALIDATOR_TYPE_VERITY, content, content_len, signature,
+                   signature_len, NULL))
+    {
+      g_debug ("%s is not signed for its fs-verity digest", path);
+      return FALSE;
+    }
+
+  g_debug ("%s is valid (as %s, fs-verity)", path, rel_path);
+  return TRUE;
+}
+
+static int
+open_tmp_file (const char *destination_file, char **tmp_path_out, GError **error)
 {
   g_autofree gchar *destination_file_tmp = g_strdup_printf ("%s.XXXXXX", destination_file);
 
   errno = 0;
-  autofd int tmp_fd = g_mkstemp_full (destination_file_tmp, O_RDWR, 0644);
+  int tmp_fd = g_mkstemp_full (destination_file_tmp, O_RDWR, INSTALLED_FILE_MODE);
   if (tmp_fd == -1)
     {
       g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
                    "Can't open tempfile for '%s': %s\n", destination_file, strerror (errno));
+      return -1;
+    }
+
+  *tmp_path_out = g_steal_pointer (&destination_file_tmp);
+  return tmp_fd;
+}
+
+static gboolean
+commit_tmp_file (const char *tmp_path, const char *destination_file, GError **error)
+{
+  int res = rename (tmp_path, destination_file);
+  if (res < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't create '%s': %s\n",
+                   destination_file, strerror (errno));
+      (void)unlink (tmp_path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* The size of content_fd is only used for probes */
+static gboolean
+replace_file (const char *destination_file, int content_fd, guint64 size, GError **error)
+{
+  PROBE2 (replace_file__start, destination_file, size);
+
+  g_autofree gchar *destination_file_tmp = NULL;
+  autofd int tmp_fd = open_tmp_file (destination_file, &destination_file_tmp, error);
+  if (tmp_fd == -1)
+    {
+      PROBE3 (replace_file__done, destination_file, (guint64)0, FALSE);
       return FALSE;
     }
 
-  int res = copy_fd (content_fd, tmp_fd);
+  CopyMethod method;
+  int res = copy_fd (content_fd, tmp_fd, &method);
   if (res < 0)
     {
       g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
                    "Can't write to '%s': %s\n", destination_file_tmp, strerror (errno));
       (void)unlink (destination_file_tmp);
+      PROBE3 (replace_file__done, destination_file, (guint64)0, FALSE);
       return FALSE;
     }
+  count_copy (destination_file, method);
+  drop_page_cache (content_fd, 0, 0);
 
-  res = rename (destination_file_tmp, destination_file);
-  if (res < 0)
+  gboolean ok = commit_tmp_file (destination_file_tmp, destination_file, error);
+  PROBE3 (replace_file__done, destination_file, size, ok);
+  return ok;
+}
+
+/* Installs a regular file by copying it to a tempfile next to the
+ * destination while hashing it, and only renaming it into place once the
+ * signature of the computed digest is validated. This reads the source
+ * only once, and guarantees that the installed data is exactly what was
+ * validated. The destination directory must already exist. */
+static gboolean
+install_file_single_pass (InstallOptions *opt, int dirfd, const char *name, const char *path,
+                          const char *rel_path, char *signature, gsize signature_len,
+                          const char *destination_file, ValidationCacheRecord *cache_record)
+{
+  g_autoptr (GError) error = NULL;
+  gboolean has_verity = FALSE;
+  guint64 size = 0;
+  autofd int content_fd = open_regular_at (dirfd, name, path, &has_verity, &size, &error);
+  if (content_fd < 0)
     {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't create '%s': %s\n",
-                   destination_file, strerror (errno));
-      (void)unlink (destination_file_tmp);
+      g_printerr ("Failed to load '%s': %s\n", path, error->message);
+      return FALSE;
+    }
+
+  /* The data of files with fs-verity can't change, and the kernel checks
+   * it as it is read, so it can be validated up front and then copied */
+  if (has_verity && check_file_verity (opt, content_fd, path, rel_path, signature, signature_len))
+    {
+      gint64 start_time = stats_phase_start ();
+      if (!replace_file (destination_file, content_fd, size, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          return FALSE;
+        }
+      stats_phase_end (STATS_PHASE_REPLACE_FILE, start_time);
+      return TRUE;
+    }
+
+  g_autofree char *tmp_path = NULL;
+  autofd int tmp_fd = open_tmp_file (destination_file, &tmp_path, &error);
+  if (tmp_fd == -1)
+    {
+      g_printerr ("%s\n", error->message);
+      return FALSE;
+    }
+
+  /* If the file can be reflinked we hash the clone instead, which is
+   * still a single read of data that is exactly what gets installed. */
+  CopyMethod method = COPY_METHOD_READ_WRITE;
+  if (copy_fd_with_methods (content_fd, tmp_fd, 1 << COPY_METHOD_REFLINK, &method) < 0)
+    method = COPY_METHOD_READ_WRITE;
+
+  gsize digest_len = 0;
+  g_autofree guchar *digest = NULL;
+  /* Only the source pages are dropped, what we just installed is likely
+   * to be used soon */
+  if (method == COPY_METHOD_REFLINK)
+    digest = (guchar *)sha512_fd (tmp_fd, -1, SHA512_FD_NONE, path, &digest_len, &error);
+  else
+    digest = (guchar *)sha512_fd (content_fd, tmp_fd, SHA512_FD_DROP_CACHE, path, &digest_len,
+                                  &error);
+  if (digest == NULL)
+    {
+      g_printerr ("Failed to load '%s': %s\n", path, error->message);
+      (void)unlink (tmp_path);
+      return FALSE;
+    }
+
+  g_autoptr (GError) validate_error = NULL;
+  if (!check_file (opt, rel_path, S_IFREG, digest, digest_len, signature, signature_len,
+                   &validate_error))
+    {
+      if (validate_error)
+        g_printerr ("Signature of '%s' (as '%s') is invalid: %s\n", path, rel_path,
+                    validate_error->message);
+      else
+        g_printerr ("Signature of '%s' (as '%s') is invalid\n", path, rel_path);
+      (void)unlink (tmp_path);
+      return FALSE;
+    }
+
+  if (cache_record)
+    validation_cache_add (opt_validation_cache, cache_record, digest, digest_len);
+
+  guchar key_id[VALIDATOR_KEY_ID_LEN];
+  get_signed_by (opt, key_id);
+
+  /* The copy was made while hashing, what is left is putting it in place */
+  gint64 start_time = stats_phase_start ();
+  PROBE2 (replace_file__start, destination_file, size);
+  set_installed_xattr (tmp_fd, tmp_path, digest, key_id);
+
+  gboolean committed = commit_tmp_file (tmp_path, destination_file, &error);
+  PROBE3 (replace_file__done, destination_file, size, committed);
+  if (!committed)
+    {
+      g_printerr ("%s\n", error->message);
       return FALSE;
     }
+  stats_phase_end (STATS_PHASE_REPLACE_FILE, start_time);
+
+  count_copy (destination_file, method);
 
   return TRUE;
 }
 
+/* Installs the regular file or symlink name in parent, which is found at
+ * path, into destination_dir, as for install() */
 static gboolean
-install (InstallOptions *opt, const char *path, const char *relative_to,
-         const char *destination_dir, gboolean toplevel)
+install_file (InstallOptions *opt, WalkDir *parent, const char *name, const char *path, int type,
+              const char *rel_path, gboolean has_sig, const char *destination_dir)
 {
-  struct stat st;
-  gboolean success = TRUE;
+  int dirfd = walk_dir_get_fd (parent);
+  int res;
 
-  int res = lstat (path, &st);
-  if (res < 0)
+  stats_add (STATS_FILES, 1);
+
+  g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+  g_autofree char *sig_name = g_strconcat (name, ".sig", NULL);
+
+  char signature[VALIDATOR_MAX_SIGNATURE_SIZE];
+  gsize signature_len = 0;
+
+  g_autoptr (GError) error = NULL;
+  if (opt->manifest == NULL
+      && (!has_sig
+          || !load_signature_at (dirfd, sig_name, signature, sizeof (signature),
+                                 &signature_len, &error)))
     {
-      g_printerr ("Can't access '%s': %s\n", path, strerror (errno));
+      if (error == NULL || g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_printerr ("No signature for '%s'\n", path);
+      else
+        g_printerr ("Failed to load '%s': %s\n", sig_path, error->message);
       return FALSE;
     }
 
-  int type = st.st_mode & S_IFMT;
-  if (type == S_IFREG || type == S_IFLNK)
+  if (rel_path == NULL)
     {
-      g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+      g_printerr ("File '%s' not inside relative dir\n", path);
+      return FALSE;
+    }
 
-      g_autofree char *signature = NULL;
-      gsize signature_len = 0;
+  g_autofree char *basename = g_path_get_basename (path);
+  g_autofree char *destination_file = g_build_filename (destination_dir, basename, NULL);
 
-      g_autoptr (GError) error = NULL;
-      if (!g_file_get_contents (sig_path, &signature, &signature_len, &error))
+  ValidationCacheRecord cache_record;
+  gboolean use_cache = opt_validation_cache && opt->manifest == NULL && type == S_IFREG;
+  if (use_cache)
+    {
+      struct stat st;
+      if (fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
         {
-          if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-            g_printerr ("No signature for '%s'\n", path);
-          else
-            g_printerr ("Failed to load '%s': %s\n", sig_path, error->message);
+          g_printerr ("Can't access '%s': %s\n", path, strerror (errno));
           return FALSE;
         }
+      validation_cache_record_init (&cache_record, &st, opt->public_keys, rel_path, signature,
+                                    signature_len);
+    }
+
+  gboolean exists = g_file_test (destination_file, G_FILE_TEST_EXISTS);
 
-      g_autofree guchar *content = NULL;
-      gsize content_len = 0;
-      autofd int content_fd = -1;
-      if (!load_file_data_for_sign (path, &st, NULL, &content, &content_len, &content_fd, &error))
+  /* Regular files are copied while they are validated, so that what is
+   * installed is exactly what was validated. An existing file is
+   * validated first, as it is likely unchanged, and so is one in a
+   * directory that we are not yet allowed to create. */
+  gboolean single_pass
+      = type == S_IFREG && !exists && g_file_test (destination_dir, G_FILE_TEST_IS_DIR);
+
+  /* The data is only needed for installing, which the cache can't
+   * vouch for */
+  gboolean cache_record_kept = FALSE;
+  if (exists && use_cache && validation_cache_lookup (opt_validation_cache, &cache_record))
+    {
+      cache_record_kept = TRUE;
+      if (!opt->force)
         {
-          g_printerr ("Failed to load '%s': %s\n", path, error->message);
-          return FALSE;
+          g_info ("File '%s' already exist, ignoring (source cached as valid)",
+                  destination_file);
+          stats_add (STATS_SKIPPED, 1);
+          return TRUE;
         }
 
-      g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt->path_prefix);
-      if (rel_path == NULL)
+      autofd int fd = open_destination (destination_file);
+      if (fd >= 0 && destination_has_digest (fd, destination_file, cache_record.digest, NULL))
         {
-          g_printerr ("File '%s' not inside relative dir\n", path);
+          g_info ("File '%s' is unchanged, ignoring (source cached as valid)",
+                  destination_file);
+          stats_add (STATS_SKIPPED, 1);
+          return TRUE;
+        }
+      single_pass = TRUE;
+    }
+
+  /* A forced install over a file that can't be left in place has
+   * nothing to compare the source with */
+  autofd int destination_fd = -1;
+  if (type == S_IFREG && exists && opt->force && !single_pass)
+    {
+      destination_fd = open_destination (destination_file);
+      single_pass = destination_fd < 0;
+    }
+
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+  autofd int content_fd = -1;
+  gboolean verity_valid = FALSE;
+  if (!single_pass && type == S_IFREG && file_has_verity (dirfd, name))
+    {
+      content_fd = open_regular_at (dirfd, name, path, NULL, NULL, NULL);
+      if (content_fd >= 0)
+        verity_valid
+            = check_file_verity (opt, content_fd, path, rel_path, signature, signature_len);
+    }
+
+  if (!single_pass && !verity_valid)
+    {
+      close_fd (&content_fd);
+      if (!load_file_data_for_sign_at (dirfd, name, path, type, &content, &content_len, NULL,
+                                       &error))
+        {
+          g_printerr ("Failed to load '%s': %s\n", path, error->message);
           return FALSE;
         }
 
       g_autoptr (GError) validate_error = NULL;
-      if (!validate_data (rel_path, type, content, content_len, signature, signature_len,
-                          opt->public_keys, &validate_error))
+      if (!check_file (opt, rel_path, type, content, content_len, signature, signature_len,
+                       &validate_error))
         {
           if (validate_error)
             g_printerr ("Signature of '%s' (as '%s') is invalid: %s\n", path, rel_path,
@@ -128,50 +495,159 @@ install (InstallOptions *opt, const char *path, const char *relative_to,
           return FALSE;
         }
 
-      g_autofree char *basename = g_path_get_basename (path);
-      g_autofree char *destination_file = g_build_filename (destination_dir, basename, NULL);
+      if (use_cache)
+        {
+          validation_cache_add (opt_validation_cache, &cache_record, content, content_len);
+          cache_record_kept = TRUE;
+        }
+    }
 
-      if (!opt->force && g_file_test (destination_file, G_FILE_TEST_EXISTS))
+  if (!single_pass)
+    {
+      guchar key_id[VALIDATOR_KEY_ID_LEN];
+      get_signed_by (opt, key_id);
+
+      if (exists && !opt->force)
         {
           g_info ("File '%s' already exist, ignoring", destination_file);
+          stats_add (STATS_SKIPPED, 1);
           return TRUE;
         }
 
+      if (exists && !verity_valid
+          && destination_is_unchanged (destination_file, destination_fd, type, content,
+                                       content_len, key_id))
+        {
+          g_info ("File '%s' is unchanged, ignoring", destination_file);
+          stats_add (STATS_SKIPPED, 1);
+          return TRUE;
+        }
+      close_fd (&destination_fd);
+
+      gint64 start_time = stats_phase_start ();
       if (g_mkdir_with_parents (destination_dir, 0755) < 0)
         {
           g_printerr ("Unable to create dir '%s': %s", destination_file, strerror (errno));
           return FALSE;
         }
+      stats_phase_end (STATS_PHASE_MKDIR, start_time);
+    }
 
-      if (type == S_IFLNK)
+  if (type == S_IFLNK)
+    {
+      gint64 start_time = stats_phase_start ();
+      res = unlink (destination_file);
+      if (res < 0 && errno != ENOENT)
         {
-          res = unlink (destination_file);
-          if (res < 0 && errno != ENOENT)
-            {
-              g_printerr ("Can't remove old symlink '%s': %s\n", destination_file,
-                          strerror (errno));
-              return FALSE;
-            }
-          res = symlink ((char *)content, destination_file);
-          if (res < 0)
-            {
-              g_printerr ("Can't create symlink '%s': %s\n", destination_file, strerror (errno));
-              return FALSE;
-            }
+          g_printerr ("Can't remove old symlink '%s': %s\n", destination_file,
+                      strerror (errno));
+          return FALSE;
         }
-      else
+      res = symlink ((char *)content, destination_file);
+      if (res < 0)
         {
-          g_assert (content_fd != -1);
-
-          g_autoptr (GError) replace_error = NULL;
-          if (!replace_file (destination_file, content_fd, &replace_error))
-            {
-              g_printerr ("%s\n", replace_error->message);
-              return FALSE;
-            }
+          g_printerr ("Can't create symlink '%s': %s\n", destination_file, strerror (errno));
+          return FALSE;
+        }
+      stats_phase_end (STATS_PHASE_REPLACE_FILE, start_time);
+    }
+  else if (verity_valid)
+    {
+      /* The kernel checks the data against the fs-verity digest that was
+       * validated as it is copied */
+      gint64 start_time = stats_phase_start ();
+      g_autoptr (GError) replace_error = NULL;
+      guint64 size = 0;
+      if (PROBE_ENABLED (replace_file__start) || PROBE_ENABLED (replace_file__done))
+        size = probe_file_size (dirfd, name);
+      if (!replace_file (destination_file, content_fd, size, &replace_error))
+        {
+          g_printerr ("%s\n", replace_error->message);
+          return FALSE;
         }
+      stats_phase_end (STATS_PHASE_REPLACE_FILE, start_time);
+    }
+  else
+    {
+      /* Whatever was validated above, the source is validated again as
+       * it is copied, as it may have changed since */
+      if (!install_file_single_pass (opt, dirfd, name, path, rel_path, signature, signature_len,
+                                     destination_file,
+                                     use_cache && !cache_record_kept ? &cache_record : NULL))
+        return FALSE;
+    }
+
+  g_info ("Installed file '%s'", destination_file);
+  g_atomic_int_inc (&installed_count);
+  return TRUE;
+}
+
+typedef struct
+{
+  char *rel_path;
+  gboolean has_sig;
+  char *destination_dir;
+} InstallJob;
+
+static void
+install_job_free (InstallJob *job)
+{
+  g_free (job->rel_path);
+  g_free (job->destination_dir);
+  g_free (job);
+}
+
+static gboolean
+install_scheduled (WalkDir *dir, const char *name, const char *path, gpointer data,
+                   gpointer user_data)
+{
+  InstallOptions *opt = user_data;
+  InstallJob *job = data;
+
+  PROBE2 (file__start, path, PROBE_FILE_SIZE (file__start, walk_dir_get_fd (dir), name));
+  gboolean res = install_file (opt, dir, name, path, S_IFREG, job->rel_path, job->has_sig,
+                               job->destination_dir);
+  PROBE2 (file__done, path, res);
+  install_job_free (job);
+  return res;
+}
 
-      g_info ("Installed file '%s'", destination_file);
+/* Installs name in parent, which is found at path, into destination_dir.
+ * type is 0 if not yet known, and ino is as from readdir. rel_path is the
+ * relative path it is validated as, or NULL if it is not inside
+ * relative_to (which a child still might be). has_sig is FALSE if it is
+ * known to have no signature file. With a schedule, regular files are
+ * collected on it to be installed later. */
+static gboolean
+install (InstallOptions *opt, WalkDir *parent, const char *name, const char *path, int type,
+         guint64 ino, const char *rel_path, gboolean has_sig, const char *relative_to,
+         const char *destination_dir, gboolean toplevel)
+{
+  gboolean success = TRUE;
+
+  g_autoptr (GError) type_error = NULL;
+  if (!walk_get_type (parent, name, path, &type, &type_error))
+    {
+      g_printerr ("%s\n", type_error->message);
+      return FALSE;
+    }
+
+  if (type == S_IFREG && opt->schedule && !toplevel)
+    {
+      InstallJob *job = g_new0 (InstallJob, 1);
+      job->rel_path = g_strdup (rel_path);
+      job->has_sig = has_sig;
+      job->destination_dir = g_strdup (destination_dir);
+      schedule_add (opt->schedule, parent, name, path, ino, job);
+    }
+  else if (type == S_IFREG || type == S_IFLNK)
+    {
+      PROBE2 (file__start, path, PROBE_FILE_SIZE (file__start, walk_dir_get_fd (parent), name));
+      gboolean installed
+          = install_file (opt, parent, name, path, type, rel_path, has_sig, destination_dir);
+      PROBE2 (file__done, path, installed);
+      if (!installed)
+        return FALSE;
     }
   else if (type == S_IFDIR)
     {
@@ -181,13 +657,13 @@ install (InstallOptions *opt, const char *path, const char *relative_to,
        * without validation. */
 
       g_autoptr (GError) dir_error = NULL;
-      g_autoptr (GDir) dir = g_dir_open (path, 0, &dir_error);
+      g_autoptr (WalkDir) dir = walk_dir_open (parent, name, path, &dir_error);
       if (dir == NULL)
         {
           if (g_error_matches (dir_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
             return TRUE;
 
-          g_printerr ("Failed to open dir '%s': %s\n", path, strerror (errno));
+          g_printerr ("%s\n", dir_error->message);
           return FALSE;
         }
 
@@ -195,14 +671,25 @@ install (InstallOptions *opt, const char *path, const char *relative_to,
       g_autofree char *destination_subdir
           = g_build_filename (destination_dir, toplevel ? NULL : basename, NULL);
 
-      const char *child;
-      while ((child = g_dir_read_name (dir)) != NULL)
+      g_autoptr (WalkEntries) entries = walk_dir_read_entries (dir, &dir_error);
+      if (entries == NULL)
         {
-          if (g_str_has_suffix (child, ".sig"))
-            continue; /* Skip existing signatures */
+          g_printerr ("%s\n", dir_error->message);
+          return FALSE;
+        }
 
-          g_autofree char *child_path = g_build_filename (path, child, NULL);
-          if (!install (opt, child_path, relative_to, destination_subdir, FALSE))
+      for (gsize i = 0; i < entries->n_entries; i++)
+        {
+          WalkEntry *child = &entries->entries[i];
+          g_autofree char *child_path = walk_child_path (path, child->name);
+          if (g_strcmp0 (child_path, opt->manifest_path) == 0)
+            continue;
+
+          g_autofree char *child_rel_path
+              = rel_path ? walk_child_path (rel_path, child->name)
+                         : opt_get_relative_path (child_path, relative_to, opt->path_prefix);
+          if (!install (opt, dir, child->name, child_path, child->type, child->ino,
+                        child_rel_path, child->has_sig, relative_to, destination_subdir, FALSE))
             success = FALSE;
         }
     }
@@ -215,9 +702,268 @@ install (InstallOptions *opt, const char *path, const char *relative_to,
   return success;
 }
 
+/* Installs the toplevel path, with relative paths relative to
+ * relative_to */
+static gboolean
+install_toplevel (InstallOptions *opt, const char *path, const char *relative_to,
+                  const char *destination_dir)
+{
+  g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt->path_prefix);
+  gboolean res
+      = install (opt, NULL, path, path, 0, 0, rel_path, TRUE, relative_to, destination_dir, TRUE);
+  if (opt->schedule && !schedule_flush (opt->schedule))
+    res = FALSE;
+  return res;
+}
+
+/* What identifies the state of a directory entry in the tree roots */
+typedef struct
+{
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+  gint64 mtime_sec;
+  gint64 ctime_sec;
+  guint32 mtime_nsec;
+  guint32 ctime_nsec;
+  guint32 mode;
+  guint32 exists;
+} TreeStat;
+
+/* st is NULL for entries that don't exist */
+static void
+hash_tree_stat (EVP_MD_CTX *ctx, const char *name, const struct stat *st)
+{
+  TreeStat tree_stat = { 0 };
+  if (st)
+    {
+      tree_stat.dev = st->st_dev;
+      tree_stat.ino = st->st_ino;
+      tree_stat.size = st->st_size;
+      tree_stat.mtime_sec = st->st_mtim.tv_sec;
+      tree_stat.mtime_nsec = st->st_mtim.tv_nsec;
+      tree_stat.ctime_sec = st->st_ctim.tv_sec;
+      tree_stat.ctime_nsec = st->st_ctim.tv_nsec;
+      tree_stat.mode = st->st_mode;
+      tree_stat.exists = 1;
+    }
+
+  if (EVP_DigestUpdate (ctx, name, strlen (name) + 1) != 1
+      || EVP_DigestUpdate (ctx, &tree_stat, sizeof (tree_stat)) != 1)
+    oom ();
+}
+
+static gboolean
+lstat_optional (const char *path, struct stat *st, gboolean *exists_out)
+{
+  *exists_out = lstat (path, st) == 0;
+  return *exists_out || errno == ENOENT;
+}
+
+static gint
+cmp_names (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
+/* Hashes the names and stat of everything in the source directory path
+ * into source_root, and the stat of where its files are installed into
+ * destination_root. Subdirectories are hashed the same way and their
+ * roots included in those of their parent, Merkle style. Nothing but
+ * directories is opened. */
+static gboolean
+hash_tree (WalkDir *parent, const char *name, const char *path, const char *destination_dir,
+           guchar *source_root, guchar *destination_root)
+{
+  g_autoptr (WalkDir) dir = walk_dir_open (parent, name, path, NULL);
+  if (dir == NULL)
+    return FALSE;
+
+  g_autoptr (GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GError) error = NULL;
+  const char *child;
+  int child_type;
+  while (walk_dir_next (dir, &child, &child_type, NULL, &error))
+    g_ptr_array_add (names, g_strdup (child));
+  if (error)
+    return FALSE;
+  g_ptr_array_sort (names, cmp_names);
+
+  g_autoptr (EVP_MD_CTX) source_ctx = EVP_MD_CTX_new ();
+  g_autoptr (EVP_MD_CTX) destination_ctx = EVP_MD_CTX_new ();
+  if (source_ctx == NULL || destination_ctx == NULL
+      || EVP_DigestInit_ex (source_ctx, EVP_sha256 (), NULL) != 1
+      || EVP_DigestInit_ex (destination_ctx, EVP_sha256 (), NULL) != 1)
+    oom ();
+
+  for (guint i = 0; i < names->len; i++)
+    {
+      const char *child_name = g_ptr_array_index (names, i);
+      g_autofree char *destination_path = g_build_filename (destination_dir, child_name, NULL);
+
+      struct stat st;
+      if (fstatat (walk_dir_get_fd (dir), child_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return FALSE;
+      hash_tree_stat (source_ctx, child_name, &st);
+
+      if (S_ISDIR (st.st_mode))
+        {
+          g_autofree char *child_path = walk_child_path (path, child_name);
+          guchar child_source_root[32], child_destination_root[32];
+          if (!hash_tree (dir, child_name, child_path, destination_path, child_source_root,
+                          child_destination_root))
+            return FALSE;
+
+          if (EVP_DigestUpdate (source_ctx, child_source_root, 32) != 1
+              || EVP_DigestUpdate (destination_ctx, child_name, strlen (child_name) + 1) != 1
+              || EVP_DigestUpdate (destination_ctx, child_destination_root, 32) != 1)
+            oom ();
+        }
+      else if (!g_str_has_suffix (child_name, ".sig"))
+        {
+          gboolean exists;
+          if (!lstat_optional (destination_path, &st, &exists))
+            return FALSE;
+          hash_tree_stat (destination_ctx, child_name, exists ? &st : NULL);
+        }
+    }
+
+  if (EVP_DigestFinal_ex (source_ctx, source_root, NULL) != 1
+      || EVP_DigestFinal_ex (destination_ctx, destination_root, NULL) != 1)
+    oom ();
+
+  return TRUE;
+}
+
+static void
+hash_string (EVP_MD_CTX *ctx, const char *str)
+{
+  if (EVP_DigestUpdate (ctx, str ? str : "", str ? strlen (str) + 1 : 1) != 1)
+    oom ();
+}
+
+/* Computes the id and roots of installing the source directory path to
+ * destination. The id covers everything else that affects the outcome:
+ * the options, the keys and the manifest. Returns FALSE if the tree
+ * can't be hashed, in which case it is installed as usual. */
+static gboolean
+get_install_tree (InstallOptions *opt, const char *path, const char *destination,
+                  ValidationCacheTree *tree)
+{
+  g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
+  if (ctx == NULL || EVP_DigestInit_ex (ctx, EVP_sha256 (), NULL) != 1
+      || EVP_DigestUpdate (ctx, key_set_get_fingerprint (opt->public_keys),
+                           VALIDATOR_KEY_ID_LEN)
+             != 1)
+    oom ();
+  hash_string (ctx, path);
+  hash_string (ctx, destination);
+  hash_string (ctx, opt->path_relative);
+  hash_string (ctx, opt->path_prefix);
+  hash_string (ctx, opt->force ? "force" : NULL);
+  hash_string (ctx, opt->manifest_path);
+
+  struct stat st;
+  if (lstat (path, &st) < 0)
+    return FALSE;
+  hash_tree_stat (ctx, ".", &st);
+
+  if (opt->manifest_path)
+    {
+      g_autofree char *sig_path = g_strconcat (opt->manifest_path, ".sig", NULL);
+      gboolean exists;
+      if (!lstat_optional (opt->manifest_path, &st, &exists))
+        return FALSE;
+      hash_tree_stat (ctx, opt->manifest_path, exists ? &st : NULL);
+      if (!lstat_optional (sig_path, &st, &exists))
+        return FALSE;
+      hash_tree_stat (ctx, sig_path, exists ? &st : NULL);
+    }
+
+  if (EVP_DigestFinal_ex (ctx, tree->id, NULL) != 1)
+    oom ();
+
+  return hash_tree (NULL, path, path, destination, tree->source_root, tree->destination_root);
+}
+
+/* Config files listing the same keys share one KeySet, so the keys are
+ * only looked up and indexed once */
+static GMutex config_key_sets_lock;
+static GHashTable *config_key_sets; /* Keys and key dirs, joined -> KeySet */
+
+static KeySet *
+get_config_key_set (const char **keys, const char **key_dirs)
+{
+  g_autoptr (GString) spec = g_string_new ("");
+  for (gsize i = 0; keys != NULL && keys[i] != NULL; i++)
+    g_string_append_printf (spec, "key=%s\n", keys[i]);
+  for (gsize i = 0; key_dirs != NULL && key_dirs[i] != NULL; i++)
+    g_string_append_printf (spec, "key_dir=%s\n", key_dirs[i]);
+
+  g_mutex_lock (&config_key_sets_lock);
+
+  if (config_key_sets == NULL)
+    config_key_sets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)key_set_unref);
+
+  KeySet *key_set = g_hash_table_lookup (config_key_sets, spec->str);
+  if (key_set == NULL)
+    {
+      key_set = read_public_keys (keys, key_dirs);
+      g_hash_table_insert (config_key_sets, g_strdup (spec->str), key_set);
+    }
+  key_set_ref (key_set);
+
+  g_mutex_unlock (&config_key_sets_lock);
+
+  return key_set;
+}
+
 static gboolean
 install_for_config (InstallOptions *opt, const char **sources, const char *destination)
 {
+  g_autoptr (GError) error = NULL;
+
+  /* Keys are only loaded if there is something to install */
+  gboolean any_source = FALSE;
+  for (gsize i = 0; sources[i] != NULL && !any_source; i++)
+    any_source = g_file_test (sources[i], G_FILE_TEST_EXISTS);
+  if (!any_source)
+    {
+      g_info ("No sources to install to '%s'", destination);
+      return TRUE;
+    }
+
+  if (opt->public_keys == NULL)
+    opt->public_keys
+        = get_config_key_set ((const char **)opt->keys, (const char **)opt->key_dirs);
+
+  g_autoptr (Verifier) verifier = verifier_new (opt->public_keys, &error);
+  if (verifier == NULL)
+    {
+      g_printerr ("error: %s\n", error->message);
+      return FALSE;
+    }
+  opt->verifier = verifier;
+
+  g_autoptr (Manifest) manifest = NULL;
+  if (opt->manifest_path)
+    {
+      manifest = manifest_load (opt->manifest_path, verifier, &error);
+      if (manifest == NULL)
+        {
+          g_printerr ("error: %s\n", error->message);
+          return FALSE;
+        }
+    }
+  opt->manifest = manifest;
+
+  g_autoptr (Schedule) schedule = NULL;
+  if (opt_schedule_mode != SCHEDULE_NONE)
+    schedule = schedule_new (opt_schedule_mode, install_scheduled,
+                             (GDestroyNotify)install_job_free, opt);
+  opt->schedule = schedule;
+
   gboolean res = TRUE;
   for (gsize i = 0; sources[i] != NULL; i++)
     {
@@ -231,16 +977,38 @@ install_for_config (InstallOptions *opt, const char **sources, const char *desti
               return EXIT_FAILURE;
             }
 
-          if (!install (opt, path, opt->path_relative ? opt->path_relative : path, destination,
-                        TRUE))
+          /* With a cache, an unchanged tree whose installed files are also
+           * unchanged since it was last installed is skipped as a whole */
+          ValidationCacheTree tree;
+          gboolean use_tree
+              = opt_validation_cache && get_install_tree (opt, path, destination, &tree);
+          if (use_tree && validation_cache_lookup_tree (opt_validation_cache, &tree))
+            {
+              g_info ("Skipping unchanged '%s'", path);
+              continue;
+            }
+
+          if (!install_toplevel (opt, path, opt->path_relative ? opt->path_relative : path,
+                                 destination))
             res = FALSE;
+          else if (use_tree)
+            {
+              /* What we installed is now part of the destination root, the
+               * source root is the one we validated */
+              ValidationCacheTree installed;
+              if (get_install_tree (opt, path, destination, &installed))
+                {
+                  memcpy (installed.source_root, tree.source_root, sizeof (tree.source_root));
+                  validation_cache_add_tree (opt_validation_cache, &installed);
+                }
+            }
         }
       else if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
         {
           g_autofree char *dirname = g_path_get_dirname (path);
 
           /* TODO: Handle opt->path_relative here?? */
-          if (!install (opt, path, dirname, destination, TRUE))
+          if (!install_toplevel (opt, path, dirname, destination))
             res = FALSE;
         }
     }
@@ -255,9 +1023,10 @@ get_install_options_from_cmdline (InstallOptions *opt)
 
   opt->recursive = opt_recursive;
   opt->force = opt_force;
-  opt->path_relative = opt_path_relative;
-  opt->path_prefix = opt_path_prefix;
-  opt->public_keys = opt_public_keys;
+  opt->path_relative = g_strdup (opt_path_relative);
+  opt->path_prefix = g_strdup (opt_path_prefix);
+  opt->public_keys = key_set_ref (opt_public_keys);
+  opt->manifest_path = g_strdup (opt_manifest);
 }
 
 static void
@@ -265,8 +1034,11 @@ free_install_options (InstallOptions *opt)
 {
   g_free (opt->path_relative);
   g_free (opt->path_prefix);
+  g_free (opt->manifest_path);
+  g_strfreev (opt->keys);
+  g_strfreev (opt->key_dirs);
 
-  free_keys (opt->public_keys);
+  g_clear_pointer (&opt->public_keys, key_set_unref);
 }
 
 static gboolean
@@ -337,6 +1109,18 @@ get_install_options_from_file (InstallOptions *opt, const char *config_path, cha
       return FALSE;
     }
 
+  g_autofree char *manifest = NULL;
+  if (!keyfile_get_value_with_default (config, "install", "manifest", NULL, &manifest, &error))
+    {
+      g_printerr ("Can't parse manifest option from config file '%s': %s\n", config_path,
+                  error->message);
+      return FALSE;
+    }
+
+  g_autofree char *manifest_path = NULL;
+  if (manifest)
+    manifest_path = g_canonicalize_filename (manifest, NULL);
+
   g_auto (GStrv) keys = NULL;
   if (!keyfile_get_string_list_with_default (config, "install", "keys", ';', NULL, &keys, &error))
     {
@@ -354,10 +1138,11 @@ get_install_options_from_file (InstallOptions *opt, const char *config_path, cha
       return FALSE;
     }
 
-  opt->public_keys = read_public_keys ((const char **)keys, (const char **)key_dirs);
-
+  opt->keys = g_steal_pointer (&keys);
+  opt->key_dirs = g_steal_pointer (&key_dirs);
   opt->path_relative = g_steal_pointer (&path_relative);
   opt->path_prefix = g_steal_pointer (&path_prefix);
+  opt->manifest_path = g_steal_pointer (&manifest_path);
 
   *destination_out = g_steal_pointer (&destination);
   *sources_out = g_steal_pointer (&sources);
@@ -365,49 +1150,101 @@ get_install_options_from_file (InstallOptions *opt, const char *config_path, cha
   return TRUE;
 }
 
-int
-cmd_install (int argc, char *argv[])
+/* What cmd_install() was asked to install, from the command line or a
+ * config file */
+typedef struct
 {
-  gboolean res = TRUE;
+  char *name; /* For messages */
+  InstallOptions opt;
+  char *destination;
+  char **sources;
+  /* Canonical, for finding conflicts */
+  char *destination_path;
+  char **source_paths;
+} InstallConfig;
 
-  if (argc > 1)
-    {
-      if (argc == 2)
-        help_error ("No destination given");
+static void
+install_config_free (InstallConfig *config)
+{
+  free_install_options (&config->opt);
+  g_free (config->name);
+  g_free (config->destination);
+  g_strfreev (config->sources);
+  g_free (config->destination_path);
+  g_strfreev (config->source_paths);
+  g_free (config);
+}
 
-      InstallOptions main_opt;
-      get_install_options_from_cmdline (&main_opt);
+static InstallConfig *
+install_config_new (const char *name, InstallOptions *opt, char *destination, char **sources)
+{
+  InstallConfig *config = g_new0 (InstallConfig, 1);
+  config->name = g_strdup (name);
+  config->opt = *opt;
+  config->destination = destination;
+  config->sources = sources;
+  config->destination_path = g_canonicalize_filename (destination, NULL);
+  config->source_paths = g_new0 (char *, g_strv_length (sources) + 1);
+  for (gsize i = 0; sources[i] != NULL; i++)
+    config->source_paths[i] = g_canonicalize_filename (sources[i], NULL);
+  return config;
+}
 
-      const char *destination = argv[argc - 1];
+static gboolean
+paths_overlap (const char *a, const char *b)
+{
+  return has_path_prefix (a, b) || has_path_prefix (b, a);
+}
 
-      g_autoptr (GPtrArray) sources = g_ptr_array_new ();
-      for (gsize i = 1; i < argc - 1; i++)
-        g_ptr_array_add (sources, argv[i]);
-      g_ptr_array_add (sources, NULL);
+/* Two configs conflict if one installs into where the other installs
+ * from or to, in which case the order they run in matters */
+static gboolean
+install_configs_conflict (InstallConfig *a, InstallConfig *b)
+{
+  if (paths_overlap (a->destination_path, b->destination_path))
+    return TRUE;
 
-      res &= install_for_config (&main_opt, (const char **)sources->pdata, destination);
-    }
+  for (gsize i = 0; b->source_paths[i] != NULL; i++)
+    if (paths_overlap (a->destination_path, b->source_paths[i]))
+      return TRUE;
 
-  for (gsize i = 0; opt_configs != NULL && opt_configs[i] != NULL; i++)
-    {
-      const char *config_file = opt_configs[i];
+  for (gsize i = 0; a->source_paths[i] != NULL; i++)
+    if (paths_overlap (a->source_paths[i], b->destination_path))
+      return TRUE;
+
+  return FALSE;
+}
 
-      g_info ("Loading config file %s", config_file);
+static void
+add_config_file (GPtrArray *configs, const char *config_file, gboolean *res)
+{
+  g_info ("Loading config file %s", config_file);
+
+  g_autofree char *destination = NULL;
+  g_auto (GStrv) sources = NULL;
+  InstallOptions opt;
+  PROBE1 (config__start, config_file);
+  gboolean loaded = get_install_options_from_file (&opt, config_file, &destination, &sources);
+  PROBE2 (config__done, config_file, loaded);
+  if (!loaded)
+    {
+      *res = FALSE;
+      return;
+    }
 
-      g_autofree char *destination = NULL;
-      g_auto (GStrv) sources = NULL;
-      InstallOptions opt;
-      if (!get_install_options_from_file (&opt, config_file, &destination, &sources))
-        {
-          res = FALSE;
-          continue;
-        }
+  /* The config file doesn't exist */
+  if (destination == NULL)
+    return;
 
-      if (destination)
-        res &= install_for_config (&opt, (const char **)sources, destination);
+  g_ptr_array_add (configs, install_config_new (config_file, &opt, g_steal_pointer (&destination),
+                                                g_steal_pointer (&sources)));
+}
 
-      free_install_options (&opt);
-    }
+static void
+read_config_files (GPtrArray *configs, gboolean *res)
+{
+  for (gsize i = 0; opt_configs != NULL && opt_configs[i] != NULL; i++)
+    add_config_file (configs, opt_configs[i], res);
 
   for (gsize i = 0; opt_config_dirs != NULL && opt_config_dirs[i] != NULL; i++)
     {
@@ -422,7 +1259,7 @@ cmd_install (int argc, char *argv[])
             continue;
 
           g_printerr ("Can't enumerate config dir %s: %s", config_dir, error->message);
-          res = FALSE;
+          *res = FALSE;
           continue;
         }
 
@@ -430,24 +1267,253 @@ cmd_install (int argc, char *argv[])
       while ((filename = g_dir_read_name (dir)) != NULL)
         {
           g_autofree char *config_file = g_build_filename (config_dir, filename, NULL);
+          add_config_file (configs, config_file, res);
+        }
+    }
+}
 
-          g_info ("Loading config file %s", config_file);
+/* The configs of a plan are already resolved, so this parses nothing */
+static gboolean
+add_plan_configs (GPtrArray *configs, const char *plan_path)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (Plan) plan = plan_load (plan_path, &error);
+  if (plan == NULL)
+    {
+      g_printerr ("error: %s\n", error->message);
+      return FALSE;
+    }
 
-          g_autofree char *destination = NULL;
-          g_auto (GStrv) sources = NULL;
-          InstallOptions opt;
-          if (!get_install_options_from_file (&opt, config_file, &destination, &sources))
-            {
-              res = FALSE;
-              continue;
-            }
+  for (guint i = 0; i < plan_get_n_configs (plan); i++)
+    {
+      const PlanConfig *plan_config = plan_get_config (plan, i);
+      InstallOptions opt = { 0 };
+
+      opt.recursive = plan_config->recursive;
+      opt.force = plan_config->force;
+      opt.path_relative = g_strdup (plan_config->path_relative);
+      opt.path_prefix = g_strdup (plan_config->path_prefix);
+      opt.public_keys = key_set_ref (plan_config->keys);
+      opt.manifest_path = g_strdup (plan_config->manifest_path);
+
+      g_autofree char *name = g_strdup_printf ("%s (config %u)", plan_path, i);
+      g_ptr_array_add (configs, install_config_new (name, &opt,
+                                                    g_strdup (plan_config->destination),
+                                                    g_strdupv ((char **)plan_config->sources)));
+    }
 
-          if (destination)
-            res &= install_for_config (&opt, (const char **)sources, destination);
+  return TRUE;
+}
+
+/* Configs that conflict are installed in order by the same job */
+typedef struct
+{
+  GPtrArray *configs; /* Not owned */
+  gboolean res;
+} InstallGroup;
+
+static void
+install_group_free (InstallGroup *group)
+{
+  g_ptr_array_unref (group->configs);
+  g_free (group);
+}
+
+static void
+install_group_run (InstallGroup *group)
+{
+  group->res = TRUE;
+  for (guint i = 0; i < group->configs->len; i++)
+    {
+      InstallConfig *config = g_ptr_array_index (group->configs, i);
+      if (!install_for_config (&config->opt, (const char **)config->sources, config->destination))
+        group->res = FALSE;
+    }
+}
+
+/* Install failures are printed as they happen, so this never fails */
+static gboolean
+install_group_job (const char *path, gpointer job_data, gpointer worker_data, GError **error)
+{
+  install_group_run (job_data);
+  return TRUE;
+}
+
+/* Splits configs into groups where each config conflicts with none in
+ * other groups, keeping their order */
+static GPtrArray *
+group_install_configs (GPtrArray *configs)
+{
+  g_autofree guint *group_of = g_new (guint, configs->len);
+  for (guint i = 0; i < configs->len; i++)
+    {
+      group_of[i] = i;
+      for (guint j = 0; j < i; j++)
+        {
+          if (group_of[j] == group_of[i]
+              || !install_configs_conflict (g_ptr_array_index (configs, j),
+                                            g_ptr_array_index (configs, i)))
+            continue;
+
+          /* Groups are named by their first config */
+          guint from = MAX (group_of[i], group_of[j]);
+          guint to = MIN (group_of[i], group_of[j]);
+          for (guint k = 0; k <= i; k++)
+            if (group_of[k] == from)
+              group_of[k] = to;
+        }
+    }
 
-          free_install_options (&opt);
+  GPtrArray *groups = g_ptr_array_new_with_free_func ((GDestroyNotify)install_group_free);
+  g_autofree InstallGroup **by_first = g_new0 (InstallGroup *, configs->len);
+  for (guint i = 0; i < configs->len; i++)
+    {
+      InstallGroup *group = by_first[group_of[i]];
+      if (group == NULL)
+        {
+          group = g_new0 (InstallGroup, 1);
+          group->configs = g_ptr_array_new ();
+          by_first[group_of[i]] = group;
+          g_ptr_array_add (groups, group);
         }
+      g_ptr_array_add (group->configs, g_ptr_array_index (configs, i));
+    }
+
+  return groups;
+}
+
+int
+cmd_install (int argc, char *argv[])
+{
+  gboolean res = TRUE;
+
+  /* All configs are read first, so that those that don't conflict can be
+   * installed in parallel */
+  g_autoptr (GPtrArray) configs
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)install_config_free);
+
+  if (argc > 1)
+    {
+      if (argc == 2)
+        help_error ("No destination given");
+
+      InstallOptions main_opt;
+      get_install_options_from_cmdline (&main_opt);
+
+      char **sources = g_new0 (char *, argc - 1);
+      for (gsize i = 1; i < argc - 1; i++)
+        sources[i - 1] = g_strdup (argv[i]);
+
+      g_ptr_array_add (configs, install_config_new ("command line", &main_opt,
+                                                    g_strdup (argv[argc - 1]), sources));
     }
 
+  /* A plan replaces the config files, unless it wasn't created */
+  if (opt_plan && g_file_test (opt_plan, G_FILE_TEST_EXISTS))
+    res &= add_plan_configs (configs, opt_plan);
+  else
+    {
+      if (opt_plan)
+        g_info ("No plan '%s', using config files", opt_plan);
+      read_config_files (configs, &res);
+    }
+
+  g_autoptr (GPtrArray) groups = group_install_configs (configs);
+  g_info ("Installing %u configs in %u independent groups", configs->len, groups->len);
+
+  Jobs *jobs = NULL;
+  if (opt_jobs > 1 && groups->len > 1)
+    jobs = jobs_new (MIN (opt_jobs, groups->len), install_group_job, NULL, NULL, NULL, NULL,
+                     NULL);
+
+  for (guint i = 0; i < groups->len; i++)
+    {
+      InstallGroup *group = g_ptr_array_index (groups, i);
+      InstallConfig *first = g_ptr_array_index (group->configs, 0);
+      if (jobs)
+        jobs_push (jobs, first->name, group);
+      else
+        install_group_run (group);
+    }
+
+  if (jobs)
+    jobs_finish (jobs);
+
+  for (guint i = 0; i < groups->len; i++)
+    {
+      InstallGroup *group = g_ptr_array_index (groups, i);
+      if (!group->res)
+        res = FALSE;
+    }
+
+  guint n_copied = 0;
+  for (int i = 0; i < N_COPY_METHODS; i++)
+    n_copied += copy_method_counts[i];
+  if (n_copied > 0)
+    g_info ("Copied %u files (reflink: %d, copy_file_range: %d, sendfile: %d, read_write: %d)",
+            n_copied, copy_method_counts[COPY_METHOD_REFLINK],
+            copy_method_counts[COPY_METHOD_COPY_FILE_RANGE], copy_method_counts[COPY_METHOD_SENDFILE],
+            copy_method_counts[COPY_METHOD_READ_WRITE]);
+  g_info ("Installed %d files, skipped %" G_GUINT64_FORMAT " existing files", installed_count,
+          stats_get (STATS_SKIPPED));
+
   return res ? 0 : 1;
 }
+
+/* Writes the config files to a plan that install can use instead */
+int
+cmd_compile_plan (int argc, char *argv[])
+{
+  if (argc < 2)
+    help_error ("No plan file given");
+  if (argc > 2)
+    help_error ("Too many arguments");
+  if (opt_configs == NULL && opt_config_dirs == NULL)
+    help_error ("No --config or --config-dir argument given");
+
+  gboolean res = TRUE;
+  g_autoptr (GPtrArray) configs
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)install_config_free);
+  read_config_files (configs, &res);
+  if (!res)
+    return EXIT_FAILURE;
+
+  g_autoptr (PlanBuilder) builder = plan_builder_new ();
+  for (guint i = 0; i < configs->len; i++)
+    {
+      InstallConfig *config = g_ptr_array_index (configs, i);
+      InstallOptions *opt = &config->opt;
+
+      /* Everything that the config would make install look up */
+      opt->public_keys
+          = get_config_key_set ((const char **)opt->keys, (const char **)opt->key_dirs);
+      g_autofree char *path_relative
+          = opt->path_relative ? g_canonicalize_filename (opt->path_relative, NULL) : NULL;
+
+      PlanConfig plan_config = { 0 };
+      plan_config.recursive = opt->recursive;
+      plan_config.force = opt->force;
+      plan_config.destination = config->destination_path;
+      plan_config.sources = (const char **)config->source_paths;
+      plan_config.path_relative = path_relative;
+      plan_config.path_prefix = opt->path_prefix;
+      plan_config.manifest_path = opt->manifest_path;
+      plan_config.keys = opt->public_keys;
+
+      g_autoptr (GError) error = NULL;
+      if (!plan_builder_add (builder, &plan_config, &error))
+        {
+          g_printerr ("error: Can't add '%s' to plan: %s\n", config->name, error->message);
+          return EXIT_FAILURE;
+        }
+    }
+
+  g_autoptr (GError) error = NULL;
+  if (!plan_builder_write (builder, argv[1], &error))
+    {
+      g_printerr ("error: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "jobs.h"
+#include "utils.h"
+
+/* Maximum number of jobs waiting for a worker. Jobs can keep resources
+ * such as the fd of their directory, so queueing must not run ahead of
+ * the workers without bound. It is lower if the fd limit is. */
+#define JOBS_MAX_QUEUED 256
+
+typedef struct
+{
+  char *path;
+  gpointer data;
+} Job;
+
+typedef struct
+{
+  char *path;
+  GError *error;
+} JobFailure;
+
+typedef struct
+{
+  Jobs *jobs;
+  gpointer data;
+  GThread *thread;
+} JobWorker;
+
+struct _Jobs
+{
+  JobFunc func;
+  GDestroyNotify job_data_free;
+  GDestroyNotify worker_free;
+
+  GAsyncQueue *queue;
+  GPtrArray *workers;
+
+  GMutex lock;
+  GPtrArray *failures;
+  GCond queued_cond;
+  guint n_queued;
+  guint max_queued;
+};
+
+/* Pushed once per worker to make it exit */
+static Job quit_job;
+
+static void
+job_failure_free (JobFailure *failure)
+{
+  g_free (failure->path);
+  g_error_free (failure->error);
+  g_free (failure);
+}
+
+static gint
+job_failure_cmp (gconstpointer a, gconstpointer b)
+{
+  const JobFailure *fa = *(const JobFailure **)a;
+  const JobFailure *fb = *(const JobFailure **)b;
+
+  return strcmp (fa->path, fb->path);
+}
+
+static gpointer
+job_worker_thread (gpointer user_data)
+{
+  JobWorker *worker = user_data;
+  Jobs *jobs = worker->jobs;
+
+  while (TRUE)
+    {
+      Job *job = g_async_queue_pop (jobs->queue);
+      if (job == &quit_job)
+        break;
+
+      g_mutex_lock (&jobs->lock);
+      jobs->n_queued--;
+      g_cond_signal (&jobs->queued_cond);
+      g_mutex_unlock (&jobs->lock);
+
+      g_autoptr (GError) error = NULL;
+      if (!jobs->func (job->path, job->data, worker->data, &error))
+        {
+          if (error == NULL)
+            g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Failed to process '%s'",
+                         job->path);
+          jobs_report_error (jobs, job->path, g_steal_pointer (&error));
+        }
+
+      if (jobs->job_data_free)
+        jobs->job_data_free (job->data);
+      g_free (job->path);
+      g_free (job);
+    }
+
+  return NULL;
+}
+
+Jobs *
+jobs_new (guint n_workers, JobFunc func, GDestroyNotify job_data_free,
+          JobWorkerInitFunc worker_init, GDestroyNotify worker_free, gpointer user_data,
+          GError **error)
+{
+  g_assert (n_workers > 0);
+
+  Jobs *jobs = g_new0 (Jobs, 1);
+  jobs->func = func;
+  jobs->job_data_free = job_data_free;
+  jobs->worker_free = worker_free;
+  jobs->queue = g_async_queue_new ();
+  jobs->workers = g_ptr_array_new ();
+  jobs->failures = g_ptr_array_new_with_free_func ((GDestroyNotify)job_failure_free);
+  g_mutex_init (&jobs->lock);
+  g_cond_init (&jobs->queued_cond);
+  jobs->max_queued = get_max_open_dirs (JOBS_MAX_QUEUED);
+
+  /* Per-worker state is created up front, on this thread, so that setup
+   * errors can be reported before any work is queued */
+  for (guint i = 0; i < n_workers; i++)
+    {
+      JobWorker *worker = g_new0 (JobWorker, 1);
+      worker->jobs = jobs;
+      g_ptr_array_add (jobs->workers, worker);
+
+      if (worker_init)
+        {
+          worker->data = worker_init (user_data, error);
+          if (worker->data == NULL)
+            {
+              jobs_finish (jobs);
+              return NULL;
+            }
+        }
+    }
+
+  for (guint i = 0; i < jobs->workers->len; i++)
+    {
+      JobWorker *worker = g_ptr_array_index (jobs->workers, i);
+      worker->thread = g_thread_new ("validator-worker", job_worker_thread, worker);
+    }
+
+  return jobs;
+}
+
+void
+jobs_push (Jobs *jobs, const char *path, gpointer job_data)
+{
+  Job *job = g_new0 (Job, 1);
+  job->path = g_strdup (path);
+  job->data = job_data;
+
+  g_mutex_lock (&jobs->lock);
+  while (jobs->n_queued >= jobs->max_queued)
+    g_cond_wait (&jobs->queued_cond, &jobs->lock);
+  jobs->n_queued++;
+  g_mutex_unlock (&jobs->lock);
+
+  g_async_queue_push (jobs->queue, job);
+}
+
+/* Takes ownership of error. With no jobs the error is printed directly,
+ * which lets callers share code between the serial and threaded paths. */
+void
+jobs_report_error (Jobs *jobs, const char *path, GError *error)
+{
+  if (jobs == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return;
+    }
+
+  JobFailure *failure = g_new0 (JobFailure, 1);
+  failure->path = g_strdup (path);
+  failure->error = error;
+
+  g_mutex_lock (&jobs->lock);
+  g_ptr_array_add (jobs->failures, failure);
+  g_mutex_unlock (&jobs->lock);
+}
+
+/* Waits for all queued jobs to be processed and stops the workers. */
+void
+jobs_wait (Jobs *jobs)
+{
+  for (guint i = 0; i < jobs->workers->len; i++)
+    {
+      JobWorker *worker = g_ptr_array_index (jobs->workers, i);
+      if (worker->thread)
+        g_async_queue_push (jobs->queue, &quit_job);
+    }
+
+  for (guint i = 0; i < jobs->workers->len; i++)
+    {
+      JobWorker *worker = g_ptr_array_index (jobs->workers, i);
+      if (worker->thread)
+        g_thread_join (g_steal_pointer (&worker->thread));
+    }
+}
+
+/* Waits for all queued jobs, prints the collected failures in path
+ * order and frees the pool. Returns FALSE if any job failed. */
+gboolean
+jobs_finish (Jobs *jobs)
+{
+  jobs_wait (jobs);
+
+  for (guint i = 0; i < jobs->workers->len; i++)
+    {
+      JobWorker *worker = g_ptr_array_index (jobs->workers, i);
+      if (worker->data && jobs->worker_free)
+        jobs->worker_free (worker->data);
+      g_free (worker);
+    }
+
+  g_ptr_array_sort (jobs->failures, job_failure_cmp);
+  for (guint i = 0; i < jobs->failures->len; i++)
+    {
+      JobFailure *failure = g_ptr_array_index (jobs->failures, i);
+      g_printerr ("%s\n", failure->error->message);
+    }
+
+  gboolean success = jobs->failures->len == 0;
+
+  g_ptr_array_unref (jobs->failures);
+  g_ptr_array_unref (jobs->workers);
+  g_async_queue_unref (jobs->queue);
+  g_cond_clear (&jobs->queued_cond);
+  g_mutex_clear (&jobs->lock);
+  g_free (jobs);
+
+  return success;
+}
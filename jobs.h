@@ -0,0 +1,41 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/* A pool of worker threads processing per-file jobs. Failures are
+ * collected and printed sorted by path when the pool is finished, so
+ * the output does not depend on the order in which workers ran. */
+
+typedef struct _Jobs Jobs;
+
+typedef gboolean (*JobFunc) (const char *path, gpointer job_data, gpointer worker_data,
+                             GError **error);
+typedef gpointer (*JobWorkerInitFunc) (gpointer user_data, GError **error);
+
+Jobs *jobs_new (guint n_workers, JobFunc func, GDestroyNotify job_data_free,
+                JobWorkerInitFunc worker_init, GDestroyNotify worker_free, gpointer user_data,
+                GError **error);
+void jobs_push (Jobs *jobs, const char *path, gpointer job_data);
+void jobs_report_error (Jobs *jobs, const char *path, GError *error);
+void jobs_wait (Jobs *jobs);
+gboolean jobs_finish (Jobs *jobs);
@@ -36,13 +36,28 @@ char **opt_configs;
 char **opt_config_dirs;
 char *opt_path_prefix;
 char *opt_path_relative;
+int opt_jobs = 1;
+gboolean opt_embed_key_id;
+gboolean opt_verity;
+char *opt_manifest;
+char *opt_schedule;
+char *opt_plan;
+gboolean opt_no_io_uring;
+static char *opt_cache;
+static char *opt_cache_key;
+static gboolean opt_new_cache_key;
 static int opt_verbose;
+static gboolean opt_no_cache_pollution;
+static gboolean opt_stats;
+static char *opt_stats_file;
 static gboolean opt_help;
 static gboolean opt_version;
 
 /* Computed */
-GList *opt_public_keys;
+KeySet *opt_public_keys;
 EVP_PKEY *opt_private_key;
+ValidationCache *opt_validation_cache;
+ScheduleMode opt_schedule_mode;
 
 static gboolean
 opt_verbose_cb (const gchar *option_name, const gchar *value, gpointer data, GError **error)
@@ -51,12 +66,26 @@ opt_verbose_cb (const gchar *option_name, const gchar *value, gpointer data, GEr
   return TRUE;
 }
 
+static gboolean
+opt_stats_cb (const gchar *option_name, const gchar *value, gpointer data, GError **error)
+{
+  opt_stats = TRUE;
+  g_free (opt_stats_file);
+  opt_stats_file = g_strdup (value);
+  return TRUE;
+}
+
 GOptionEntry global_entries[]
     = { { "verbose", 'v', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, &opt_verbose_cb,
           "Show debug information", NULL },
         { "help", '?', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &opt_help, NULL, NULL },
         { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version information and exit",
           NULL },
+        { "no-cache-pollution", 0, 0, G_OPTION_ARG_NONE, &opt_no_cache_pollution,
+          "Don't leave file data read for hashing in the page cache", NULL },
+        { "stats", 0, G_OPTION_FLAG_OPTIONAL_ARG | G_OPTION_FLAG_FILENAME, G_OPTION_ARG_CALLBACK,
+          &opt_stats_cb, "Write counters and timings as JSON to FILE (or stderr) at exit",
+          "FILE" },
         { NULL } };
 
 GOptionEntry privkey_entries[]
@@ -77,6 +106,14 @@ GOptionEntry sign_entries[]
           "Add prefix to signed paths", NULL },
         { "force", 'f', 0, G_OPTION_ARG_NONE, &opt_force, "Force signatures (replace existing)",
           NULL },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Sign using N threads (0 for one per CPU)",
+          "N" },
+        { "embed-key-id", 0, 0, G_OPTION_ARG_NONE, &opt_embed_key_id,
+          "Include the key id in signatures (v2 format)", NULL },
+        { "manifest", 0, 0, G_OPTION_ARG_FILENAME, &opt_manifest,
+          "Write a single signed manifest instead of signature files", "FILE" },
+        { "verity", 0, 0, G_OPTION_ARG_NONE, &opt_verity,
+          "Sign regular files by their fs-verity digest", NULL },
         { NULL } };
 
 GOptionEntry validate_entries[]
@@ -84,6 +121,20 @@ GOptionEntry validate_entries[]
           "Validate relative to this directory", NULL },
         { "recursive", 'r', 0, G_OPTION_ARG_NONE, &opt_recursive, "Validate files recursively",
           NULL },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+          "Validate using N threads (0 for one per CPU)", "N" },
+        { "manifest", 0, 0, G_OPTION_ARG_FILENAME, &opt_manifest,
+          "Validate using this signed manifest instead of signature files", "FILE" },
+        { "cache", 0, 0, G_OPTION_ARG_FILENAME, &opt_cache,
+          "Remember validated files in this cache", "FILE" },
+        { "cache-key", 0, 0, G_OPTION_ARG_FILENAME, &opt_cache_key,
+          "Authenticate the cache with this key", "FILE" },
+        { "new-cache-key", 0, 0, G_OPTION_ARG_NONE, &opt_new_cache_key,
+          "Create the cache key if it doesn't exist", NULL },
+        { "schedule", 0, 0, G_OPTION_ARG_STRING, &opt_schedule,
+          "Read files in disk order (inode or extent)", "ORDER" },
+        { "no-io-uring", 0, 0, G_OPTION_ARG_NONE, &opt_no_io_uring,
+          "Don't batch file reads with io_uring", NULL },
         { NULL } };
 
 GOptionEntry install_entries[]
@@ -97,6 +148,20 @@ GOptionEntry install_entries[]
           "Install options from this config file", "FILE" },
         { "config-dir", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_config_dirs,
           "Directory of config files to install from", "FILE" },
+        { "plan", 0, 0, G_OPTION_ARG_FILENAME, &opt_plan,
+          "Install from this compiled plan instead of the config files", "FILE" },
+        { "manifest", 0, 0, G_OPTION_ARG_FILENAME, &opt_manifest,
+          "Validate using this signed manifest instead of signature files", "FILE" },
+        { "cache", 0, 0, G_OPTION_ARG_FILENAME, &opt_cache,
+          "Remember validated files in this cache", "FILE" },
+        { "cache-key", 0, 0, G_OPTION_ARG_FILENAME, &opt_cache_key,
+          "Authenticate the cache with this key", "FILE" },
+        { "new-cache-key", 0, 0, G_OPTION_ARG_NONE, &opt_new_cache_key,
+          "Create the cache key if it doesn't exist", NULL },
+        { "schedule", 0, 0, G_OPTION_ARG_STRING, &opt_schedule,
+          "Read files in disk order (inode or extent)", "ORDER" },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+          "Install independent configs using N threads (0 for one per CPU)", "N" },
         {
             "force",
             'f',
@@ -107,6 +172,13 @@ GOptionEntry install_entries[]
         },
         { NULL } };
 
+GOptionEntry compile_plan_entries[]
+    = { { "config", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_configs,
+          "Compile options from this config file", "FILE" },
+        { "config-dir", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_config_dirs,
+          "Directory of config files to compile", "FILE" },
+        { NULL } };
+
 GOptionEntry blob_entries[] = { { "relative-to", 0, 0, G_OPTION_ARG_FILENAME, &opt_path_relative,
                                   "Paths relative to this directory", NULL },
                                 { "path-prefix", 'p', 0, G_OPTION_ARG_FILENAME, &opt_path_prefix,
@@ -151,10 +223,11 @@ read_private_key (void)
     }
 }
 
-GList *
+KeySet *
 read_public_keys (const char **keys, const char **key_dirs)
 {
-  GList *res = NULL;
+  gint64 start_time = stats_phase_start ();
+  KeySet *res = key_set_new ();
 
   for (int i = 0; keys != NULL && keys[i] != NULL; i++)
     {
@@ -167,24 +240,23 @@ read_public_keys (const char **keys, const char **key_dirs)
           exit (EXIT_FAILURE);
         }
 
-      res = g_list_append (res, g_steal_pointer (&key));
+      key_set_add (res, key);
     }
 
   for (int i = 0; key_dirs != NULL && key_dirs[i] != NULL; i++)
     {
       const char *key_dir_path = key_dirs[i];
 
-      GList *dir_keys;
       g_autoptr (GError) error = NULL;
-      if (!load_pub_keys_from_dir (key_dir_path, &dir_keys, &error))
+      if (!load_pub_keys_from_dir (key_dir_path, res, &error))
         {
           g_printerr ("error: %s\n", error->message);
           exit (EXIT_FAILURE);
         }
-
-      res = g_list_concat (res, dir_keys);
     }
 
+  stats_phase_end (STATS_PHASE_LOAD_KEYS, start_time);
+
   return res;
 }
 
@@ -225,6 +297,12 @@ canonicalize_opts (void)
       opt_path_relative = g_canonicalize_filename (old, NULL);
     }
 
+  if (opt_manifest)
+    {
+      g_autofree char *old = g_steal_pointer (&opt_manifest);
+      opt_manifest = g_canonicalize_filename (old, NULL);
+    }
+
   if (opt_path_prefix)
     {
       g_autofree char *canonical = g_canonicalize_filename (opt_path_prefix, "/");
@@ -232,6 +310,14 @@ canonicalize_opts (void)
       /* Skip initial slash */
       opt_path_prefix = g_strdup (canonical + 1);
     }
+
+  if (opt_jobs < 0)
+    help_error ("Invalid number of jobs: %d", opt_jobs);
+  if (opt_jobs == 0)
+    opt_jobs = g_get_num_processors ();
+
+  if (opt_schedule && !schedule_mode_from_string (opt_schedule, &opt_schedule_mode))
+    help_error ("Invalid schedule: %s", opt_schedule);
 }
 
 enum
@@ -254,6 +340,7 @@ static struct CommandInfo commands[] = {
   { "validate", validate_entries, COMMAND_PUBKEYS, cmd_validate, "validate FILE [FILE...]" },
   { "install", install_entries, COMMAND_PUBKEYS, cmd_install,
     "install SOURCE [SOURCE..] DESTINATION" },
+  { "compile-plan", compile_plan_entries, 0, cmd_compile_plan, "compile-plan PLAN" },
   { "blob", blob_entries, 0, cmd_blob, "blob FILE" },
 };
 
@@ -288,6 +375,7 @@ int
 main (int argc, char *argv[])
 {
   g_set_prgname (argv[0]);
+  stats_start ();
 
   g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_WARNING, message_handler,
                      NULL);
@@ -308,6 +396,7 @@ main (int argc, char *argv[])
                                          "  sign         Sign files\n"
                                          "  validate     Validate files\n"
                                          "  install      Install validated files\n"
+                                         "  compile-plan Compile install configs into a plan\n"
                                          "  blob         Output blob for external signing\n");
   g_option_context_add_main_entries (context, global_entries, NULL);
 
@@ -330,6 +419,9 @@ main (int argc, char *argv[])
   if (opt_verbose > 1)
     g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
 
+  /* Verbose output includes the hashing rate */
+  stats_set_enabled (opt_stats || opt_verbose > 0);
+
   if (opt_version)
     {
       g_print ("%s\n", PACKAGE_STRING);
@@ -345,7 +437,7 @@ main (int argc, char *argv[])
   if (command->flags & COMMAND_PUBKEYS)
     {
       if (opt_keys == NULL && opt_key_dirs == NULL && opt_configs == NULL
-          && opt_config_dirs == NULL)
+          && opt_config_dirs == NULL && opt_plan == NULL)
         help_error ("No --key or --key-dirs argument given given");
 
       opt_public_keys = read_public_keys ((const char **)opt_keys, (const char **)opt_key_dirs);
@@ -353,5 +445,52 @@ main (int argc, char *argv[])
 
   canonicalize_opts ();
 
-  return command->cmd (argc, argv);
+  set_drop_page_cache (opt_no_cache_pollution);
+
+  g_autoptr (ValidationCache) cache = NULL;
+  if (opt_cache)
+    {
+      if (opt_cache_key == NULL)
+        help_error ("--cache requires --cache-key");
+
+      cache = validation_cache_load (opt_cache, opt_cache_key, opt_new_cache_key, &error);
+      if (cache == NULL)
+        {
+          g_printerr ("error: %s\n", error->message);
+          return EXIT_FAILURE;
+        }
+      opt_validation_cache = cache;
+    }
+
+  int res = command->cmd (argc, argv);
+
+  if (cache)
+    {
+      guint hits, misses;
+      validation_cache_get_stats (cache, &hits, &misses);
+      g_info ("Cache had %u hits and %u misses", hits, misses);
+      stats_add (STATS_CACHE_HITS, hits);
+      stats_add (STATS_CACHE_MISSES, misses);
+
+      /* The cache only saves work, so failing to update it is not fatal */
+      if (!validation_cache_save (cache, res == EXIT_SUCCESS, &error))
+        g_printerr ("Can't write cache '%s': %s\n", opt_cache, error->message);
+    }
+
+  guint64 hashed_bytes;
+  gint64 hash_usec;
+  sha512_get_stats (&hashed_bytes, &hash_usec);
+  if (hashed_bytes > 0)
+    g_info ("Hashed %" G_GUINT64_FORMAT " bytes in %.3f s (%.1f MB/s)", hashed_bytes,
+            hash_usec / (double)G_USEC_PER_SEC,
+            hash_usec > 0 ? (double)hashed_bytes / hash_usec : 0.0);
+
+  if (opt_stats)
+    {
+      g_autoptr (GError) stats_error = NULL;
+      if (!stats_write (opt_stats_file, command->name, res, &stats_error))
+        g_printerr ("Can't write stats '%s': %s\n", opt_stats_file, stats_error->message);
+    }
+
+  return res;
 }
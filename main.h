@@ -21,6 +21,9 @@
 #include "utils.h"
 #include <glib.h>
 
+#include "cache.h"
+#include "schedule.h"
+
 extern gboolean opt_recursive;
 extern gboolean opt_force;
 extern char *opt_key;
@@ -30,18 +33,28 @@ extern char **opt_configs;
 extern char **opt_config_dirs;
 extern char *opt_path_prefix;
 extern char *opt_path_relative;
+extern int opt_jobs;
+extern gboolean opt_embed_key_id;
+extern gboolean opt_verity;
+extern char *opt_manifest;
+extern char *opt_schedule;
+extern char *opt_plan;
+extern gboolean opt_no_io_uring;
 
 /* Computed */
-extern GList *opt_public_keys;
+extern KeySet *opt_public_keys;
 extern EVP_PKEY *opt_private_key;
+extern ValidationCache *opt_validation_cache;
+extern ScheduleMode opt_schedule_mode;
 
 int cmd_sign (int argc, char *argv[]);
 int cmd_validate (int argc, char *argv[]);
 int cmd_install (int argc, char *argv[]);
+int cmd_compile_plan (int argc, char *argv[]);
 int cmd_blob (int argc, char *argv[]);
 
 void help_error (const char *error_msg_fmt, ...);
 char *opt_get_relative_path (const char *path, const char *relative_to,
                              const char *optional_path_prefix);
 
-GList *read_public_keys (const char **keys, const char **key_dirs);
+KeySet *read_public_keys (const char **keys, const char **key_dirs);
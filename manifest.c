@@ -0,0 +1,369 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "utils.h"
+
+#include "manifest.h"
+
+#define MANIFEST_HEADER_LEN (VALIDATOR_MANIFEST_MAGIC_LEN + 4)
+
+struct _Manifest
+{
+  char *data;
+  gsize len;
+  guint32 n_entries;
+  /* Points into data, not aligned */
+  const guchar *offsets;
+};
+
+typedef struct
+{
+  guchar *blob;
+  gsize blob_len;
+} ManifestEntry;
+
+struct _ManifestBuilder
+{
+  GMutex lock;
+  GPtrArray *entries;
+};
+
+static guint32
+read_u32 (const guchar *p)
+{
+  guint32 v;
+  memcpy (&v, p, sizeof (v));
+  return GUINT32_FROM_LE (v);
+}
+
+static void
+append_u32 (GString *s, guint32 v)
+{
+  v = GUINT32_TO_LE (v);
+  g_string_append_len (s, (const char *)&v, sizeof (v));
+}
+
+static gboolean
+sha512_data (const guchar *data, gsize len, guchar *digest_out, GError **error)
+{
+  if (EVP_Digest (data, len, digest_out, NULL, EVP_sha512 (), NULL) != 1)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't compute sha512");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Returns the blob of entry i, whose bounds were checked on load */
+static const guchar *
+manifest_get_blob (Manifest *manifest, guint32 i, gsize *blob_len_out)
+{
+  guint32 offset = read_u32 (manifest->offsets + 4 * i);
+  *blob_len_out = read_u32 ((const guchar *)manifest->data + offset);
+  return (const guchar *)manifest->data + offset + 4;
+}
+
+static gboolean
+manifest_parse (Manifest *manifest, GError **error)
+{
+  const guchar *data = (const guchar *)manifest->data;
+
+  if (manifest->len < MANIFEST_HEADER_LEN
+      || memcmp (data, VALIDATOR_MANIFEST_MAGIC, VALIDATOR_MANIFEST_MAGIC_LEN) != 0)
+    goto invalid;
+
+  manifest->n_entries = read_u32 (data + VALIDATOR_MANIFEST_MAGIC_LEN);
+  manifest->offsets = data + MANIFEST_HEADER_LEN;
+
+  guint64 entries_start = MANIFEST_HEADER_LEN + 4 * (guint64)manifest->n_entries;
+  if (entries_start > manifest->len)
+    goto invalid;
+
+  const char *prev_rel_path = NULL;
+  for (guint32 i = 0; i < manifest->n_entries; i++)
+    {
+      guint64 offset = read_u32 (manifest->offsets + 4 * i);
+      if (offset < entries_start || offset + 4 > manifest->len)
+        goto invalid;
+
+      guint64 blob_len = read_u32 (data + offset);
+      if (blob_len < 2 || offset + 4 + blob_len > manifest->len)
+        goto invalid;
+
+      /* Type byte, then the NUL terminated relative path */
+      const guchar *blob = data + offset + 4;
+      if (blob[0] > 2 || memchr (blob + 1, 0, blob_len - 1) == NULL)
+        goto invalid;
+
+      const char *rel_path = (const char *)blob + 1;
+      if (prev_rel_path != NULL && strcmp (prev_rel_path, rel_path) >= 0)
+        goto invalid;
+      prev_rel_path = rel_path;
+    }
+
+  return TRUE;
+
+invalid:
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid manifest");
+  return FALSE;
+}
+
+/* Loads the manifest at path, and validates its signature (path.sig)
+ * with verifier */
+Manifest *
+manifest_load (const char *path, Verifier *verifier, GError **error)
+{
+  g_autoptr (Manifest) manifest = g_new0 (Manifest, 1);
+  g_autoptr (GError) local_error = NULL;
+
+  g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+  char signature[VALIDATOR_MAX_SIGNATURE_SIZE];
+  gsize signature_len = 0;
+  if (!load_signature (sig_path, signature, sizeof (signature), &signature_len, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "No signature for manifest '%s'",
+                     path);
+      else
+        g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  if (!g_file_get_contents (path, &manifest->data, &manifest->len, error))
+    return NULL;
+
+  guchar digest[64];
+  if (!sha512_data ((const guchar *)manifest->data, manifest->len, digest, error))
+    return NULL;
+
+  g_autofree char *basename = g_path_get_basename (path);
+  if (!verifier_verify (verifier, basename, VALIDATOR_TYPE_MANIFEST, digest, sizeof (digest),
+                        signature, signature_len, &local_error))
+    {
+      if (local_error)
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "Signature of manifest '%s' is invalid: %s", path, local_error->message);
+      else
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "Signature of manifest '%s' is invalid", path);
+      return NULL;
+    }
+
+  if (!manifest_parse (manifest, &local_error))
+    {
+      g_propagate_prefixed_error (error, g_steal_pointer (&local_error), "Can't load '%s': ",
+                                  path);
+      return NULL;
+    }
+
+  g_info ("Loaded manifest '%s' with %u entries", path, manifest->n_entries);
+
+  return g_steal_pointer (&manifest);
+}
+
+void
+manifest_free (Manifest *manifest)
+{
+  g_free (manifest->data);
+  g_free (manifest);
+}
+
+/* Checks that the manifest has an entry for rel_path that matches the
+ * type and content, i.e. what a signature would have been made for */
+gboolean
+manifest_check (Manifest *manifest, const char *rel_path, int type, const guchar *content,
+                gsize content_len, GError **error)
+{
+  const guchar *blob = NULL;
+  gsize blob_len = 0;
+
+  guint32 lo = 0, hi = manifest->n_entries;
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      gsize mid_len;
+      const guchar *mid_blob = manifest_get_blob (manifest, mid, &mid_len);
+
+      int cmp = strcmp (rel_path, (const char *)mid_blob + 1);
+      if (cmp == 0)
+        {
+          blob = mid_blob;
+          blob_len = mid_len;
+          break;
+        }
+      else if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  if (blob == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "Not in manifest");
+      return FALSE;
+    }
+
+  gsize expected_len;
+  g_autofree guchar *expected
+      = make_sign_blob (rel_path, type, content, content_len, &expected_len, error);
+  if (expected == NULL)
+    return FALSE;
+
+  if (expected_len != blob_len || memcmp (expected, blob, blob_len) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Doesn't match manifest");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+manifest_entry_free (ManifestEntry *entry)
+{
+  g_free (entry->blob);
+  g_free (entry);
+}
+
+static gint
+manifest_entry_cmp (gconstpointer a, gconstpointer b)
+{
+  const ManifestEntry *ea = *(const ManifestEntry **)a;
+  const ManifestEntry *eb = *(const ManifestEntry **)b;
+
+  return strcmp ((const char *)ea->blob + 1, (const char *)eb->blob + 1);
+}
+
+/* Entries can be added from several threads */
+ManifestBuilder *
+manifest_builder_new (void)
+{
+  ManifestBuilder *builder = g_new0 (ManifestBuilder, 1);
+  g_mutex_init (&builder->lock);
+  builder->entries = g_ptr_array_new_with_free_func ((GDestroyNotify)manifest_entry_free);
+  return builder;
+}
+
+void
+manifest_builder_free (ManifestBuilder *builder)
+{
+  g_ptr_array_unref (builder->entries);
+  g_mutex_clear (&builder->lock);
+  g_free (builder);
+}
+
+gboolean
+manifest_builder_add (ManifestBuilder *builder, const char *rel_path, int type,
+                      const guchar *content, gsize content_len, GError **error)
+{
+  ManifestEntry *entry = g_new0 (ManifestEntry, 1);
+  entry->blob = make_sign_blob (rel_path, type, content, content_len, &entry->blob_len, error);
+  if (entry->blob == NULL)
+    {
+      g_free (entry);
+      return FALSE;
+    }
+
+  if (entry->blob_len > G_MAXUINT32)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Entry for '%s' is too large",
+                   rel_path);
+      manifest_entry_free (entry);
+      return FALSE;
+    }
+
+  g_mutex_lock (&builder->lock);
+  g_ptr_array_add (builder->entries, entry);
+  g_mutex_unlock (&builder->lock);
+
+  return TRUE;
+}
+
+/* Writes the manifest to path, and its signature to path.sig */
+gboolean
+manifest_builder_write (ManifestBuilder *builder, const char *path, Signer *signer,
+                        GError **error)
+{
+  GPtrArray *entries = builder->entries;
+
+  g_ptr_array_sort (entries, manifest_entry_cmp);
+
+  gsize total_len = MANIFEST_HEADER_LEN + 4 * (gsize)entries->len;
+  for (guint i = 0; i < entries->len; i++)
+    {
+      ManifestEntry *entry = g_ptr_array_index (entries, i);
+      if (i > 0 && manifest_entry_cmp (&g_ptr_array_index (entries, i - 1), &entry) == 0)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "'%s' is in the manifest twice",
+                       (const char *)entry->blob + 1);
+          return FALSE;
+        }
+      total_len += 4 + entry->blob_len;
+    }
+
+  if (total_len > G_MAXUINT32)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Manifest is too large");
+      return FALSE;
+    }
+
+  g_autoptr (GString) s = g_string_sized_new (total_len);
+  g_string_append_len (s, VALIDATOR_MANIFEST_MAGIC, VALIDATOR_MANIFEST_MAGIC_LEN);
+  append_u32 (s, entries->len);
+
+  guint32 offset = MANIFEST_HEADER_LEN + 4 * entries->len;
+  for (guint i = 0; i < entries->len; i++)
+    {
+      ManifestEntry *entry = g_ptr_array_index (entries, i);
+      append_u32 (s, offset);
+      offset += 4 + entry->blob_len;
+    }
+
+  for (guint i = 0; i < entries->len; i++)
+    {
+      ManifestEntry *entry = g_ptr_array_index (entries, i);
+      append_u32 (s, entry->blob_len);
+      g_string_append_len (s, (const char *)entry->blob, entry->blob_len);
+    }
+
+  guchar digest[64];
+  if (!sha512_data ((const guchar *)s->str, s->len, digest, error))
+    return FALSE;
+
+  g_autofree char *basename = g_path_get_basename (path);
+  g_autofree guchar *signature = NULL;
+  gsize signature_len = 0;
+  if (!signer_sign (signer, VALIDATOR_TYPE_MANIFEST, basename, digest, sizeof (digest),
+                    &signature, &signature_len, error))
+    return FALSE;
+
+  if (!g_file_set_contents (path, s->str, s->len, error))
+    return FALSE;
+
+  g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+  if (!g_file_set_contents (sig_path, (const char *)signature, signature_len, error))
+    return FALSE;
+
+  g_info ("Wrote manifest '%s' with %u entries", path, entries->len);
+
+  return TRUE;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/* A manifest lists the blobs (as from make_sign_blob()) of all the files
+ * in a tree, and is signed as a whole, so that a tree can be validated
+ * with a single signature check.
+ *
+ * The file starts with VALIDATOR_MANIFEST_MAGIC, followed by the number
+ * of entries and a table of their offsets in the file. Each entry is the
+ * length of its blob followed by the blob. Integers are 32bit little
+ * endian, and entries are sorted by relative path so they can be found
+ * by binary search. The manifest is signed like a regular file, using
+ * its basename as relative path but VALIDATOR_TYPE_MANIFEST as type,
+ * and the signature is stored next to it with the usual ".sig"
+ * extension. */
+
+#define VALIDATOR_MANIFEST_MAGIC "VALIDMF\001"
+#define VALIDATOR_MANIFEST_MAGIC_LEN 8
+
+typedef struct _Manifest Manifest;
+typedef struct _ManifestBuilder ManifestBuilder;
+
+Manifest *manifest_load (const char *path, Verifier *verifier, GError **error);
+void manifest_free (Manifest *manifest);
+gboolean manifest_check (Manifest *manifest, const char *rel_path, int type,
+                         const guchar *content, gsize content_len, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Manifest, manifest_free)
+
+ManifestBuilder *manifest_builder_new (void);
+void manifest_builder_free (ManifestBuilder *builder);
+gboolean manifest_builder_add (ManifestBuilder *builder, const char *rel_path, int type,
+                               const guchar *content, gsize content_len, GError **error);
+gboolean manifest_builder_write (ManifestBuilder *builder, const char *path, Signer *signer,
+                                 GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ManifestBuilder, manifest_builder_free)
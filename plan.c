@@ -0,0 +1,359 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "utils.h"
+
+#include "plan.h"
+
+#define PLAN_HEADER_LEN (VALIDATOR_PLAN_MAGIC_LEN + 8)
+#define PLAN_KEY_LEN 32
+#define PLAN_STRING_NONE G_MAXUINT32
+
+#define PLAN_FLAG_RECURSIVE (1 << 0)
+#define PLAN_FLAG_FORCE (1 << 1)
+
+struct _Plan
+{
+  GMappedFile *file;
+  GArray *configs;     /* PlanConfig, pointing into file */
+  GPtrArray *key_sets; /* Shared by configs with the same keys */
+};
+
+struct _PlanBuilder
+{
+  GByteArray *keys;
+  guint32 n_keys;
+  GString *configs;
+  guint32 n_configs;
+};
+
+/* Where the plan is parsed from */
+typedef struct
+{
+  const guchar *p;
+  const guchar *end;
+} PlanReader;
+
+static gboolean
+read_u32 (PlanReader *reader, guint32 *v_out)
+{
+  guint32 v;
+  if (reader->end - reader->p < sizeof (v))
+    return FALSE;
+  memcpy (&v, reader->p, sizeof (v));
+  reader->p += sizeof (v);
+  *v_out = GUINT32_FROM_LE (v);
+  return TRUE;
+}
+
+static gboolean
+read_string (PlanReader *reader, const char **str_out)
+{
+  guint32 len;
+  if (!read_u32 (reader, &len))
+    return FALSE;
+
+  if (len == PLAN_STRING_NONE)
+    {
+      *str_out = NULL;
+      return TRUE;
+    }
+
+  if (reader->end - reader->p <= len || reader->p[len] != 0
+      || memchr (reader->p, 0, len) != NULL)
+    return FALSE;
+
+  *str_out = (const char *)reader->p;
+  reader->p += len + 1;
+  return TRUE;
+}
+
+static void
+append_u32 (GString *s, guint32 v)
+{
+  v = GUINT32_TO_LE (v);
+  g_string_append_len (s, (const char *)&v, sizeof (v));
+}
+
+static void
+append_string (GString *s, const char *str)
+{
+  if (str == NULL)
+    {
+      append_u32 (s, PLAN_STRING_NONE);
+      return;
+    }
+
+  gsize len = strlen (str);
+  append_u32 (s, len);
+  g_string_append_len (s, str, len + 1);
+}
+
+static void
+plan_config_clear (PlanConfig *config)
+{
+  g_free (config->sources);
+}
+
+void
+plan_free (Plan *plan)
+{
+  if (plan->configs)
+    g_array_unref (plan->configs);
+  if (plan->key_sets)
+    g_ptr_array_unref (plan->key_sets);
+  if (plan->file)
+    g_mapped_file_unref (plan->file);
+  g_free (plan);
+}
+
+/* Returns the key set of the n_keys keys at indexes in the plan, which
+ * configs with the same keys share */
+static KeySet *
+plan_get_key_set (Plan *plan, GHashTable *by_indexes, GPtrArray *keys, const guint32 *indexes,
+                  guint32 n_keys)
+{
+  g_autoptr (GString) spec = g_string_new ("");
+  for (guint32 i = 0; i < n_keys; i++)
+    g_string_append_printf (spec, "%u,", indexes[i]);
+
+  KeySet *key_set = g_hash_table_lookup (by_indexes, spec->str);
+  if (key_set == NULL)
+    {
+      key_set = key_set_new ();
+      for (guint32 i = 0; i < n_keys; i++)
+        key_set_add (key_set, g_ptr_array_index (keys, indexes[i]));
+      g_ptr_array_add (plan->key_sets, key_set);
+      g_hash_table_insert (by_indexes, g_strdup (spec->str), key_set);
+    }
+
+  return key_set;
+}
+
+static gboolean
+plan_parse (Plan *plan, GError **error)
+{
+  PlanReader reader;
+  reader.p = (const guchar *)g_mapped_file_get_contents (plan->file);
+  reader.end = reader.p + g_mapped_file_get_length (plan->file);
+
+  g_autoptr (GPtrArray) keys = g_ptr_array_new_with_free_func ((GDestroyNotify)EVP_PKEY_free);
+  g_autoptr (GHashTable) by_indexes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  guint32 n_keys, n_configs;
+  if (reader.end - reader.p < PLAN_HEADER_LEN
+      || memcmp (reader.p, VALIDATOR_PLAN_MAGIC, VALIDATOR_PLAN_MAGIC_LEN) != 0)
+    goto invalid;
+  reader.p += VALIDATOR_PLAN_MAGIC_LEN;
+  if (!read_u32 (&reader, &n_keys) || !read_u32 (&reader, &n_configs))
+    goto invalid;
+
+  if ((reader.end - reader.p) / PLAN_KEY_LEN < n_keys)
+    goto invalid;
+
+  for (guint32 i = 0; i < n_keys; i++)
+    {
+      EVP_PKEY *key = EVP_PKEY_new_raw_public_key (EVP_PKEY_ED25519, NULL, reader.p, PLAN_KEY_LEN);
+      if (key == NULL)
+        goto invalid;
+      g_ptr_array_add (keys, key);
+      reader.p += PLAN_KEY_LEN;
+    }
+
+  for (guint32 i = 0; i < n_configs; i++)
+    {
+      guint32 flags, n_config_keys, n_sources;
+      if (!read_u32 (&reader, &flags) || !read_u32 (&reader, &n_config_keys)
+          || (reader.end - reader.p) / 4 < n_config_keys)
+        goto invalid;
+
+      g_autofree guint32 *indexes = g_new (guint32, n_config_keys);
+      for (guint32 j = 0; j < n_config_keys; j++)
+        if (!read_u32 (&reader, &indexes[j]) || indexes[j] >= n_keys)
+          goto invalid;
+
+      /* Each source is at least a length and a NUL */
+      if (!read_u32 (&reader, &n_sources) || (reader.end - reader.p) / 5 < n_sources)
+        goto invalid;
+
+      PlanConfig config = { 0 };
+      config.recursive = (flags & PLAN_FLAG_RECURSIVE) != 0;
+      config.force = (flags & PLAN_FLAG_FORCE) != 0;
+      config.sources = g_new0 (const char *, n_sources + 1);
+      g_array_append_val (plan->configs, config);
+
+      PlanConfig *added = &g_array_index (plan->configs, PlanConfig, i);
+      if (!read_string (&reader, &added->destination) || added->destination == NULL
+          || !read_string (&reader, &added->path_relative)
+          || !read_string (&reader, &added->path_prefix)
+          || !read_string (&reader, &added->manifest_path))
+        goto invalid;
+      for (guint32 j = 0; j < n_sources; j++)
+        if (!read_string (&reader, &added->sources[j]) || added->sources[j] == NULL)
+          goto invalid;
+
+      added->keys = plan_get_key_set (plan, by_indexes, keys, indexes, n_config_keys);
+    }
+
+  if (reader.p != reader.end)
+    goto invalid;
+
+  return TRUE;
+
+invalid:
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid plan");
+  return FALSE;
+}
+
+/* Loads the plan at path, which is mapped for as long as it is used */
+Plan *
+plan_load (const char *path, GError **error)
+{
+  g_autoptr (Plan) plan = g_new0 (Plan, 1);
+  g_autoptr (GError) local_error = NULL;
+
+  plan->file = g_mapped_file_new (path, FALSE, error);
+  if (plan->file == NULL)
+    return NULL;
+
+  plan->configs = g_array_new (FALSE, TRUE, sizeof (PlanConfig));
+  g_array_set_clear_func (plan->configs, (GDestroyNotify)plan_config_clear);
+  plan->key_sets = g_ptr_array_new_with_free_func ((GDestroyNotify)key_set_unref);
+
+  if (!plan_parse (plan, &local_error))
+    {
+      g_propagate_prefixed_error (error, g_steal_pointer (&local_error), "Can't load '%s': ",
+                                  path);
+      return NULL;
+    }
+
+  g_info ("Loaded plan '%s' with %u configs", path, plan->configs->len);
+
+  return g_steal_pointer (&plan);
+}
+
+guint
+plan_get_n_configs (Plan *plan)
+{
+  return plan->configs->len;
+}
+
+/* The config, and its strings and keys, belong to the plan */
+const PlanConfig *
+plan_get_config (Plan *plan, guint i)
+{
+  return &g_array_index (plan->configs, PlanConfig, i);
+}
+
+PlanBuilder *
+plan_builder_new (void)
+{
+  PlanBuilder *builder = g_new0 (PlanBuilder, 1);
+  builder->keys = g_byte_array_new ();
+  builder->configs = g_string_new ("");
+  return builder;
+}
+
+void
+plan_builder_free (PlanBuilder *builder)
+{
+  g_byte_array_unref (builder->keys);
+  g_string_free (builder->configs, TRUE);
+  g_free (builder);
+}
+
+/* Returns the index of key in the plan, adding it if needed */
+static gboolean
+plan_builder_add_key (PlanBuilder *builder, EVP_PKEY *key, guint32 *index_out, GError **error)
+{
+  guchar raw[PLAN_KEY_LEN];
+  gsize raw_len = sizeof (raw);
+
+  if (EVP_PKEY_id (key) != EVP_PKEY_ED25519
+      || EVP_PKEY_get_raw_public_key (key, raw, &raw_len) != 1 || raw_len != PLAN_KEY_LEN)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Only Ed25519 keys can be used in a plan");
+      return FALSE;
+    }
+
+  for (guint32 i = 0; i < builder->n_keys; i++)
+    {
+      if (memcmp (builder->keys->data + i * PLAN_KEY_LEN, raw, PLAN_KEY_LEN) == 0)
+        {
+          *index_out = i;
+          return TRUE;
+        }
+    }
+
+  g_byte_array_append (builder->keys, raw, PLAN_KEY_LEN);
+  *index_out = builder->n_keys++;
+  return TRUE;
+}
+
+/* Adds config, which should be installed after the ones added before it */
+gboolean
+plan_builder_add (PlanBuilder *builder, const PlanConfig *config, GError **error)
+{
+  guint n_keys = key_set_get_size (config->keys);
+  g_autofree guint32 *indexes = g_new (guint32, n_keys);
+  for (guint i = 0; i < n_keys; i++)
+    if (!plan_builder_add_key (builder, key_set_get_key (config->keys, i), &indexes[i], error))
+      return FALSE;
+
+  GString *s = builder->configs;
+  append_u32 (s, (config->recursive ? PLAN_FLAG_RECURSIVE : 0)
+                     | (config->force ? PLAN_FLAG_FORCE : 0));
+  append_u32 (s, n_keys);
+  for (guint i = 0; i < n_keys; i++)
+    append_u32 (s, indexes[i]);
+  append_u32 (s, g_strv_length ((char **)config->sources));
+  append_string (s, config->destination);
+  append_string (s, config->path_relative);
+  append_string (s, config->path_prefix);
+  append_string (s, config->manifest_path);
+  for (gsize i = 0; config->sources[i] != NULL; i++)
+    append_string (s, config->sources[i]);
+
+  builder->n_configs++;
+  return TRUE;
+}
+
+gboolean
+plan_builder_write (PlanBuilder *builder, const char *path, GError **error)
+{
+  g_autoptr (GString) s = g_string_sized_new (PLAN_HEADER_LEN + builder->keys->len
+                                              + builder->configs->len);
+  g_string_append_len (s, VALIDATOR_PLAN_MAGIC, VALIDATOR_PLAN_MAGIC_LEN);
+  append_u32 (s, builder->n_keys);
+  append_u32 (s, builder->n_configs);
+  g_string_append_len (s, (const char *)builder->keys->data, builder->keys->len);
+  g_string_append_len (s, builder->configs->str, builder->configs->len);
+
+  if (!g_file_set_contents (path, s->str, s->len, error))
+    return FALSE;
+
+  g_info ("Wrote plan '%s' with %u configs and %u keys", path, builder->n_configs,
+          builder->n_keys);
+
+  return TRUE;
+}
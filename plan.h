@@ -0,0 +1,72 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/* A plan is what validator install would read from a set of config
+ * files, compiled into one file, so that it can be installed from
+ * without parsing the config files or the keys (e.g. at boot).
+ *
+ * The file starts with VALIDATOR_PLAN_MAGIC, followed by the number of
+ * keys, the number of configs, the raw (32 byte) Ed25519 public keys,
+ * and then each config in order. A config is its flags, the number of
+ * its keys and their indexes in the key table, the number of sources,
+ * and then its destination, path_relative, path_prefix and manifest
+ * strings and its sources. Strings are their length (or
+ * PLAN_STRING_NONE when unset) followed by the string and a NUL, so
+ * they can be used where the file is mapped. Integers are 32bit little
+ * endian.
+ *
+ * The plan is not signed, so it must be kept where only trusted users
+ * can change it, just like the config files and keys it is made from. */
+
+#define VALIDATOR_PLAN_MAGIC "VALPLAN\001"
+#define VALIDATOR_PLAN_MAGIC_LEN 8
+
+typedef struct
+{
+  gboolean recursive;
+  gboolean force;
+  const char *destination;
+  const char **sources; /* NULL terminated */
+  const char *path_relative;
+  const char *path_prefix;
+  const char *manifest_path;
+  KeySet *keys;
+} PlanConfig;
+
+typedef struct _Plan Plan;
+typedef struct _PlanBuilder PlanBuilder;
+
+Plan *plan_load (const char *path, GError **error);
+void plan_free (Plan *plan);
+guint plan_get_n_configs (Plan *plan);
+const PlanConfig *plan_get_config (Plan *plan, guint i);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Plan, plan_free)
+
+PlanBuilder *plan_builder_new (void);
+void plan_builder_free (PlanBuilder *builder);
+gboolean plan_builder_add (PlanBuilder *builder, const PlanConfig *config, GError **error);
+gboolean plan_builder_write (PlanBuilder *builder, const char *path, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PlanBuilder, plan_builder_free)
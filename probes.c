@@ -0,0 +1,44 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "probes.h"
+
+#ifdef HAVE_SDT
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* Tracers find the semaphores through the probe notes, and increment
+ * them while attached */
+#define PROBE_SEMAPHORE(name)                                                                     \
+  unsigned short validator_##name##_semaphore __attribute__ ((section (".probes")));
+PROBE_NAMES (PROBE_SEMAPHORE)
+#undef PROBE_SEMAPHORE
+
+guint64
+probe_file_size (int dirfd, const char *name)
+{
+  struct stat st;
+  if (fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+    return 0;
+  return st.st_size;
+}
+#endif
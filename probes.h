@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#pragma once
+
+/* Static probes for perf and bpftrace, in the "validator" provider,
+ * e.g.: bpftrace -e 'usdt:./validator:validator:sha512__done { @[arg1] = count(); }'
+ *
+ * file__start (path, bytes), file__done (path, ok)
+ *     Around handling a file in sign, validate and install.
+ * sha512__start (path, bytes), sha512__done (path, bytes)
+ *     Hashing a file. Files hashed by the io_uring loader only have
+ *     sha512__done.
+ * verify__start (rel_path, bytes), verify__done (rel_path, key_index, valid)
+ *     Checking a signature of bytes of content (a digest or a symlink
+ *     target), key_index is the key that matched or -1.
+ * replace_file__start (path, bytes), replace_file__done (path, bytes, ok)
+ *     Putting an installed file in place, including the copy unless it
+ *     was made while hashing.
+ * config__start (path), config__done (path, ok)
+ *     Loading an install config file.
+ *
+ * Where the size of a file isn't known it is only looked up while a
+ * tracer is attached to the probe, as told by its semaphore.
+ *
+ * If configure didn't find sys/sdt.h, or with --disable-sdt, the probes
+ * and their arguments compile to nothing. */
+
+#include <glib.h>
+
+#ifdef HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_NAMES(X)                                                                            \
+  X (file__start)                                                                                 \
+  X (file__done)                                                                                  \
+  X (sha512__start)                                                                               \
+  X (sha512__done)                                                                                \
+  X (verify__start)                                                                               \
+  X (verify__done)                                                                                \
+  X (replace_file__start)                                                                         \
+  X (replace_file__done)                                                                          \
+  X (config__start)                                                                               \
+  X (config__done)
+
+#define PROBE_SEMAPHORE(name)                                                                     \
+  extern unsigned short validator_##name##_semaphore __attribute__ ((section (".probes")));
+PROBE_NAMES (PROBE_SEMAPHORE)
+#undef PROBE_SEMAPHORE
+
+#define PROBE1(name, a1) DTRACE_PROBE1 (validator, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2 (validator, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3 (validator, name, a1, a2, a3)
+#define PROBE_ENABLED(name) G_UNLIKELY (validator_##name##_semaphore != 0)
+
+guint64 probe_file_size (int dirfd, const char *name);
+#else
+#define PROBE1(name, a1) ((void)0)
+#define PROBE2(name, a1, a2) PROBE1 (name, a1)
+#define PROBE3(name, a1, a2, a3) PROBE1 (name, a1)
+#define PROBE_ENABLED(name) FALSE
+#define probe_file_size(dirfd, name) ((guint64)0)
+#endif
+
+/* The size of name in dirfd, or 0 when nothing traces probe */
+#define PROBE_FILE_SIZE(probe, dirfd, name)                                                       \
+  (PROBE_ENABLED (probe) ? probe_file_size (dirfd, name) : (guint64)0)
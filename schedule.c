@@ -0,0 +1,224 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "utils.h"
+
+#include "schedule.h"
+
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+/* Number of files read ahead of the one being handled */
+#define SCHEDULE_READAHEAD_FILES 8
+/* Only the start of large files is read ahead, so they don't push the
+ * files before them out of the page cache */
+#define SCHEDULE_READAHEAD_SIZE (4 * 1024 * 1024)
+/* Collected files are handled before more directories than this would
+ * be kept open, or fewer if the fd limit is low */
+#define SCHEDULE_MAX_DIRS 256
+
+typedef struct
+{
+  guint64 key;
+  guint64 ino;
+  WalkDir *dir;
+  char *name;
+  char *path;
+  gpointer data;
+} ScheduleItem;
+
+struct _Schedule
+{
+  ScheduleMode mode;
+  ScheduleFunc func;
+  GDestroyNotify data_free;
+  gpointer user_data;
+  GArray *items;
+  GHashTable *dirs;
+  guint max_dirs;
+  gboolean success;
+};
+
+gboolean
+schedule_mode_from_string (const char *str, ScheduleMode *mode_out)
+{
+  if (strcmp (str, "inode") == 0)
+    *mode_out = SCHEDULE_INODE;
+  else if (strcmp (str, "extent") == 0)
+    *mode_out = SCHEDULE_EXTENT;
+  else
+    return FALSE;
+  return TRUE;
+}
+
+static void
+schedule_item_clear (ScheduleItem *item, GDestroyNotify data_free)
+{
+  walk_dir_unref (item->dir);
+  g_free (item->name);
+  g_free (item->path);
+  if (item->data && data_free)
+    data_free (item->data);
+}
+
+Schedule *
+schedule_new (ScheduleMode mode, ScheduleFunc func, GDestroyNotify data_free, gpointer user_data)
+{
+  Schedule *schedule = g_new0 (Schedule, 1);
+  schedule->mode = mode;
+  schedule->func = func;
+  schedule->data_free = data_free;
+  schedule->user_data = user_data;
+  schedule->items = g_array_new (FALSE, FALSE, sizeof (ScheduleItem));
+  schedule->dirs = g_hash_table_new (NULL, NULL);
+  schedule->max_dirs = get_max_open_dirs (SCHEDULE_MAX_DIRS);
+  schedule->success = TRUE;
+  return schedule;
+}
+
+/* Unhandled files are dropped */
+void
+schedule_free (Schedule *schedule)
+{
+  for (guint i = 0; i < schedule->items->len; i++)
+    schedule_item_clear (&g_array_index (schedule->items, ScheduleItem, i), schedule->data_free);
+  g_array_unref (schedule->items);
+  g_hash_table_unref (schedule->dirs);
+  g_free (schedule);
+}
+
+/* Returns the physical offset of the first extent of name in dirfd, or 0
+ * if it is not known (e.g. the filesystem doesn't support FIEMAP, or the
+ * file is empty), which sorts such files first */
+static guint64
+get_first_extent (int dirfd, const char *name)
+{
+  autofd int fd
+      = openat (dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  struct
+  {
+    struct fiemap fiemap;
+    struct fiemap_extent extent;
+  } map = { { 0 } };
+  map.fiemap.fm_start = 0;
+  map.fiemap.fm_length = FIEMAP_MAX_OFFSET;
+  map.fiemap.fm_extent_count = 1;
+  if (ioctl (fd, FS_IOC_FIEMAP, &map) < 0 || map.fiemap.fm_mapped_extents == 0)
+    return 0;
+
+  return map.extent.fe_physical;
+}
+
+static gint
+cmp_items (gconstpointer a, gconstpointer b)
+{
+  const ScheduleItem *ia = a;
+  const ScheduleItem *ib = b;
+
+  if (ia->key != ib->key)
+    return ia->key < ib->key ? -1 : 1;
+  if (ia->ino != ib->ino)
+    return ia->ino < ib->ino ? -1 : 1;
+  return 0;
+}
+
+static void
+read_ahead (ScheduleItem *item)
+{
+  autofd int fd = openat (walk_dir_get_fd (item->dir), item->name,
+                          O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if (fd >= 0)
+    (void)posix_fadvise (fd, 0, SCHEDULE_READAHEAD_SIZE, POSIX_FADV_WILLNEED);
+}
+
+/* Handles all collected files in order. Failures are kept in
+ * schedule->success until the next schedule_flush(). */
+static void
+schedule_run (Schedule *schedule)
+{
+  /* Stolen, as handling a file may add more */
+  g_autoptr (GArray) items = g_steal_pointer (&schedule->items);
+  schedule->items = g_array_new (FALSE, FALSE, sizeof (ScheduleItem));
+  g_hash_table_remove_all (schedule->dirs);
+
+  g_array_sort (items, cmp_items);
+
+  if (items->len > 0)
+    g_debug ("Handling %u scheduled files", items->len);
+
+  guint read_ahead_end = 1;
+  for (guint i = 0; i < items->len; i++)
+    {
+      ScheduleItem *item = &g_array_index (items, ScheduleItem, i);
+
+      for (; read_ahead_end < items->len && read_ahead_end <= i + SCHEDULE_READAHEAD_FILES;
+           read_ahead_end++)
+        read_ahead (&g_array_index (items, ScheduleItem, read_ahead_end));
+
+      if (!schedule->func (item->dir, item->name, item->path, g_steal_pointer (&item->data),
+                           schedule->user_data))
+        schedule->success = FALSE;
+      schedule_item_clear (item, schedule->data_free);
+    }
+}
+
+/* Queues name in dir (found at path) to be handled by the schedule, with
+ * ino as from readdir. If this makes the schedule keep too many
+ * directories open, everything collected so far is handled now, and
+ * failures are reported by the next schedule_flush(). */
+void
+schedule_add (Schedule *schedule, WalkDir *dir, const char *name, const char *path, guint64 ino,
+              gpointer data)
+{
+  ScheduleItem item = { 0 };
+
+  item.ino = ino;
+  if (schedule->mode == SCHEDULE_EXTENT)
+    item.key = get_first_extent (walk_dir_get_fd (dir), name);
+  item.dir = walk_dir_ref (dir);
+  item.name = g_strdup (name);
+  item.path = g_strdup (path);
+  item.data = data;
+  g_array_append_val (schedule->items, item);
+  g_hash_table_add (schedule->dirs, dir);
+
+  if (g_hash_table_size (schedule->dirs) > schedule->max_dirs)
+    schedule_run (schedule);
+}
+
+/* Handles all collected files in order. Returns FALSE if handling any
+ * file since the last flush failed, including those handled early by
+ * schedule_add(). */
+gboolean
+schedule_flush (Schedule *schedule)
+{
+  schedule_run (schedule);
+
+  gboolean success = schedule->success;
+  schedule->success = TRUE;
+  return success;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "walk.h"
+
+/* With a cold page cache (as when booting), reading files in the order
+ * the directories list them makes the disk seek back and forth. A
+ * schedule collects the files of a walk instead, and then handles them in
+ * the order of their inode number, or of where their data starts on the
+ * disk (from FIEMAP), which tends to be the order they are stored in.
+ * While one file is handled, the kernel is asked to read ahead the next
+ * few ones.
+ *
+ * The directories of the collected files are kept open until they are
+ * handled, so collected files are handled early if they span too many
+ * directories. */
+
+typedef enum
+{
+  SCHEDULE_NONE,
+  SCHEDULE_INODE,
+  SCHEDULE_EXTENT,
+} ScheduleMode;
+
+typedef struct _Schedule Schedule;
+
+/* Handles a scheduled file, taking ownership of data */
+typedef gboolean (*ScheduleFunc) (WalkDir *dir, const char *name, const char *path,
+                                  gpointer data, gpointer user_data);
+
+gboolean schedule_mode_from_string (const char *str, ScheduleMode *mode_out);
+
+Schedule *schedule_new (ScheduleMode mode, ScheduleFunc func, GDestroyNotify data_free,
+                        gpointer user_data);
+void schedule_free (Schedule *schedule);
+void schedule_add (Schedule *schedule, WalkDir *dir, const char *name, const char *path,
+                   guint64 ino, gpointer data);
+gboolean schedule_flush (Schedule *schedule);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Schedule, schedule_free)
@@ -21,97 +21,398 @@
 #include "config.h"
 #include "main.h"
 
-static gboolean
-sign (const char *path, const char *relative_to)
+#include "jobs.h"
+#include "manifest.h"
+#include "probes.h"
+#include "walk.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Maximum number of signatures waiting to be written */
+#define SIGNATURE_WRITER_QUEUE_SIZE 256
+
+/* With --manifest, files are added to this instead of being signed */
+static ManifestBuilder *manifest_builder;
+
+typedef struct
 {
-  struct stat st;
-  gboolean success = TRUE;
+  char *path;
+  char *sig_path;
+  guchar *signature;
+  gsize signature_len;
+} PendingSignature;
+
+/* Writes signatures produced by the workers from a single thread. The
+ * queue is bounded so that fast signing can't run ahead of the disk, and
+ * all the signatures that are ready when the writer wakes up are written
+ * as one batch. */
+typedef struct
+{
+  Jobs *jobs;
+  GMutex lock;
+  GCond cond;
+  GPtrArray *pending;
+  gboolean done;
+  GThread *thread;
+} SignatureWriter;
 
-  int res = lstat (path, &st);
-  if (res < 0)
+typedef struct
+{
+  Signer *signer;
+  SignatureWriter *writer;
+} SignWorker;
+
+typedef struct
+{
+  WalkDir *dir;
+  char *name;
+  char *rel_path; /* NULL if not inside the relative dir */
+  int type;
+  gboolean has_sig;
+} SignJob;
+
+static void
+pending_signature_free (PendingSignature *pending)
+{
+  g_free (pending->path);
+  g_free (pending->sig_path);
+  g_free (pending->signature);
+  g_free (pending);
+}
+
+static gboolean
+write_signature (const char *sig_path, const guchar *signature, gsize signature_len,
+                 GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  if (!g_file_set_contents (sig_path, (char *)signature, signature_len, &local_error))
     {
-      g_printerr ("Can't access '%s': %s\n", path, strerror (errno));
+      g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                  "Failed to write file '%s': ", sig_path);
       return FALSE;
     }
 
-  int type = st.st_mode & S_IFMT;
-  if (type == S_IFREG || type == S_IFLNK)
+  return TRUE;
+}
+
+static gpointer
+signature_writer_thread (gpointer user_data)
+{
+  SignatureWriter *writer = user_data;
+
+  while (TRUE)
     {
-      g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+      g_mutex_lock (&writer->lock);
+      while (writer->pending->len == 0 && !writer->done)
+        g_cond_wait (&writer->cond, &writer->lock);
 
-      if (!opt_force && g_file_test (sig_path, G_FILE_TEST_EXISTS))
+      g_autoptr (GPtrArray) batch = g_steal_pointer (&writer->pending);
+      writer->pending = g_ptr_array_new_with_free_func ((GDestroyNotify)pending_signature_free);
+      gboolean done = writer->done;
+
+      g_cond_broadcast (&writer->cond);
+      g_mutex_unlock (&writer->lock);
+
+      for (guint i = 0; i < batch->len; i++)
         {
-          g_info ("File '%s' already signed, ignoring", path);
-          return TRUE; /* Already signed */
+          PendingSignature *pending = g_ptr_array_index (batch, i);
+
+          g_autoptr (GError) error = NULL;
+          if (!write_signature (pending->sig_path, pending->signature, pending->signature_len,
+                                &error))
+            jobs_report_error (writer->jobs, pending->path, g_steal_pointer (&error));
+          else
+            g_info ("Wrote signature '%s'", pending->sig_path);
         }
 
-      g_autofree guchar *content = NULL;
-      gsize content_len = 0;
+      if (done && batch->len == 0)
+        break;
+    }
+
+  return NULL;
+}
+
+static SignatureWriter *
+signature_writer_new (void)
+{
+  SignatureWriter *writer = g_new0 (SignatureWriter, 1);
+
+  g_mutex_init (&writer->lock);
+  g_cond_init (&writer->cond);
+  writer->pending = g_ptr_array_new_with_free_func ((GDestroyNotify)pending_signature_free);
+  writer->thread = g_thread_new ("validator-writer", signature_writer_thread, writer);
+
+  return writer;
+}
+
+/* Takes ownership of sig_path and signature */
+static void
+signature_writer_push (SignatureWriter *writer, const char *path, char *sig_path,
+                       guchar *signature, gsize signature_len)
+{
+  PendingSignature *pending = g_new0 (PendingSignature, 1);
+  pending->path = g_strdup (path);
+  pending->sig_path = sig_path;
+  pending->signature = signature;
+  pending->signature_len = signature_len;
+
+  g_mutex_lock (&writer->lock);
+  while (writer->pending->len >= SIGNATURE_WRITER_QUEUE_SIZE)
+    g_cond_wait (&writer->cond, &writer->lock);
+  g_ptr_array_add (writer->pending, pending);
+  g_cond_broadcast (&writer->cond);
+  g_mutex_unlock (&writer->lock);
+}
+
+/* Writes all remaining signatures and frees the writer */
+static void
+signature_writer_finish (SignatureWriter *writer)
+{
+  g_mutex_lock (&writer->lock);
+  writer->done = TRUE;
+  g_cond_broadcast (&writer->cond);
+  g_mutex_unlock (&writer->lock);
 
-      g_autoptr (GError) error = NULL;
-      if (!load_file_data_for_sign (path, &st, NULL, &content, &content_len, NULL, &error))
+  g_thread_join (writer->thread);
+
+  g_ptr_array_unref (writer->pending);
+  g_cond_clear (&writer->cond);
+  g_mutex_clear (&writer->lock);
+  g_free (writer);
+}
+
+/* Signs name in dir, as found by the walk, which has_sig says already
+ * has a signature file. If writer is NULL the signature is written
+ * directly. */
+static gboolean
+sign_file (WalkDir *dir, const char *name, const char *path, int type, const char *rel_path,
+           gboolean has_sig, Signer *signer, SignatureWriter *writer, GError **error)
+{
+  int dirfd = walk_dir_get_fd (dir);
+  g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+
+  stats_add (STATS_FILES, 1);
+
+  if (manifest_builder == NULL && !opt_force && has_sig)
+    {
+      g_info ("File '%s' already signed, ignoring", path);
+      stats_add (STATS_SKIPPED, 1);
+      return TRUE; /* Already signed */
+    }
+
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+
+  g_autoptr (GError) local_error = NULL;
+  if (opt_verity && type == S_IFREG)
+    {
+      type = VALIDATOR_TYPE_VERITY;
+      autofd int fd = open_regular_at (dirfd, name, path, NULL, NULL, &local_error);
+      if (fd < 0 || !get_verity_digest (path, fd, &content, &content_len, &local_error))
         {
-          g_printerr ("Failed to read file '%s': %s\n", path, error->message);
+          g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                      "Failed to sign file '%s': ", path);
           return FALSE;
         }
+    }
+  else if (!load_file_data_for_sign_at (dirfd, name, path, type, &content, &content_len, NULL,
+                                        &local_error))
+    {
+      g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                  "Failed to read file '%s': ", path);
+      return FALSE;
+    }
 
-      g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt_path_prefix);
-      if (rel_path == NULL)
+  if (rel_path == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File '%s' not inside relative dir",
+                   path);
+      return FALSE;
+    }
+
+  if (manifest_builder)
+    {
+      if (!manifest_builder_add (manifest_builder, rel_path, type, content, content_len,
+                                 &local_error))
         {
-          g_printerr ("File '%s' not inside relative dir\n", path);
+          g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                      "Failed to add file '%s' to manifest: ", path);
           return FALSE;
         }
+      return TRUE;
+    }
+
+  g_autofree guchar *signature = NULL;
+  gsize signature_len = 0;
+
+  if (!signer_sign (signer, type, rel_path, content, content_len, &signature, &signature_len,
+                    &local_error))
+    {
+      g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                  "Failed to sign file '%s': ", path);
+      return FALSE;
+    }
+
+  if (writer)
+    {
+      signature_writer_push (writer, path, g_steal_pointer (&sig_path),
+                             g_steal_pointer (&signature), signature_len);
+      return TRUE;
+    }
+
+  if (!write_signature (sig_path, signature, signature_len, error))
+    return FALSE;
+
+  g_info ("Wrote signature '%s' (for path %s)", sig_path, rel_path);
+
+  return TRUE;
+}
+
+static void
+sign_job_free (SignJob *job)
+{
+  walk_dir_unref (job->dir);
+  g_free (job->name);
+  g_free (job->rel_path);
+  g_free (job);
+}
+
+static gboolean
+sign_job (const char *path, gpointer job_data, gpointer worker_data, GError **error)
+{
+  SignJob *job = job_data;
+  SignWorker *worker = worker_data;
+
+  PROBE2 (file__start, path, PROBE_FILE_SIZE (file__start, walk_dir_get_fd (job->dir), job->name));
+  gboolean ok = sign_file (job->dir, job->name, path, job->type, job->rel_path, job->has_sig,
+                           worker->signer, worker->writer, error);
+  PROBE2 (file__done, path, ok);
+  return ok;
+}
+
+static gpointer
+sign_worker_new (gpointer user_data, GError **error)
+{
+  g_autoptr (Signer) signer = signer_new (opt_private_key, opt_embed_key_id, error);
+  if (signer == NULL)
+    return NULL;
+
+  SignWorker *worker = g_new0 (SignWorker, 1);
+  worker->signer = g_steal_pointer (&signer);
+  worker->writer = user_data;
+
+  return worker;
+}
 
-      g_autofree guchar *signature = NULL;
-      gsize signature_len = 0;
+static void
+sign_worker_free (SignWorker *worker)
+{
+  signer_free (worker->signer);
+  g_free (worker);
+}
+
+/* Signs name in parent, which is found at path. type is 0 if not yet
+ * known. rel_path is the relative path it is signed as, or NULL if it is
+ * not inside relative_to (which a child still might be). has_sig is TRUE
+ * if it already has a signature file.
+ *
+ * If jobs is non-NULL, files are queued on it, otherwise they are signed
+ * directly with signer. */
+static gboolean
+sign (WalkDir *parent, const char *name, const char *path, int type, const char *rel_path,
+      gboolean has_sig, const char *relative_to, Signer *signer, Jobs *jobs)
+{
+  gboolean success = TRUE;
+  g_autoptr (GError) error = NULL;
 
-      if (!sign_data (type, rel_path, content, content_len, opt_private_key, &signature,
-                      &signature_len, &error))
+  if (!walk_get_type (parent, name, path, &type, &error))
+    {
+      jobs_report_error (jobs, path, g_steal_pointer (&error));
+      return FALSE;
+    }
+
+  if (type == S_IFREG || type == S_IFLNK)
+    {
+      if (jobs)
         {
-          g_printerr ("Failed to sign file '%s': %s\n", path, error->message);
-          return FALSE;
+          SignJob *job = g_new0 (SignJob, 1);
+          job->dir = walk_dir_ref (parent);
+          job->name = g_strdup (name);
+          job->rel_path = g_strdup (rel_path);
+          job->type = type;
+          job->has_sig = has_sig;
+          jobs_push (jobs, path, job);
         }
-
-      if (!g_file_set_contents (sig_path, (char *)signature, signature_len, &error))
+      else
         {
-          g_printerr ("Failed to write file '%s': %s\n", sig_path, error->message);
-          return FALSE;
+          PROBE2 (file__start, path,
+                  PROBE_FILE_SIZE (file__start, walk_dir_get_fd (parent), name));
+          gboolean ok = sign_file (parent, name, path, type, rel_path, has_sig, signer, NULL,
+                                   &error);
+          PROBE2 (file__done, path, ok);
+          if (!ok)
+            {
+              jobs_report_error (NULL, path, g_steal_pointer (&error));
+              return FALSE;
+            }
         }
-
-      g_info ("Wrote signature '%s' (for path %s)", sig_path, rel_path);
     }
   else if (type == S_IFDIR)
     {
-      g_autoptr (GError) dir_error = NULL;
-      g_autoptr (GDir) dir = g_dir_open (path, 0, &dir_error);
+      g_autoptr (WalkDir) dir = walk_dir_open (parent, name, path, &error);
       if (dir == NULL)
         {
-          if (g_error_matches (dir_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+          if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
             return TRUE;
-          g_printerr ("Failed to open dir '%s': %s\n", path, strerror (errno));
+
+          jobs_report_error (jobs, path, g_steal_pointer (&error));
           return FALSE;
         }
 
-      const char *child;
-      while ((child = g_dir_read_name (dir)) != NULL)
+      g_autoptr (WalkEntries) entries = walk_dir_read_entries (dir, &error);
+      if (entries == NULL)
         {
-          if (g_str_has_suffix (child, ".sig"))
-            continue; /* Skip existing signatures */
+          jobs_report_error (jobs, path, g_steal_pointer (&error));
+          return FALSE;
+        }
 
-          g_autofree char *child_path = g_build_filename (path, child, NULL);
-          if (!sign (child_path, relative_to))
+      for (gsize i = 0; i < entries->n_entries; i++)
+        {
+          WalkEntry *child = &entries->entries[i];
+          g_autofree char *child_path = walk_child_path (path, child->name);
+          if (g_strcmp0 (child_path, opt_manifest) == 0)
+            continue;
+
+          g_autofree char *child_rel_path
+              = rel_path ? walk_child_path (rel_path, child->name)
+                         : opt_get_relative_path (child_path, relative_to, opt_path_prefix);
+          if (!sign (dir, child->name, child_path, child->type, child_rel_path, child->has_sig,
+                     relative_to, signer, jobs))
             success = FALSE;
         }
     }
   else
     {
-      g_printerr ("Unsupported file type for '%s'\n", path);
+      g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Unsupported file type for '%s'",
+                   path);
+      jobs_report_error (jobs, path, g_steal_pointer (&error));
       success = FALSE;
     }
 
   return success;
 }
 
+/* Signs the toplevel path, with relative paths relative to relative_to */
+static gboolean
+sign_toplevel (const char *path, const char *relative_to, Signer *signer, Jobs *jobs)
+{
+  g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt_path_prefix);
+  g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+  gboolean has_sig = access (sig_path, F_OK) == 0;
+  return sign (NULL, path, path, 0, rel_path, has_sig, relative_to, signer, jobs);
+}
+
 int
 cmd_sign (int argc, char *argv[])
 {
@@ -120,6 +421,36 @@ cmd_sign (int argc, char *argv[])
   if (argc == 1)
     help_error ("No input files given");
 
+  g_autoptr (ManifestBuilder) builder = NULL;
+  if (opt_manifest)
+    manifest_builder = builder = manifest_builder_new ();
+
+  g_autoptr (Signer) signer = NULL;
+  SignatureWriter *writer = NULL;
+  Jobs *jobs = NULL;
+  if (opt_jobs > 1)
+    {
+      writer = signature_writer_new ();
+      jobs = jobs_new (opt_jobs, sign_job, (GDestroyNotify)sign_job_free, sign_worker_new,
+                       (GDestroyNotify)sign_worker_free, writer, &error);
+      if (jobs == NULL)
+        {
+          signature_writer_finish (writer);
+          g_printerr ("error: %s\n", error->message);
+          return EXIT_FAILURE;
+        }
+      writer->jobs = jobs;
+    }
+  else
+    {
+      signer = signer_new (opt_private_key, opt_embed_key_id, &error);
+      if (signer == NULL)
+        {
+          g_printerr ("error: %s\n", error->message);
+          return EXIT_FAILURE;
+        }
+    }
+
   gboolean res = TRUE;
   for (gsize i = 1; i < argc; i++)
     {
@@ -130,20 +461,46 @@ cmd_sign (int argc, char *argv[])
           if (!opt_recursive)
             {
               g_printerr ("error: '%s' is a directory and not in recursive mode\n", path);
-              return EXIT_FAILURE;
+              res = FALSE;
+              break;
             }
 
-          if (!sign (path, opt_path_relative ? opt_path_relative : path))
+          if (!sign_toplevel (path, opt_path_relative ? opt_path_relative : path, signer, jobs))
             res = FALSE;
         }
       else
         {
           g_autofree char *dirname = g_path_get_dirname (path);
 
-          if (!sign (path, opt_path_relative ? opt_path_relative : dirname))
+          if (!sign_toplevel (path, opt_path_relative ? opt_path_relative : dirname, signer,
+                              jobs))
             res = FALSE;
         }
     }
 
+  if (jobs)
+    {
+      /* All signatures must be queued before the writer can be stopped,
+       * and written before the failures are reported */
+      jobs_wait (jobs);
+      signature_writer_finish (writer);
+      if (!jobs_finish (jobs))
+        res = FALSE;
+    }
+
+  /* Don't write a manifest that is missing files */
+  if (builder && res)
+    {
+      if (signer == NULL)
+        signer = signer_new (opt_private_key, opt_embed_key_id, &error);
+
+      if (signer == NULL || !manifest_builder_write (builder, opt_manifest, signer, &error))
+        {
+          g_printerr ("error: Can't write manifest '%s': %s\n", opt_manifest, error->message);
+          res = FALSE;
+        }
+    }
+  manifest_builder = NULL;
+
   return res ? EXIT_SUCCESS : EXIT_FAILURE;
 }
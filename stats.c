@@ -0,0 +1,231 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+
+#include "stats.h"
+
+typedef struct
+{
+  guint64 count;
+  gint64 usec;
+} StatsPhaseData;
+
+struct _StatsKey
+{
+  char *id;
+  guint64 verifies;
+  guint64 matches;
+};
+
+static const char *phase_names[N_STATS_PHASES] = {
+  "load_keys", "walk", "hash", "sign", "verify", "mkdir", "replace_file",
+};
+
+static const char *counter_names[N_STATS_COUNTERS] = {
+  "files", "skipped", "bytes_hashed", "bytes_copied", "syscalls", "cache_hits", "cache_misses",
+};
+
+static gboolean enabled;
+static gint64 run_start_time;
+static StatsPhaseData phases[N_STATS_PHASES];
+static guint64 counters[N_STATS_COUNTERS];
+
+/* Keys are only added when a verifier is created, so the lock is not
+ * taken while verifying */
+static GMutex keys_lock;
+static GPtrArray *keys;
+
+/* Marks the start of the run, for the wall clock time */
+void
+stats_start (void)
+{
+  run_start_time = g_get_monotonic_time ();
+}
+
+/* Must be called before any other threads are started */
+void
+stats_set_enabled (gboolean enable)
+{
+  enabled = enable;
+}
+
+gboolean
+stats_enabled (void)
+{
+  return enabled;
+}
+
+/* Returns the start time to pass to stats_phase_end(), without reading
+ * the clock if timings are disabled */
+gint64
+stats_phase_start (void)
+{
+  return enabled ? g_get_monotonic_time () : 0;
+}
+
+/* Returns the time since start_time (from stats_phase_start()), or 0 if
+ * timings are disabled */
+gint64
+stats_phase_elapsed (gint64 start_time)
+{
+  return enabled ? g_get_monotonic_time () - start_time : 0;
+}
+
+void
+stats_phase_add (StatsPhase phase, guint64 count, gint64 usec)
+{
+  if (!enabled)
+    return;
+
+  __atomic_add_fetch (&phases[phase].count, count, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&phases[phase].usec, usec, __ATOMIC_RELAXED);
+}
+
+/* Records one operation of phase, started at start_time (from
+ * stats_phase_start()) */
+void
+stats_phase_end (StatsPhase phase, gint64 start_time)
+{
+  if (enabled)
+    stats_phase_add (phase, 1, g_get_monotonic_time () - start_time);
+}
+
+void
+stats_phase_get (StatsPhase phase, guint64 *count_out, gint64 *usec_out)
+{
+  *count_out = __atomic_load_n (&phases[phase].count, __ATOMIC_RELAXED);
+  *usec_out = __atomic_load_n (&phases[phase].usec, __ATOMIC_RELAXED);
+}
+
+void
+stats_add (StatsCounter counter, guint64 value)
+{
+  __atomic_add_fetch (&counters[counter], value, __ATOMIC_RELAXED);
+}
+
+guint64
+stats_get (StatsCounter counter)
+{
+  return __atomic_load_n (&counters[counter], __ATOMIC_RELAXED);
+}
+
+static void
+stats_key_free (StatsKey *key)
+{
+  g_free (key->id);
+  g_free (key);
+}
+
+/* Returns the counters of the key with the given id, which live until
+ * the process exits */
+StatsKey *
+stats_get_key (const guchar *key_id, gsize key_id_len)
+{
+  g_autofree char *id = g_malloc (key_id_len * 2 + 1);
+  for (gsize i = 0; i < key_id_len; i++)
+    g_snprintf (id + 2 * i, 3, "%02x", key_id[i]);
+
+  g_mutex_lock (&keys_lock);
+  if (keys == NULL)
+    keys = g_ptr_array_new_with_free_func ((GDestroyNotify)stats_key_free);
+
+  StatsKey *key = NULL;
+  for (guint i = 0; key == NULL && i < keys->len; i++)
+    {
+      StatsKey *other = g_ptr_array_index (keys, i);
+      if (strcmp (other->id, id) == 0)
+        key = other;
+    }
+
+  if (key == NULL)
+    {
+      key = g_new0 (StatsKey, 1);
+      key->id = g_steal_pointer (&id);
+      g_ptr_array_add (keys, key);
+    }
+  g_mutex_unlock (&keys_lock);
+
+  return key;
+}
+
+/* key may be NULL, if it wasn't looked up as stats are disabled */
+void
+stats_key_add_verify (StatsKey *key, gboolean matched)
+{
+  if (key == NULL)
+    return;
+
+  __atomic_add_fetch (&key->verifies, 1, __ATOMIC_RELAXED);
+  if (matched)
+    __atomic_add_fetch (&key->matches, 1, __ATOMIC_RELAXED);
+}
+
+/* Writes everything recorded as a single line of JSON to path, or to
+ * stderr if path is NULL. The schema is the same for all commands. */
+gboolean
+stats_write (const char *path, const char *command, int exit_status, GError **error)
+{
+  gint64 wall_usec = g_get_monotonic_time () - run_start_time;
+
+  g_autoptr (GString) s = g_string_new ("{");
+  g_string_append_printf (s, "\"version\":\"%s\",\"command\":\"%s\",\"exit_status\":%d",
+                          PACKAGE_VERSION, command, exit_status);
+  g_string_append_printf (s, ",\"wall_seconds\":%.6f", wall_usec / (double)G_USEC_PER_SEC);
+
+  g_string_append (s, ",\"phases\":{");
+  for (int i = 0; i < N_STATS_PHASES; i++)
+    {
+      guint64 count;
+      gint64 usec;
+      stats_phase_get (i, &count, &usec);
+      g_string_append_printf (s, "%s\"%s\":{\"count\":%" G_GUINT64_FORMAT ",\"seconds\":%.6f}",
+                              i > 0 ? "," : "", phase_names[i], count,
+                              usec / (double)G_USEC_PER_SEC);
+    }
+
+  g_string_append (s, "},\"counters\":{");
+  for (int i = 0; i < N_STATS_COUNTERS; i++)
+    g_string_append_printf (s, "%s\"%s\":%" G_GUINT64_FORMAT, i > 0 ? "," : "",
+                            counter_names[i], stats_get (i));
+
+  g_string_append (s, "},\"keys\":[");
+  g_mutex_lock (&keys_lock);
+  for (guint i = 0; keys != NULL && i < keys->len; i++)
+    {
+      StatsKey *key = g_ptr_array_index (keys, i);
+      g_string_append_printf (s,
+                              "%s{\"id\":\"%s\",\"verifies\":%" G_GUINT64_FORMAT
+                              ",\"matches\":%" G_GUINT64_FORMAT "}",
+                              i > 0 ? "," : "", key->id, key->verifies, key->matches);
+    }
+  g_mutex_unlock (&keys_lock);
+  g_string_append (s, "]}\n");
+
+  if (path == NULL)
+    {
+      fputs (s->str, stderr);
+      return TRUE;
+    }
+
+  return g_file_set_contents (path, s->str, s->len, error);
+}
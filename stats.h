@@ -0,0 +1,78 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/* Process-wide counters and timings, for finding out where the time of
+ * a run went. Everything can be recorded from any thread. Phase times
+ * are summed over all threads, so with --jobs they can add up to more
+ * than the wall clock time, and phases can nest (e.g. the hashing done
+ * while installing a file).
+ *
+ * Counters are always kept, as they are cheap and some are reported
+ * with --verbose. Timings and per-key counts are only recorded once
+ * stats_set_enabled() was called, so that the clock isn't read for
+ * every file otherwise. */
+
+typedef enum
+{
+  STATS_PHASE_LOAD_KEYS,
+  STATS_PHASE_WALK,
+  STATS_PHASE_HASH,
+  STATS_PHASE_SIGN,
+  STATS_PHASE_VERIFY,
+  STATS_PHASE_MKDIR,
+  STATS_PHASE_REPLACE_FILE,
+} StatsPhase;
+
+#define N_STATS_PHASES (STATS_PHASE_REPLACE_FILE + 1)
+
+typedef enum
+{
+  STATS_FILES,
+  STATS_SKIPPED,
+  STATS_BYTES_HASHED,
+  STATS_BYTES_COPIED,
+  STATS_SYSCALLS,
+  STATS_CACHE_HITS,
+  STATS_CACHE_MISSES,
+} StatsCounter;
+
+#define N_STATS_COUNTERS (STATS_CACHE_MISSES + 1)
+
+typedef struct _StatsKey StatsKey;
+
+void stats_start (void);
+void stats_set_enabled (gboolean enabled);
+gboolean stats_enabled (void);
+gint64 stats_phase_start (void);
+gint64 stats_phase_elapsed (gint64 start_time);
+void stats_phase_add (StatsPhase phase, guint64 count, gint64 usec);
+void stats_phase_end (StatsPhase phase, gint64 start_time);
+void stats_phase_get (StatsPhase phase, guint64 *count_out, gint64 *usec_out);
+void stats_add (StatsCounter counter, guint64 value);
+guint64 stats_get (StatsCounter counter);
+
+StatsKey *stats_get_key (const guchar *key_id, gsize key_id_len);
+void stats_key_add_verify (StatsKey *key, gboolean matched);
+
+gboolean stats_write (const char *path, const char *command, int exit_status, GError **error);
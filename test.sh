@@ -53,7 +53,7 @@ assert_file_has_content () {
 }
 
 TMPDIR=$(mktemp -d /tmp/validator-test.XXXXXX)
-trap 'rm -rf -- "$TMPDIR"' EXIT
+trap 'rm -rf -- "$TMPDIR" ${SHMDIR:+"$SHMDIR"}' EXIT
 
 OUT=$TMPDIR/out
 COPY=$TMPDIR/copy
@@ -98,6 +98,56 @@ assert_has_file $CONTENT/dir/symlink2.sig
 HEADER Validate all
 $VALIDATOR validate -r --key=$PUBKEY $CONTENT
 
+HEADER Validate all in parallel
+$VALIDATOR validate -r -j 4 --key=$PUBKEY $CONTENT
+
+HEADER Validate all without io_uring
+$VALIDATOR validate -r --no-io-uring --key=$PUBKEY $CONTENT
+
+HEADER Validate all in disk order
+$VALIDATOR validate -r --schedule=inode --key=$PUBKEY $CONTENT
+$VALIDATOR validate -r --schedule=extent --key=$PUBKEY $CONTENT
+$VALIDATOR validate -r -j 4 --schedule=inode --key=$PUBKEY $CONTENT
+
+HEADER Validate more directories than the fd limit
+MANY=$TMPDIR/many
+for i in $(seq -w 1 300); do
+    mkdir -p $MANY/d$i
+    echo DATA$i > $MANY/d$i/f
+done
+$VALIDATOR sign -r --key=$SECKEY $MANY
+# Queued files keep their directory open
+(ulimit -n 128 && $VALIDATOR validate -r -j 2 --key=$PUBKEY $MANY) || fatal "Failed with -j 2"
+(ulimit -n 128 && $VALIDATOR validate -r --schedule=inode --key=$PUBKEY $MANY) \
+    || fatal "Failed with schedule"
+
+HEADER Disk order failures in more directories than are kept open
+rm $MANY/d001/f.sig
+if $VALIDATOR validate -r --schedule=inode --key=$PUBKEY $MANY 2> $OUT; then
+    fatal "Should fail with schedule"
+fi
+assert_file_has_content $OUT "No signature for .*d001/f"
+MANYCACHE="--cache=$TMPDIR/many.cache --cache-key=$TMPDIR/many.key --new-cache-key"
+if $VALIDATOR install -r --schedule=inode $MANYCACHE --key=$PUBKEY $MANY $TMPDIR/many-copy 2> $OUT; then
+    fatal "Should fail with schedule"
+fi
+if $VALIDATOR install -v -r $MANYCACHE --key=$PUBKEY $MANY $TMPDIR/many-copy 2> $OUT; then
+    fatal "Should fail after failing with schedule"
+fi
+if grep -q "Skipping unchanged" $OUT; then
+    fatal "Tree of failed install was cached"
+fi
+rm -rf $MANY $TMPDIR/many-copy $TMPDIR/many.cache $TMPDIR/many.key
+
+HEADER Validate all without caching
+$VALIDATOR --no-cache-pollution validate -r --key=$PUBKEY $CONTENT
+
+HEADER Validate with stats
+$VALIDATOR validate -r --stats=$OUT --key=$PUBKEY $CONTENT
+assert_file_has_content $OUT '"command":"validate","exit_status":0'
+assert_file_has_content $OUT '"files":5,'
+assert_file_has_content $OUT '"verifies":5,"matches":5'
+
 HEADER Validate individually
 $VALIDATOR validate --key=$PUBKEY $CONTENT/file1.txt
 $VALIDATOR validate --key=$PUBKEY $CONTENT/file2.txt
@@ -114,6 +164,14 @@ fi
 assert_file_has_content $OUT "No signature for .*file1.txt"
 assert_file_has_content $OUT "No signature for .*file3.txt"
 
+if $VALIDATOR validate -r -j 4 --key=$PUBKEY $CONTENT 2> $OUT; then
+   fatal "Should not have validated"
+fi
+assert_file_has_content $OUT "No signature for .*file1.txt"
+assert_file_has_content $OUT "No signature for .*file3.txt"
+# Parallel failures are reported sorted by path
+sort $OUT | cmp - $OUT
+
 if $VALIDATOR validate --key=$PUBKEY $CONTENT/file1.txt 2> $OUT; then
    fatal "Should not have validated"
 fi
@@ -144,10 +202,31 @@ fi
 assert_file_has_content $OUT "Signature of .*symlink1.* is invalid"
 assert_file_has_content $OUT "Signature of .*file3.txt.* is invalid"
 
+# Signature files are not followed if they are symlinks
+mv $CONTENT/file1.txt.sig $TMPDIR/file1.txt.sig
+ln -s $TMPDIR/file1.txt.sig $CONTENT/file1.txt.sig
+for jobs in 1 2; do
+    if $VALIDATOR validate -r -j $jobs --key=$PUBKEY $CONTENT 2> $OUT; then
+        fatal "Should not have validated"
+    fi
+    assert_file_has_content $OUT "Failed to load .*file1.txt.sig"
+done
+rm $CONTENT/file1.txt.sig
+mv $TMPDIR/file1.txt.sig $CONTENT/file1.txt.sig
+
 HEADER Re-Sign all forced
 $VALIDATOR sign -f -r --key=$SECKEY $CONTENT
 $VALIDATOR validate -r --key=$PUBKEY $CONTENT
 
+HEADER Re-Sign all forced in parallel
+cp -r $CONTENT $TMPDIR/content-serial
+$VALIDATOR sign -f -r -j 4 --key=$SECKEY $CONTENT
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+for i in file1.txt file2.txt symlink1 dir/file3.txt dir/symlink2  ; do
+    cmp $CONTENT/$i.sig $TMPDIR/content-serial/$i.sig
+done
+rm -rf $TMPDIR/content-serial
+
 HEADER Externally signed blob gives same result
 echo -n  $'VALIDTR\001' > $TMPDIR/sig_header
 for i in file1.txt file2.txt symlink1 dir/file3.txt dir/symlink2  ; do
@@ -157,6 +236,126 @@ for i in file1.txt file2.txt symlink1 dir/file3.txt dir/symlink2  ; do
     cmp $CONTENT/$i.sig $TMPDIR/blob.sig
 done
 
+HEADER Sign with embedded key id
+OTHERKEYS=$TMPDIR/otherkeys
+mkdir -p $OTHERKEYS
+for i in 1 2 3; do
+    openssl genpkey -algorithm ed25519 -outform PEM -out $TMPDIR/other.pem
+    openssl pkey -in $TMPDIR/other.pem -pubout -out $OTHERKEYS/other$i.pem
+done
+$VALIDATOR sign -f -r --embed-key-id --key=$SECKEY $CONTENT
+echo -n $'VALIDTR\002' > $TMPDIR/sig_header
+head -c 8 $CONTENT/file1.txt.sig | cmp - $TMPDIR/sig_header
+cp $PUBKEY $OTHERKEYS/
+$VALIDATOR validate -r --key-dir=$OTHERKEYS $CONTENT
+rm $OTHERKEYS/public.der
+if $VALIDATOR validate -r --key-dir=$OTHERKEYS $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Signature of .*file1.txt.* is invalid.*: Signed with unknown key"
+
+HEADER Validate with cache
+CACHE=$TMPDIR/cache/validator.cache
+mkdir -p $TMPDIR/cache
+if $VALIDATOR validate -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_not_has_file $TMPDIR/cache/key
+head -c 16 /dev/urandom > $TMPDIR/cache/key
+if $VALIDATOR validate -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Cache key .* is too short"
+rm $TMPDIR/cache/key
+$VALIDATOR validate -v -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --new-cache-key --key=$PUBKEY $CONTENT 2> $OUT
+assert_file_has_content $OUT "Created new cache key" "Cache had 0 hits and 3 misses"
+$VALIDATOR validate -v -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --key=$PUBKEY $CONTENT 2> $OUT
+assert_file_has_content $OUT "file1.txt is valid (as file1.txt, cached)" "Cache had 3 hits and 0 misses"
+cp $CONTENT/file1.txt $TMPDIR/file1.txt.orig
+echo wrong > $CONTENT/file1.txt
+if $VALIDATOR validate -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Signature of .*file1.txt.* is invalid"
+cp $TMPDIR/file1.txt.orig $CONTENT/file1.txt
+echo -n XXXXXXXX | dd of=$CACHE bs=1 seek=20 conv=notrunc 2> /dev/null
+$VALIDATOR validate -v -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --key=$PUBKEY $CONTENT 2> $OUT
+assert_file_has_content $OUT "Ignoring invalid cache" "Cache had 0 hits and 3 misses"
+$VALIDATOR install -v -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --key=$PUBKEY $CONTENT $TMPDIR/cache-copy 2> $OUT
+$VALIDATOR install -v -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --key=$PUBKEY $CONTENT $TMPDIR/cache-copy 2> $OUT
+assert_file_has_content $OUT "Skipping unchanged .*content"
+rm $TMPDIR/cache-copy/dir/file3.txt
+$VALIDATOR install -v -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --key=$PUBKEY $CONTENT $TMPDIR/cache-copy 2> $OUT
+assert_has_file $TMPDIR/cache-copy/dir/file3.txt
+# Only what was used by the last run is kept
+$VALIDATOR validate -v -r --cache=$CACHE --cache-key=$TMPDIR/cache/key --key=$PUBKEY --relative-to=$CONTENT $CONTENT/dir 2> $OUT
+assert_file_has_content $OUT "Cache had 1 hits and 0 misses" "Wrote cache .* with 1 records and 0 trees"
+
+HEADER Sign with fs-verity digest
+mkdir -p $TMPDIR/verity
+echo VERITYDATA > $TMPDIR/verity/file.txt
+if fsverity enable $TMPDIR/verity/file.txt 2> /dev/null; then
+    $VALIDATOR sign --verity --key=$SECKEY $TMPDIR/verity/file.txt
+    $VALIDATOR validate -v --key=$PUBKEY $TMPDIR/verity/file.txt 2> $OUT
+    assert_file_has_content $OUT "file.txt is valid (as file.txt, fs-verity)"
+    $VALIDATOR install --key=$PUBKEY $TMPDIR/verity/file.txt $TMPDIR/verity-copy
+    cmp $TMPDIR/verity/file.txt $TMPDIR/verity-copy/file.txt
+else
+    echo "fs-verity not available, only testing failure"
+    if $VALIDATOR sign --verity --key=$SECKEY $TMPDIR/verity/file.txt 2> $OUT; then
+        fatal "Should fail"
+    fi
+    assert_file_has_content $OUT "doesn't have fs-verity enabled"
+fi
+
+HEADER Copy across filesystems
+# A reflink can't cross filesystems, so one of the fallbacks is used
+SHMDIR=$(mktemp -d /dev/shm/validator-test.XXXXXX 2> /dev/null || true)
+if [ -n "$SHMDIR" ] && [ "$(stat -c %d $SHMDIR)" != "$(stat -c %d $TMPDIR)" ]; then
+    head -c 3000000 /dev/urandom > $SHMDIR/big.bin
+    $VALIDATOR sign --key=$SECKEY $SHMDIR/big.bin
+    mkdir -p $TMPDIR/shm-copy
+    echo old > $TMPDIR/shm-copy/big.bin
+    $VALIDATOR install -v -v --force --key=$PUBKEY $SHMDIR/big.bin $TMPDIR/shm-copy 2> $OUT
+    assert_file_has_content $OUT "Copied .*big.bin' using \(copy_file_range\|sendfile\|read_write\)"
+    cmp $SHMDIR/big.bin $TMPDIR/shm-copy/big.bin
+else
+    echo "No second filesystem, skipping"
+fi
+
+HEADER Sign and validate with manifest
+MANIFEST=$TMPDIR/manifest/content.manifest
+mkdir -p $TMPDIR/manifest $TMPDIR/manifest-copy
+$VALIDATOR sign -r --manifest=$MANIFEST --key=$SECKEY $CONTENT
+assert_has_file $MANIFEST.sig
+$VALIDATOR validate -r --manifest=$MANIFEST --key=$PUBKEY $CONTENT
+$VALIDATOR install -r --manifest=$MANIFEST --key=$PUBKEY $CONTENT $TMPDIR/manifest-copy
+cmp $CONTENT/dir/file3.txt $TMPDIR/manifest-copy/dir/file3.txt
+# Manifest and file signatures can't be swapped
+if $VALIDATOR validate --key=$PUBKEY $MANIFEST 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Signature of .*content.manifest.* is invalid"
+cp $MANIFEST.sig $TMPDIR/manifest.sig.orig
+$VALIDATOR sign --force --key=$SECKEY $MANIFEST
+if $VALIDATOR validate -r --manifest=$MANIFEST --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Signature of manifest .* is invalid"
+mv $TMPDIR/manifest.sig.orig $MANIFEST.sig
+echo NEWDATA > $CONTENT/file2.txt
+echo UNSIGNED > $CONTENT/unsigned.txt
+if $VALIDATOR validate -r --manifest=$MANIFEST --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Signature of .*file2.txt.* is invalid.*: Doesn't match manifest"
+assert_file_has_content $OUT "No signature for .*unsigned.txt.* in manifest"
+echo >> $MANIFEST
+if $VALIDATOR validate -r --manifest=$MANIFEST --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Signature of manifest .* is invalid"
+
 # Reset content
 gencontent $CONTENT
 
@@ -192,6 +391,37 @@ assert_has_file $COPY/dir/symlink2
 # Dir with no validated file in should not be created
 assert_not_has_dir $COPY/unused
 
+HEADER Reinstall unchanged should not rewrite
+INODE=$(stat -c %i $COPY/file1.txt)
+$VALIDATOR install -v -f -r --key=$PUBKEY $CONTENT $COPY 2> $OUT
+assert_file_has_content $OUT "File .*file1.txt' is unchanged, ignoring" "File .*symlink1' is unchanged, ignoring"
+assert_file_has_content $OUT "Installed 0 files, skipped"
+[ "$(stat -c %i $COPY/file1.txt)" = "$INODE" ] || fatal "file1.txt was rewritten"
+echo changed > $COPY/file1.txt
+$VALIDATOR install -v -f -r --key=$PUBKEY $CONTENT $COPY 2> $OUT
+assert_file_has_content $OUT "Installed 1 files, skipped"
+cmp $CONTENT/file1.txt $COPY/file1.txt
+# Same size and mtime, but other content
+touch -r $COPY/file1.txt $TMPDIR/file1.mtime
+echo FILEDATAX > $COPY/file1.txt
+touch -r $TMPDIR/file1.mtime $COPY/file1.txt
+$VALIDATOR install -v -f -r --key=$PUBKEY $CONTENT $COPY 2> $OUT
+assert_file_has_content $OUT "Installed 1 files, skipped"
+cmp $CONTENT/file1.txt $COPY/file1.txt
+# Same content, but writable by others, which is replaced without reading it
+chmod 0666 $COPY/file1.txt
+$VALIDATOR install -v -v -f -r --key=$PUBKEY $CONTENT $COPY 2> $OUT
+assert_file_has_content $OUT "Installed 1 files, skipped"
+[ "$(grep -c "Hashed .*file1.txt" $OUT)" = 1 ] || fatal "file1.txt was not hashed exactly once"
+[ "$(stat -c %a $COPY/file1.txt)" != 666 ] || fatal "file1.txt is still writable by others"
+
+HEADER Install in disk order
+rm -rf $COPY
+$VALIDATOR install -r --schedule=extent --key=$PUBKEY $CONTENT $COPY
+cmp $CONTENT/file1.txt $COPY/file1.txt
+cmp $CONTENT/dir/file3.txt $COPY/dir/file3.txt
+assert_has_file $COPY/dir/symlink2
+
 HEADER "Install signed should succeed (config)"
 
 rm -rf $COPY
@@ -224,7 +454,15 @@ HEADER "Install signed should succeed (configdir)"
 rm -rf $COPY
 mkdir -p $COPY
 
+# Keys are not loaded for configs with nothing to install
+cat > $CONFIGDIR/nosources.conf <<- EOF
+[install]
+keys=$TMPDIR/missing.pem
+sources=$TMPDIR/missing
+destination=$COPY
+EOF
 $VALIDATOR install --config-dir=$CONFIGDIR
+rm $CONFIGDIR/nosources.conf
 
 assert_has_file $COPY/file1.txt
 cmp $CONTENT/file1.txt $COPY/file1.txt
@@ -238,6 +476,32 @@ assert_has_file $COPY/dir/symlink2
 # Dir with no validated file in should not be created
 assert_not_has_dir $COPY/unused
 
+HEADER "Install independent configs in parallel"
+
+rm -rf $COPY $COPY.2
+sed "s|^destination=.*|destination=$COPY.2|" $CONFIGDIR/test.conf > $CONFIGDIR/test2.conf
+$VALIDATOR install -v -j 2 --config-dir=$CONFIGDIR 2> $OUT
+rm $CONFIGDIR/test2.conf
+
+assert_file_has_content $OUT "Installing 2 configs in 2 independent groups"
+cmp $CONTENT/dir/file3.txt $COPY/dir/file3.txt
+cmp $CONTENT/dir/file3.txt $COPY.2/dir/file3.txt
+rm -rf $COPY.2
+
+HEADER "Install signed should succeed (plan)"
+
+rm -rf $COPY
+$VALIDATOR compile-plan --config-dir=$CONFIGDIR $TMPDIR/boot.plan
+$VALIDATOR install -v --plan=$TMPDIR/boot.plan 2> $OUT
+
+assert_file_has_content $OUT "Loaded plan .* with 1 configs"
+if grep -q "Loaded public key" $OUT; then
+    fatal "Keys should not be loaded with a plan"
+fi
+cmp $CONTENT/file1.txt $COPY/file1.txt
+cmp $CONTENT/dir/file3.txt $COPY/dir/file3.txt
+assert_has_file $COPY/dir/symlink2
+
 HEADER Partial install
 rm -rf $COPY
 mkdir -p $COPY
@@ -252,8 +516,17 @@ fi
 assert_file_has_content $OUT "No signature for .*symlink2"
 assert_file_has_content $OUT "Signature of .*file2.txt.* is invalid"
 
+if $VALIDATOR install -r --schedule=inode --key=$PUBKEY $CONTENT $COPY 2> $OUT; then
+    fatal "Should fail with schedule"
+fi
+assert_file_has_content $OUT "Signature of .*file2.txt.* is invalid"
+
 assert_has_file $COPY/file1.txt
 assert_not_has_file $COPY/file2.txt
+# The rejected copy must not be left behind
+if ls $COPY | grep -q "^file2.txt."; then
+    fatal "Temporary file left for file2.txt"
+fi
 assert_has_file $COPY/symlink1
 assert_has_file $COPY/dir/file3.txt
 assert_not_has_file $COPY/dir/symlink2
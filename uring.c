@@ -0,0 +1,637 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "probes.h"
+#include "uring.h"
+#include "utils.h"
+
+#ifdef HAVE_IO_URING
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Number of files loaded concurrently. Each has at most two operations
+ * in flight, one on the file and one on its signature. */
+#define URING_SLOTS 16
+#define URING_ENTRIES (2 * URING_SLOTS)
+#define URING_READ_SIZE (128 * 1024)
+
+typedef enum
+{
+  OP_NONE,
+  OP_OPEN,
+  OP_READ,
+  OP_CLOSE,
+} UringOp;
+
+typedef struct
+{
+  UringOp op;
+  int fd;
+  guint64 offset;
+  int errsv;
+} UringFileState;
+
+typedef struct
+{
+  gboolean in_use;
+  int dirfd;
+  char *name;
+  char *sig_name;
+  char *path;
+  gpointer data;
+  gint64 start_time;
+
+  UringFileState file;
+  gboolean not_regular;
+  EVP_MD_CTX *ctx;
+  guchar *buf;
+
+  UringFileState sig;
+  char sig_buf[VALIDATOR_MAX_SIGNATURE_SIZE];
+  gsize sig_len;
+} UringSlot;
+
+struct _UringLoader
+{
+  int ring_fd;
+
+  void *sq_ring;
+  gsize sq_ring_size;
+  void *cq_ring;
+  gsize cq_ring_size;
+  struct io_uring_sqe *sqes;
+  gsize sqes_size;
+
+  guint32 *sq_head;
+  guint32 *sq_tail;
+  guint32 sq_mask;
+  guint32 *sq_array;
+  guint32 *cq_head;
+  guint32 *cq_tail;
+  guint32 cq_mask;
+  struct io_uring_cqe *cqes;
+
+  guint to_submit;
+  guint in_flight;
+  /* Set once io_uring_enter() failed, files are then loaded synchronously */
+  gboolean failed;
+
+  UringSlot slots[URING_SLOTS];
+  guint n_busy;
+
+  UringLoadedFunc loaded_func;
+  gpointer user_data;
+};
+
+#define SLOT_USER_DATA(slot_index, is_sig) (((guint64)(slot_index) << 1) | ((is_sig) ? 1 : 0))
+
+static int
+sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  stats_add (STATS_SYSCALLS, 1);
+  return (int)syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register (int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int)syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static gboolean
+uring_supports_ops (int ring_fd)
+{
+  const int needed_ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+  gsize probe_size = sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op);
+  g_autofree struct io_uring_probe *probe = g_malloc0 (probe_size);
+
+  if (sys_io_uring_register (ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    return FALSE;
+
+  for (gsize i = 0; i < G_N_ELEMENTS (needed_ops); i++)
+    {
+      int op = needed_ops[i];
+      if (op > probe->last_op || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+uring_loader_free (UringLoader *loader)
+{
+  for (guint i = 0; i < URING_SLOTS; i++)
+    {
+      EVP_MD_CTX_free (loader->slots[i].ctx);
+      g_free (loader->slots[i].buf);
+    }
+
+  if (loader->sqes)
+    munmap (loader->sqes, loader->sqes_size);
+  if (loader->cq_ring && loader->cq_ring != loader->sq_ring)
+    munmap (loader->cq_ring, loader->cq_ring_size);
+  if (loader->sq_ring)
+    munmap (loader->sq_ring, loader->sq_ring_size);
+  if (loader->ring_fd >= 0)
+    close (loader->ring_fd);
+  g_free (loader);
+}
+
+UringLoader *
+uring_loader_new (UringLoadedFunc loaded_func, gpointer user_data)
+{
+  UringLoader *loader = g_new0 (UringLoader, 1);
+  loader->loaded_func = loaded_func;
+  loader->user_data = user_data;
+
+  struct io_uring_params params = { 0 };
+  loader->ring_fd = sys_io_uring_setup (URING_ENTRIES, &params);
+  if (loader->ring_fd < 0)
+    {
+      g_debug ("io_uring not available: %s", strerror (errno));
+      uring_loader_free (loader);
+      return NULL;
+    }
+
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 || !uring_supports_ops (loader->ring_fd))
+    {
+      g_debug ("io_uring too old, not using it");
+      uring_loader_free (loader);
+      return NULL;
+    }
+
+  loader->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (guint32);
+  loader->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  loader->sq_ring_size = loader->cq_ring_size = MAX (loader->sq_ring_size, loader->cq_ring_size);
+
+  loader->sq_ring = mmap (NULL, loader->sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, loader->ring_fd, IORING_OFF_SQ_RING);
+  if (loader->sq_ring == MAP_FAILED)
+    {
+      loader->sq_ring = NULL;
+      uring_loader_free (loader);
+      return NULL;
+    }
+  loader->cq_ring = loader->sq_ring;
+
+  loader->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  loader->sqes = mmap (NULL, loader->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       loader->ring_fd, IORING_OFF_SQES);
+  if (loader->sqes == MAP_FAILED)
+    {
+      loader->sqes = NULL;
+      uring_loader_free (loader);
+      return NULL;
+    }
+
+  char *sq = loader->sq_ring;
+  loader->sq_head = (guint32 *)(sq + params.sq_off.head);
+  loader->sq_tail = (guint32 *)(sq + params.sq_off.tail);
+  loader->sq_mask = *(guint32 *)(sq + params.sq_off.ring_mask);
+  loader->sq_array = (guint32 *)(sq + params.sq_off.array);
+
+  char *cq = loader->cq_ring;
+  loader->cq_head = (guint32 *)(cq + params.cq_off.head);
+  loader->cq_tail = (guint32 *)(cq + params.cq_off.tail);
+  loader->cq_mask = *(guint32 *)(cq + params.cq_off.ring_mask);
+  loader->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  for (guint i = 0; i < URING_SLOTS; i++)
+    {
+      loader->slots[i].ctx = EVP_MD_CTX_new ();
+      if (loader->slots[i].ctx == NULL)
+        {
+          uring_loader_free (loader);
+          return NULL;
+        }
+      loader->slots[i].buf = g_malloc (URING_READ_SIZE);
+    }
+
+  return loader;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe (UringLoader *loader)
+{
+  guint32 tail = *loader->sq_tail;
+  guint32 index = tail & loader->sq_mask;
+  struct io_uring_sqe *sqe = &loader->sqes[index];
+
+  /* We never have more operations than entries in flight */
+  g_assert (loader->in_flight + loader->to_submit < URING_ENTRIES);
+
+  memset (sqe, 0, sizeof (*sqe));
+  loader->sq_array[index] = index;
+  __atomic_store_n (loader->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  loader->to_submit++;
+
+  return sqe;
+}
+
+static void
+uring_queue_open (UringLoader *loader, guint slot_index, gboolean is_sig)
+{
+  UringSlot *slot = &loader->slots[slot_index];
+  UringFileState *state = is_sig ? &slot->sig : &slot->file;
+  struct io_uring_sqe *sqe = uring_get_sqe (loader);
+
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = slot->dirfd;
+  sqe->addr = (guint64)(guintptr)(is_sig ? slot->sig_name : slot->name);
+  /* As in open_regular_at(), so a file that was replaced by a FIFO or a
+   * device after the walk can't block the open */
+  sqe->open_flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+  sqe->user_data = SLOT_USER_DATA (slot_index, is_sig);
+  state->op = OP_OPEN;
+}
+
+static void
+uring_queue_read (UringLoader *loader, guint slot_index, gboolean is_sig)
+{
+  UringSlot *slot = &loader->slots[slot_index];
+  UringFileState *state = is_sig ? &slot->sig : &slot->file;
+  struct io_uring_sqe *sqe = uring_get_sqe (loader);
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = state->fd;
+  sqe->off = state->offset;
+  if (is_sig)
+    {
+      sqe->addr = (guint64)(guintptr)(slot->sig_buf + slot->sig_len);
+      sqe->len = sizeof (slot->sig_buf) - slot->sig_len;
+    }
+  else
+    {
+      sqe->addr = (guint64)(guintptr)slot->buf;
+      sqe->len = URING_READ_SIZE;
+    }
+  sqe->user_data = SLOT_USER_DATA (slot_index, is_sig);
+  state->op = OP_READ;
+}
+
+static void
+uring_queue_close (UringLoader *loader, guint slot_index, gboolean is_sig)
+{
+  UringSlot *slot = &loader->slots[slot_index];
+  UringFileState *state = is_sig ? &slot->sig : &slot->file;
+
+  if (state->fd < 0)
+    {
+      state->op = OP_NONE;
+      return;
+    }
+
+  struct io_uring_sqe *sqe = uring_get_sqe (loader);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = state->fd;
+  sqe->user_data = SLOT_USER_DATA (slot_index, is_sig);
+  state->fd = -1;
+  state->op = OP_CLOSE;
+}
+
+static void
+uring_slot_complete (UringLoader *loader, UringSlot *slot)
+{
+  UringLoadResult result = { 0 };
+  g_autofree guchar *digest = NULL;
+
+  result.path = slot->path;
+  result.data = slot->data;
+
+  if (slot->sig.errsv != 0)
+    g_set_error (&result.signature_error, G_FILE_ERROR, g_file_error_from_errno (slot->sig.errsv),
+                 "Can't read %s.sig: %s", slot->path, strerror (slot->sig.errsv));
+  else if (slot->sig_len == sizeof (slot->sig_buf))
+    g_set_error (&result.signature_error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                 "Signature %s.sig is too large", slot->path);
+  else
+    {
+      result.signature = slot->sig_buf;
+      result.signature_len = slot->sig_len;
+    }
+
+  if (slot->not_regular)
+    g_set_error (&result.digest_error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                 "%s is not a regular file", slot->path);
+  else if (slot->file.errsv != 0)
+    g_set_error (&result.digest_error, G_FILE_ERROR, g_file_error_from_errno (slot->file.errsv),
+                 "Can't read %s: %s", slot->path, strerror (slot->file.errsv));
+  else
+    {
+      guint digest_len = EVP_MD_CTX_size (slot->ctx);
+      digest = g_malloc (digest_len);
+      if (EVP_DigestFinal_ex (slot->ctx, digest, &digest_len) == 0)
+        g_set_error (&result.digest_error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                     "Can't compute sha512 operation");
+      else
+        {
+          result.digest = digest;
+          result.digest_len = digest_len;
+          sha512_add_stats (slot->file.offset, stats_phase_elapsed (slot->start_time));
+          PROBE2 (sha512__done, slot->path, (guint64)slot->file.offset);
+        }
+    }
+
+  loader->loaded_func (&result, loader->user_data);
+
+  g_clear_error (&result.signature_error);
+  g_clear_error (&result.digest_error);
+  g_clear_pointer (&slot->name, g_free);
+  g_clear_pointer (&slot->sig_name, g_free);
+  g_clear_pointer (&slot->path, g_free);
+  slot->in_use = FALSE;
+  loader->n_busy--;
+}
+
+static void
+uring_handle_cqe (UringLoader *loader, struct io_uring_cqe *cqe)
+{
+  guint slot_index = cqe->user_data >> 1;
+  gboolean is_sig = (cqe->user_data & 1) != 0;
+  UringSlot *slot = &loader->slots[slot_index];
+  UringFileState *state = is_sig ? &slot->sig : &slot->file;
+  int res = cqe->res;
+
+  switch (state->op)
+    {
+    case OP_OPEN:
+      if (res < 0)
+        {
+          state->errsv = -res;
+          state->op = OP_NONE;
+        }
+      else
+        {
+          state->fd = res;
+
+          /* A device would never reach the end of the file. The signature
+           * is only read up to the size of its buffer. */
+          struct stat st;
+          if (!is_sig && fstat (state->fd, &st) < 0)
+            state->errsv = errno;
+          else if (!is_sig && !S_ISREG (st.st_mode))
+            slot->not_regular = TRUE;
+
+          if (state->errsv != 0 || slot->not_regular)
+            uring_queue_close (loader, slot_index, is_sig);
+          else
+            uring_queue_read (loader, slot_index, is_sig);
+        }
+      break;
+
+    case OP_READ:
+      if (res == -EAGAIN)
+        {
+          /* Older kernels don't wait for data of files opened with
+           * O_NONBLOCK, it isn't needed once the file is open */
+          (void)fcntl (state->fd, F_SETFL, 0);
+          uring_queue_read (loader, slot_index, is_sig);
+        }
+      else if (res == -EINTR)
+        uring_queue_read (loader, slot_index, is_sig);
+      else if (res < 0)
+        {
+          state->errsv = -res;
+          uring_queue_close (loader, slot_index, is_sig);
+        }
+      else if (is_sig)
+        {
+          slot->sig_len += res;
+          state->offset += res;
+          if (res == 0 || slot->sig_len == sizeof (slot->sig_buf))
+            uring_queue_close (loader, slot_index, is_sig);
+          else
+            uring_queue_read (loader, slot_index, is_sig);
+        }
+      else if (res == 0)
+        uring_queue_close (loader, slot_index, is_sig);
+      else
+        {
+          if (EVP_DigestUpdate (slot->ctx, slot->buf, res) == 0)
+            {
+              state->errsv = EIO;
+              uring_queue_close (loader, slot_index, is_sig);
+              break;
+            }
+          drop_page_cache (state->fd, state->offset, res);
+          state->offset += res;
+          uring_queue_read (loader, slot_index, is_sig);
+        }
+      break;
+
+    case OP_CLOSE:
+      state->op = OP_NONE;
+      break;
+
+    case OP_NONE:
+    default:
+      g_assert_not_reached ();
+    }
+
+  if (slot->file.op == OP_NONE && slot->sig.op == OP_NONE)
+    uring_slot_complete (loader, slot);
+}
+
+/* Loads a file without the ring, as the synchronous path would */
+static void
+uring_load_sync (UringLoader *loader, int dirfd, const char *name, const char *path,
+                 gpointer data)
+{
+  UringLoadResult result = { 0 };
+  g_autofree guchar *digest = NULL;
+  g_autofree char *sig_name = g_strconcat (name, ".sig", NULL);
+  char sig_buf[VALIDATOR_MAX_SIGNATURE_SIZE];
+
+  result.path = path;
+  result.data = data;
+
+  if (load_signature_at (dirfd, sig_name, sig_buf, sizeof (sig_buf), &result.signature_len,
+                         &result.signature_error))
+    result.signature = sig_buf;
+
+  autofd int fd = open_regular_at (dirfd, name, path, NULL, NULL, &result.digest_error);
+  if (fd >= 0)
+    digest = (guchar *)sha512_fd (fd, -1, SHA512_FD_DROP_CACHE, path, &result.digest_len,
+                                  &result.digest_error);
+  result.digest = digest;
+
+  loader->loaded_func (&result, loader->user_data);
+
+  g_clear_error (&result.signature_error);
+  g_clear_error (&result.digest_error);
+}
+
+/* Gives up on the ring after an error, and loads the files that were in
+ * flight synchronously instead. Closing the ring cancels what the kernel
+ * still had queued, but opens that already completed have fds that only
+ * their completions know about. */
+static void
+uring_fail (UringLoader *loader, int errsv)
+{
+  g_info ("io_uring_enter failed: %s, loading files synchronously", strerror (errsv));
+
+  guint32 head = *loader->cq_head;
+  guint32 tail = __atomic_load_n (loader->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+    {
+      struct io_uring_cqe *cqe = &loader->cqes[head & loader->cq_mask];
+      UringSlot *slot = &loader->slots[cqe->user_data >> 1];
+      UringFileState *state = (cqe->user_data & 1) != 0 ? &slot->sig : &slot->file;
+      if (state->op == OP_OPEN && cqe->res >= 0)
+        close (cqe->res);
+    }
+  __atomic_store_n (loader->cq_head, head, __ATOMIC_RELEASE);
+
+  loader->failed = TRUE;
+  close (loader->ring_fd);
+  loader->ring_fd = -1;
+  loader->to_submit = loader->in_flight = 0;
+
+  for (guint i = 0; i < URING_SLOTS; i++)
+    {
+      UringSlot *slot = &loader->slots[i];
+      if (!slot->in_use)
+        continue;
+
+      close_fd (&slot->file.fd);
+      close_fd (&slot->sig.fd);
+      uring_load_sync (loader, slot->dirfd, slot->name, slot->path, slot->data);
+
+      g_clear_pointer (&slot->name, g_free);
+      g_clear_pointer (&slot->sig_name, g_free);
+      g_clear_pointer (&slot->path, g_free);
+      slot->in_use = FALSE;
+      loader->n_busy--;
+    }
+}
+
+/* Submits queued operations and handles at least one completion */
+static void
+uring_run (UringLoader *loader)
+{
+  int res;
+
+  do
+    res = sys_io_uring_enter (loader->ring_fd, loader->to_submit, 1, IORING_ENTER_GETEVENTS);
+  while (res < 0 && errno == EINTR);
+
+  if (res < 0)
+    {
+      uring_fail (loader, errno);
+      return;
+    }
+
+  loader->in_flight += res;
+  loader->to_submit -= res;
+
+  guint32 head = *loader->cq_head;
+  guint32 tail = __atomic_load_n (loader->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail)
+    {
+      struct io_uring_cqe cqe = loader->cqes[head & loader->cq_mask];
+      head++;
+      __atomic_store_n (loader->cq_head, head, __ATOMIC_RELEASE);
+      loader->in_flight--;
+
+      uring_handle_cqe (loader, &cqe);
+    }
+}
+
+void
+uring_loader_add (UringLoader *loader, int dirfd, const char *name, const char *path,
+                  gpointer data)
+{
+  while (loader->n_busy == URING_SLOTS)
+    uring_run (loader);
+
+  if (loader->failed)
+    {
+      uring_load_sync (loader, dirfd, name, path, data);
+      return;
+    }
+
+  guint slot_index = 0;
+  while (loader->slots[slot_index].in_use)
+    slot_index++;
+
+  UringSlot *slot = &loader->slots[slot_index];
+  slot->in_use = TRUE;
+  slot->dirfd = dirfd;
+  slot->name = g_strdup (name);
+  slot->sig_name = g_strconcat (name, ".sig", NULL);
+  slot->path = g_strdup (path);
+  slot->data = data;
+  slot->start_time = stats_phase_start ();
+  slot->file = (UringFileState){ OP_NONE, -1, 0, 0 };
+  slot->not_regular = FALSE;
+  slot->sig = (UringFileState){ OP_NONE, -1, 0, 0 };
+  slot->sig_len = 0;
+  if (EVP_DigestInit_ex (slot->ctx, EVP_sha512 (), NULL) == 0)
+    slot->file.errsv = EIO;
+  else
+    uring_queue_open (loader, slot_index, FALSE);
+  uring_queue_open (loader, slot_index, TRUE);
+  loader->n_busy++;
+}
+
+/* Waits for all added files to be loaded, and frees the loader */
+void
+uring_loader_finish (UringLoader *loader)
+{
+  while (loader->n_busy > 0)
+    uring_run (loader);
+
+  uring_loader_free (loader);
+}
+
+#else /* !HAVE_IO_URING */
+
+UringLoader *
+uring_loader_new (UringLoadedFunc loaded_func, gpointer user_data)
+{
+  return NULL;
+}
+
+void
+uring_loader_add (UringLoader *loader, int dirfd, const char *name, const char *path,
+                  gpointer data)
+{
+  g_assert_not_reached ();
+}
+
+void
+uring_loader_finish (UringLoader *loader)
+{
+  g_assert_not_reached ();
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/* Loads the signature and the sha512 digest of many regular files at
+ * once, keeping the opens, reads and closes of several files in flight
+ * with io_uring. Only available when built with io_uring support, and
+ * uring_loader_new() returns NULL if the kernel doesn't support it, in
+ * which case files should be loaded synchronously. If io_uring fails
+ * later on, the loader falls back to loading files synchronously itself.
+ *
+ * Files are opened as name (and name.sig) relative to dirfd, which must
+ * stay open until the file is loaded. They are reported as path. */
+
+typedef struct _UringLoader UringLoader;
+
+typedef struct
+{
+  const char *path;
+  gpointer data;
+
+  /* Set on success, otherwise signature_error is set */
+  char *signature;
+  gsize signature_len;
+  GError *signature_error;
+
+  /* Set on success, otherwise digest_error is set */
+  guchar *digest;
+  gsize digest_len;
+  GError *digest_error;
+} UringLoadResult;
+
+typedef void (*UringLoadedFunc) (UringLoadResult *result, gpointer user_data);
+
+UringLoader *uring_loader_new (UringLoadedFunc loaded_func, gpointer user_data);
+void uring_loader_add (UringLoader *loader, int dirfd, const char *name, const char *path,
+                       gpointer data);
+void uring_loader_finish (UringLoader *loader);
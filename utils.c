@@ -21,18 +21,28 @@
 #include <config.h>
 
 #include "utils.h"
+#include "probes.h"
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#ifdef HAVE_LINUX_FSVERITY_H
+#include <linux/fsverity.h>
+#endif
 #include <openssl/err.h>
 #include <openssl/pem.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+/* Max bytes per copy_file_range()/sendfile() call */
+#define COPY_FD_CHUNK_SIZE (1024 * 1024 * 1024)
+
 void
-free_keys (GList *keys)
+oom (void)
 {
-  for (GList *l = keys; l != NULL; l = l->next)
-    EVP_PKEY_free (l->data);
-  g_list_free (keys);
+  g_error ("Out of memory");
 }
 
 static const char *
@@ -74,10 +84,57 @@ fail_ssl (GError **error, const char *msg, ...)
   return FALSE;
 }
 
+/* Each public key file is only parsed once per process, as long as it
+ * is unchanged, so that config files using the same keys share them */
+typedef struct
+{
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  EVP_PKEY *key;
+} CachedPubKey;
+
+static GMutex pub_key_cache_lock;
+static GHashTable *pub_key_cache; /* Canonical path -> CachedPubKey */
+
+static gboolean
+cached_pub_key_matches (CachedPubKey *cached, const struct stat *st)
+{
+  return cached->dev == st->st_dev && cached->ino == st->st_ino
+         && cached->mtime.tv_sec == st->st_mtim.tv_sec
+         && cached->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void
+cached_pub_key_free (CachedPubKey *cached)
+{
+  EVP_PKEY_free (cached->key);
+  g_free (cached);
+}
+
 EVP_PKEY *
 load_pub_key (const char *path, GError **error)
 {
   g_autoptr (FILE) file = NULL;
+  g_autofree char *canonical = g_canonicalize_filename (path, NULL);
+  struct stat st;
+
+  if (stat (canonical, &st) == 0)
+    {
+      g_mutex_lock (&pub_key_cache_lock);
+      CachedPubKey *cached
+          = pub_key_cache ? g_hash_table_lookup (pub_key_cache, canonical) : NULL;
+      EVP_PKEY *key = NULL;
+      if (cached && cached_pub_key_matches (cached, &st) && EVP_PKEY_up_ref (cached->key) == 1)
+        key = cached->key;
+      g_mutex_unlock (&pub_key_cache_lock);
+
+      if (key)
+        {
+          g_debug ("Reusing public key '%s'", path);
+          return key;
+        }
+    }
 
   file = fopen (path, "rb");
   if (file == NULL)
@@ -96,6 +153,23 @@ load_pub_key (const char *path, GError **error)
 
   g_info ("Loaded public key '%s'", path);
 
+  /* What was parsed is the file as opened, whatever the path is now */
+  if (fstat (fileno (file), &st) == 0 && EVP_PKEY_up_ref (pkey) == 1)
+    {
+      CachedPubKey *cached = g_new0 (CachedPubKey, 1);
+      cached->dev = st.st_dev;
+      cached->ino = st.st_ino;
+      cached->mtime = st.st_mtim;
+      cached->key = pkey;
+
+      g_mutex_lock (&pub_key_cache_lock);
+      if (pub_key_cache == NULL)
+        pub_key_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)cached_pub_key_free);
+      g_hash_table_replace (pub_key_cache, g_steal_pointer (&canonical), cached);
+      g_mutex_unlock (&pub_key_cache_lock);
+    }
+
   return g_steal_pointer (&pkey);
 }
 
@@ -125,19 +199,14 @@ load_priv_key (const char *path, GError **error)
 }
 
 gboolean
-load_pub_keys_from_dir (const char *key_dir, GList **out_keys, GError **error)
+load_pub_keys_from_dir (const char *key_dir, KeySet *keys, GError **error)
 {
-  GList *keys = NULL;
-
   g_autoptr (GError) my_error = NULL;
   g_autoptr (GDir) dir = g_dir_open (key_dir, 0, &my_error);
   if (dir == NULL)
     {
       if (g_error_matches (my_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-        {
-          *out_keys = NULL;
-          return TRUE;
-        }
+        return TRUE;
 
       g_propagate_prefixed_error (error, my_error, "Can't enumerate key dir %s: ", key_dir);
       return FALSE;
@@ -161,33 +230,179 @@ load_pub_keys_from_dir (const char *key_dir, GList **out_keys, GError **error)
         }
       else
         {
-          keys = g_list_prepend (keys, g_steal_pointer (&pkey));
+          key_set_add (keys, pkey);
         }
     }
 
-  *out_keys = keys;
   return TRUE;
 }
 
-guchar *
-make_sign_blob (const char *rel_path, int type, const guchar *content, gsize content_len,
-                gsize *out_size, GError **error)
+/* The key id is the sha256 of the raw public key. Returns FALSE for key
+ * types that have no raw form, which can then only be used for v1
+ * signatures. */
+gboolean
+get_key_id (EVP_PKEY *key, guchar *key_id_out)
 {
-  gsize rel_path_len = strlen (rel_path);
-  gsize to_sign_len = 1 + rel_path_len + 1 + content_len;
-  g_autofree guchar *to_sign = g_malloc (to_sign_len);
+  guchar raw[256];
+  gsize raw_len = sizeof (raw);
+
+  if (EVP_PKEY_get_raw_public_key (key, raw, &raw_len) != 1)
+    {
+      ERR_clear_error ();
+      return FALSE;
+    }
+
+  return EVP_Digest (raw, raw_len, key_id_out, NULL, EVP_sha256 (), NULL) == 1;
+}
+
+typedef struct
+{
+  guchar id[VALIDATOR_KEY_ID_LEN];
+  EVP_PKEY *key;
+  guint index; /* In KeySet.keys */
+} KeySetEntry;
+
+struct _KeySet
+{
+  gint ref_count;
+  /* In the order added, for v1 signatures */
+  GPtrArray *keys;
+  /* Key id -> KeySetEntry, for v2 signatures */
+  GHashTable *by_id;
+  /* sha256 of the ids of all keys, in order */
+  guchar fingerprint[VALIDATOR_KEY_ID_LEN];
+  GByteArray *ids;
+};
+
+static guint
+key_id_hash (gconstpointer v)
+{
+  /* Key ids are already uniformly distributed */
+  guint hash;
+  memcpy (&hash, v, sizeof (hash));
+  return hash;
+}
+
+static gboolean
+key_id_equal (gconstpointer v1, gconstpointer v2)
+{
+  return memcmp (v1, v2, VALIDATOR_KEY_ID_LEN) == 0;
+}
+
+KeySet *
+key_set_new (void)
+{
+  KeySet *keys = g_new0 (KeySet, 1);
+  keys->ref_count = 1;
+  keys->keys = g_ptr_array_new_with_free_func ((GDestroyNotify)EVP_PKEY_free);
+  keys->by_id = g_hash_table_new_full (key_id_hash, key_id_equal, NULL, g_free);
+  keys->ids = g_byte_array_new ();
+  EVP_Digest (NULL, 0, keys->fingerprint, NULL, EVP_sha256 (), NULL);
+  return keys;
+}
+
+/* Key sets are shared by all config files that list the same keys */
+KeySet *
+key_set_ref (KeySet *keys)
+{
+  g_atomic_int_inc (&keys->ref_count);
+  return keys;
+}
+
+void
+key_set_unref (KeySet *keys)
+{
+  if (!g_atomic_int_dec_and_test (&keys->ref_count))
+    return;
+
+  g_byte_array_unref (keys->ids);
+  g_hash_table_unref (keys->by_id);
+  g_ptr_array_unref (keys->keys);
+  g_free (keys);
+}
+
+/* Adds a reference to key */
+void
+key_set_add (KeySet *keys, EVP_PKEY *key)
+{
+  EVP_PKEY_up_ref (key);
+  g_ptr_array_add (keys->keys, key);
+
+  g_autofree KeySetEntry *entry = g_new0 (KeySetEntry, 1);
+  if (!get_key_id (key, entry->id))
+    return;
+
+  g_byte_array_append (keys->ids, entry->id, VALIDATOR_KEY_ID_LEN);
+  EVP_Digest (keys->ids->data, keys->ids->len, keys->fingerprint, NULL, EVP_sha256 (), NULL);
+
+  if (g_hash_table_contains (keys->by_id, entry->id))
+    return;
+
+  entry->key = key;
+  entry->index = keys->keys->len - 1;
+  guchar *key_id = entry->id;
+  g_hash_table_insert (keys->by_id, key_id, g_steal_pointer (&entry));
+}
+
+guint
+key_set_get_size (KeySet *keys)
+{
+  return keys->keys->len;
+}
+
+/* Returns the i:th key added, without adding a reference */
+EVP_PKEY *
+key_set_get_key (KeySet *keys, guint i)
+{
+  return g_ptr_array_index (keys->keys, i);
+}
+
+/* Identifies the set of keys, so results of validating with it can be
+ * remembered */
+const guchar *
+key_set_get_fingerprint (KeySet *keys)
+{
+  return keys->fingerprint;
+}
+
+EVP_PKEY *
+key_set_lookup (KeySet *keys, const guchar *key_id)
+{
+  KeySetEntry *entry = g_hash_table_lookup (keys->by_id, key_id);
+  return entry ? entry->key : NULL;
+}
 
-  guchar *dst = to_sign;
+/* Builds the blob to sign in *buf, growing it as needed, so callers
+ * handling many files can reuse the same buffer */
+static gboolean
+make_sign_blob_in (const char *rel_path, int type, const guchar *content, gsize content_len,
+                   guchar **buf, gsize *buf_size, gsize *out_size, GError **error)
+{
+  guchar type_byte;
   if (type == S_IFREG)
-    *dst++ = 0;
+    type_byte = 0;
   else if (type == S_IFLNK)
-    *dst++ = 1;
+    type_byte = 1;
+  else if (type == VALIDATOR_TYPE_VERITY)
+    type_byte = 2;
+  else if (type == VALIDATOR_TYPE_MANIFEST)
+    type_byte = 3;
   else
     {
       g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Unsupported file type");
-      return NULL;
+      return FALSE;
     }
 
+  gsize rel_path_len = strlen (rel_path);
+  gsize to_sign_len = 1 + rel_path_len + 1 + content_len;
+  if (*buf == NULL || *buf_size < to_sign_len)
+    {
+      *buf_size = MAX (to_sign_len, 2 * *buf_size);
+      *buf = g_realloc (*buf, *buf_size);
+    }
+
+  guchar *dst = *buf;
+  *dst++ = type_byte;
   memcpy (dst, rel_path, rel_path_len);
   dst += rel_path_len;
   *dst++ = 0;
@@ -195,66 +410,365 @@ make_sign_blob (const char *rel_path, int type, const guchar *content, gsize con
   dst += content_len;
 
   *out_size = to_sign_len;
+  return TRUE;
+}
+
+guchar *
+make_sign_blob (const char *rel_path, int type, const guchar *content, gsize content_len,
+                gsize *out_size, GError **error)
+{
+  g_autofree guchar *to_sign = NULL;
+  gsize to_sign_size = 0;
+
+  if (!make_sign_blob_in (rel_path, type, content, content_len, &to_sign, &to_sign_size, out_size,
+                          error))
+    return NULL;
+
   return g_steal_pointer (&to_sign);
 }
 
-gboolean
-validate_data (const char *rel_path, int type, guchar *content, gsize content_len, char *sig,
-               gsize sig_size, GList *pub_keys, GError **error)
+struct _Verifier
+{
+  KeySet *keys;
+  /* One context per key in keys->keys, initialized once and copied for
+   * each verify to avoid redoing EVP_DigestVerifyInit() per file */
+  EVP_MD_CTX **templates;
+  /* Where the verifies with each key are counted */
+  StatsKey **stats_keys;
+  EVP_MD_CTX *ctx;
+  /* Reused for the blob of each file */
+  guchar *blob;
+  gsize blob_size;
+  /* Key that last matched a v1 signature */
+  guint last_key_index;
+  /* Key of the last valid signature, or -1 */
+  int signed_by;
+};
+
+/* The verifier holds a reference to keys, and no keys must be added to
+ * them afterwards. Like the EVP contexts it contains, a verifier must
+ * only be used by one thread at a time. */
+Verifier *
+verifier_new (KeySet *keys, GError **error)
 {
-  if (sig_size < VALIDATOR_SIGNATURE_MAGIC_LEN
-      || memcmp (sig, VALIDATOR_SIGNATURE_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN) != 0)
+  g_autoptr (Verifier) verifier = g_new0 (Verifier, 1);
+  verifier->keys = key_set_ref (keys);
+  verifier->templates = g_new0 (EVP_MD_CTX *, keys->keys->len);
+  verifier->stats_keys = g_new0 (StatsKey *, keys->keys->len);
+  verifier->signed_by = -1;
+
+  verifier->ctx = EVP_MD_CTX_new ();
+  if (verifier->ctx == NULL)
     {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid signature");
-      return FALSE;
+      fail_ssl (error, "Can't init context");
+      return NULL;
     }
-  /* Skip past header */
-  sig += VALIDATOR_SIGNATURE_MAGIC_LEN;
-  sig_size -= VALIDATOR_SIGNATURE_MAGIC_LEN;
 
-  gsize to_sign_len;
-  g_autofree guchar *to_sign
-      = make_sign_blob (rel_path, type, content, content_len, &to_sign_len, error);
-  if (to_sign == NULL)
-    return FALSE;
+  for (guint i = 0; i < keys->keys->len; i++)
+    {
+      verifier->templates[i] = EVP_MD_CTX_new ();
+      if (verifier->templates[i] == NULL)
+        {
+          fail_ssl (error, "Can't init context");
+          return NULL;
+        }
 
-  gboolean valid = FALSE;
-  for (GList *l = pub_keys; l != NULL; l = l->next)
+      if (EVP_DigestVerifyInit (verifier->templates[i], NULL, NULL, NULL,
+                                g_ptr_array_index (keys->keys, i))
+          == 0)
+        {
+          fail_ssl (error, "Can't initialzie digest verify operation");
+          return NULL;
+        }
+
+      if (stats_enabled ())
+        {
+          guchar key_id[VALIDATOR_KEY_ID_LEN] = { 0 };
+          (void)get_key_id (g_ptr_array_index (keys->keys, i), key_id);
+          verifier->stats_keys[i] = stats_get_key (key_id, sizeof (key_id));
+        }
+    }
+
+  return g_steal_pointer (&verifier);
+}
+
+void
+verifier_free (Verifier *verifier)
+{
+  for (guint i = 0; i < verifier->keys->keys->len; i++)
+    EVP_MD_CTX_free (verifier->templates[i]);
+  g_free (verifier->templates);
+  g_free (verifier->stats_keys);
+  EVP_MD_CTX_free (verifier->ctx);
+  g_free (verifier->blob);
+  key_set_unref (verifier->keys);
+  g_free (verifier);
+}
+
+/* Returns 1 if valid, 0 if not and -1 on error */
+static int
+verify_with_key (Verifier *verifier, guint key_index, const guchar *sig, gsize sig_size,
+                 const guchar *blob, gsize blob_len, GError **error)
+{
+  if (EVP_MD_CTX_copy_ex (verifier->ctx, verifier->templates[key_index]) == 0)
+    {
+      fail_ssl (error, "Can't initialzie digest verify operation");
+      return -1;
+    }
+
+  gint64 start_time = stats_phase_start ();
+  int res = EVP_DigestVerify (verifier->ctx, sig, sig_size, blob, blob_len);
+  stats_phase_end (STATS_PHASE_VERIFY, start_time);
+  stats_key_add_verify (verifier->stats_keys[key_index], res == 1);
+  if (res != 0 && res != 1)
     {
-      EVP_PKEY *key = l->data;
+      fail_ssl (error, "Error validating digest");
+      return -1;
+    }
 
-      g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
-      if (!ctx)
-        return fail_ssl (error, "Can't init context");
+  return res;
+}
 
-      if (EVP_DigestVerifyInit (ctx, NULL, NULL, NULL, key) == 0)
-        return fail_ssl (error, "Can't initialzie digest verify operation");
+/* Strips the header from sig, and returns the index of the key that
+ * signed it for v2 signatures, or -1 for v1 signatures which can be
+ * signed with any key */
+static gboolean
+parse_signature (Verifier *verifier, const char **sig, gsize *sig_size, int *key_index_out,
+                 GError **error)
+{
+  if (*sig_size >= VALIDATOR_SIGNATURE_MAGIC_LEN
+      && memcmp (*sig, VALIDATOR_SIGNATURE_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN) == 0)
+    {
+      *sig += VALIDATOR_SIGNATURE_MAGIC_LEN;
+      *sig_size -= VALIDATOR_SIGNATURE_MAGIC_LEN;
+      *key_index_out = -1;
+      return TRUE;
+    }
 
-      int res = EVP_DigestVerify (ctx, (unsigned char *)sig, sig_size, (unsigned char *)to_sign,
-                                  to_sign_len);
-      if (res == 1)
+  if (*sig_size >= VALIDATOR_SIGNATURE_MAGIC_LEN + VALIDATOR_KEY_ID_LEN
+      && memcmp (*sig, VALIDATOR_SIGNATURE_MAGIC_V2, VALIDATOR_SIGNATURE_MAGIC_LEN) == 0)
+    {
+      /* v2 signatures name their key, so only that one is tried */
+      KeySetEntry *signed_by
+          = g_hash_table_lookup (verifier->keys->by_id, *sig + VALIDATOR_SIGNATURE_MAGIC_LEN);
+      if (signed_by == NULL)
         {
-          valid = TRUE;
-          break;
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Signed with unknown key");
+          return FALSE;
         }
-      else if (res != 0)
-        return fail_ssl (error, "Error validating digest");
+      *sig += VALIDATOR_SIGNATURE_MAGIC_LEN + VALIDATOR_KEY_ID_LEN;
+      *sig_size -= VALIDATOR_SIGNATURE_MAGIC_LEN + VALIDATOR_KEY_ID_LEN;
+      *key_index_out = signed_by->index;
+      return TRUE;
     }
 
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid signature");
+  return FALSE;
+}
+
+static gboolean
+verify_blob (Verifier *verifier, int key_index, const char *sig, gsize sig_size,
+             const guchar *blob, gsize blob_len, GError **error)
+{
+  if (key_index >= 0)
+    {
+      if (verify_with_key (verifier, key_index, (const guchar *)sig, sig_size, blob, blob_len,
+                           error)
+          != 1)
+        return FALSE;
+      verifier->signed_by = key_index;
+      return TRUE;
+    }
+
+  /* The files in a tree are normally all signed with the same key, so
+   * start with the one that matched last time */
+  guint n_keys = verifier->keys->keys->len;
+  for (guint i = 0; i < n_keys; i++)
+    {
+      guint index = (verifier->last_key_index + i) % n_keys;
+      int res
+          = verify_with_key (verifier, index, (const guchar *)sig, sig_size, blob, blob_len, error);
+      if (res == 1)
+        verifier->last_key_index = verifier->signed_by = index;
+      if (res != 0)
+        return res == 1;
+    }
+
+  return FALSE;
+}
+
+gboolean
+verifier_verify (Verifier *verifier, const char *rel_path, int type, const guchar *content,
+                 gsize content_len, const char *sig, gsize sig_size, GError **error)
+{
+  int key_index;
+  if (!parse_signature (verifier, &sig, &sig_size, &key_index, error))
+    return FALSE;
+
+  gsize blob_len;
+  if (!make_sign_blob_in (rel_path, type, content, content_len, &verifier->blob,
+                          &verifier->blob_size, &blob_len, error))
+    return FALSE;
+
+  PROBE2 (verify__start, rel_path, (guint64)content_len);
+  gboolean valid
+      = verify_blob (verifier, key_index, sig, sig_size, verifier->blob, blob_len, error);
+  PROBE3 (verify__done, rel_path, valid ? verifier->signed_by : -1, valid);
   return valid;
 }
 
-static char *
-sha512_file (const char *path, gsize *digest_len_out, int *fd_out, GError **error)
+/* Gets the id of the key that made the last valid signature. Returns
+ * FALSE if nothing was validated yet, or the key has no id. */
+gboolean
+verifier_get_signed_by (Verifier *verifier, guchar *key_id_out)
 {
-  autofd int fd = open (path, O_RDONLY);
+  if (verifier->signed_by < 0)
+    return FALSE;
+
+  return get_key_id (g_ptr_array_index (verifier->keys->keys, verifier->signed_by), key_id_out);
+}
+
+/* Each thread keeps the verifier of the last key set it checked with */
+static GPrivate cached_verifier = G_PRIVATE_INIT ((GDestroyNotify)verifier_free);
+
+gboolean
+validate_data (const char *rel_path, int type, guchar *content, gsize content_len, char *sig,
+               gsize sig_size, KeySet *pub_keys, GError **error)
+{
+  /* The verifier holds a ref on the keys it was made for, so a matching
+   * pointer can't be a new key set at the same address */
+  Verifier *verifier = g_private_get (&cached_verifier);
+  if (verifier == NULL || verifier->keys != pub_keys)
+    {
+      Verifier *new_verifier = verifier_new (pub_keys, error);
+      if (new_verifier == NULL)
+        return FALSE;
+
+      if (verifier != NULL)
+        verifier_free (verifier);
+      verifier = new_verifier;
+      g_private_set (&cached_verifier, verifier);
+    }
+
+  return verifier_verify (verifier, rel_path, type, content, content_len, sig, sig_size, error);
+}
+
+/* Reads a signature file into buf, which should be at least
+ * VALIDATOR_MAX_SIGNATURE_SIZE bytes, so no allocation is needed. A
+ * symlink in place of the signature file is not followed. */
+gboolean
+load_signature (const char *sig_path, char *buf, gsize buf_size, gsize *len_out, GError **error)
+{
+  return load_signature_at (AT_FDCWD, sig_path, buf, buf_size, len_out, error);
+}
+
+/* Like load_signature(), with sig_path relative to dirfd */
+gboolean
+load_signature_at (int dirfd, const char *sig_path, char *buf, gsize buf_size, gsize *len_out,
+                   GError **error)
+{
+  autofd int fd = openat (dirfd, sig_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
   if (fd < 0)
     {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open %s: %s", path,
-                   strerror (errno));
-      return NULL;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open %s: %s",
+                   sig_path, strerror (errno));
+      return FALSE;
+    }
+
+  gsize len = 0;
+  while (len < buf_size)
+    {
+      ssize_t res = read (fd, buf + len, buf_size - len);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't read %s: %s",
+                       sig_path, strerror (errno));
+          return FALSE;
+        }
+      else if (res == 0)
+        break;
+
+      len += res;
+    }
+
+  if (len == buf_size)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Signature %s is too large", sig_path);
+      return FALSE;
     }
 
+  *len_out = len;
+  return TRUE;
+}
+
+/* Files at least this big are hashed with a larger buffer and a
+ * sequential readahead hint */
+#define SHA512_LARGE_FILE_SIZE (1024 * 1024)
+#define SHA512_LARGE_BUFFER_SIZE (1024 * 1024)
+
+static GPrivate sha512_large_buffer = G_PRIVATE_INIT (free);
+
+static gboolean drop_page_cache_enabled;
+
+/* If enabled, file data that is only read for hashing is dropped from the
+ * page cache again, so validating doesn't evict anybody else's pages */
+void
+set_drop_page_cache (gboolean enabled)
+{
+  drop_page_cache_enabled = enabled;
+}
+
+void
+drop_page_cache (int fd, off_t offset, off_t len)
+{
+  if (drop_page_cache_enabled)
+    (void)posix_fadvise (fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+static guchar *
+get_sha512_large_buffer (void)
+{
+  void *buf = g_private_get (&sha512_large_buffer);
+  if (buf == NULL)
+    {
+      /* Page aligned, which helps the kernel copy out large reads */
+      if (posix_memalign (&buf, sysconf (_SC_PAGESIZE), SHA512_LARGE_BUFFER_SIZE) != 0)
+        oom ();
+      g_private_set (&sha512_large_buffer, buf);
+    }
+  return buf;
+}
+
+/* Records bytes hashed outside of sha512_fd(), e.g. by the io_uring loader */
+void
+sha512_add_stats (guint64 bytes, gint64 usec)
+{
+  stats_phase_add (STATS_PHASE_HASH, 1, usec);
+  stats_add (STATS_BYTES_HASHED, bytes);
+}
+
+/* Total bytes hashed and time spent hashing them, summed over all threads */
+void
+sha512_get_stats (guint64 *bytes_out, gint64 *usec_out)
+{
+  guint64 count;
+  stats_phase_get (STATS_PHASE_HASH, &count, usec_out);
+  *bytes_out = stats_get (STATS_BYTES_HASHED);
+}
+
+/* Computes the sha512 of the rest of fd. If to_fd is not -1, everything
+ * read is also written to it, so the data can be copied and hashed in
+ * one pass. With SHA512_FD_DROP_CACHE the data read from fd is dropped
+ * from the page cache (if enabled with set_drop_page_cache()). The path
+ * is only used for error messages. */
+char *
+sha512_fd (int fd, int to_fd, Sha512Flags flags, const char *path, gsize *digest_len_out,
+           GError **error)
+{
+  gint64 start_time = stats_phase_start ();
+
   g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
   if (!ctx)
     {
@@ -268,10 +782,30 @@ sha512_file (const char *path, gsize *digest_len_out, int *fd_out, GError **erro
       return NULL;
     }
 
-  guchar buf[16 * 1024];
+  guchar small_buf[16 * 1024];
+  guchar *buf = small_buf;
+  gsize buf_size = sizeof (small_buf);
+
+  struct stat st;
+  guint64 size = fstat (fd, &st) == 0 && S_ISREG (st.st_mode) ? st.st_size : 0;
+  PROBE2 (sha512__start, path, size);
+  if (size >= SHA512_LARGE_FILE_SIZE)
+    {
+      (void)posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      buf = get_sha512_large_buffer ();
+      buf_size = SHA512_LARGE_BUFFER_SIZE;
+    }
+
+  off_t offset = 0;
+  gboolean drop_cache = drop_page_cache_enabled && (flags & SHA512_FD_DROP_CACHE) != 0;
+  if (drop_cache)
+    offset = lseek (fd, 0, SEEK_CUR);
+
+  guint64 total = 0;
   while (TRUE)
     {
-      ssize_t res = read (fd, buf, sizeof (buf));
+      ssize_t res = read (fd, buf, buf_size);
+      stats_add (STATS_SYSCALLS, 1);
       if (res < 0)
         {
           if (errno == EINTR)
@@ -283,11 +817,32 @@ sha512_file (const char *path, gsize *digest_len_out, int *fd_out, GError **erro
       else if (res == 0)
         break;
 
+      total += res;
+
       if (EVP_DigestUpdate (ctx, buf, res) == 0)
         {
           fail_ssl (error, "Can't compute sha512 operation");
           return NULL;
         }
+
+      if (to_fd != -1)
+        {
+          if (write_to_fd (to_fd, buf, res) < 0)
+            {
+              g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                           "Can't write copy of %s: %s", path, strerror (errno));
+              return NULL;
+            }
+          stats_add (STATS_BYTES_COPIED, res);
+        }
+
+      /* Drop each chunk once hashed, so the cache never grows by more
+       * than a buffer */
+      if (drop_cache && offset >= 0)
+        {
+          drop_page_cache (fd, offset, res);
+          offset += res;
+        }
     }
 
   guint digest_len = EVP_MD_CTX_size (ctx);
@@ -298,15 +853,157 @@ sha512_file (const char *path, gsize *digest_len_out, int *fd_out, GError **erro
       return NULL;
     }
 
+  gint64 elapsed = stats_phase_elapsed (start_time);
+
+  sha512_add_stats (total, elapsed);
+  PROBE2 (sha512__done, path, total);
+
+  g_debug ("Hashed %s: %" G_GUINT64_FORMAT " bytes in %.3f ms (%.1f MB/s)", path, total,
+           elapsed / 1000.0, elapsed > 0 ? (double)total / elapsed : 0.0);
+
+  *digest_len_out = digest_len;
+  return g_steal_pointer (&digest);
+}
+
+/* Opens name in dirfd, without following symlinks or blocking on
+ * special files, and fails unless it is a regular file. If
+ * has_verity_out is non-NULL it is set to whether the file has
+ * fs-verity enabled, and size_out to its size, which both come with the
+ * same statx() call. */
+int
+open_regular_at (int dirfd, const char *name, const char *path, gboolean *has_verity_out,
+                 guint64 *size_out, GError **error)
+{
+  autofd int fd = openat (dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open %s: %s", path,
+                   strerror (errno));
+      return -1;
+    }
+
+  struct statx stx;
+  if (statx (fd, "", AT_EMPTY_PATH, STATX_TYPE | STATX_SIZE, &stx) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't stat %s: %s", path,
+                   strerror (errno));
+      return -1;
+    }
+
+  if (!S_ISREG (stx.stx_mode))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a regular file", path);
+      return -1;
+    }
+
+  if (has_verity_out)
+    *has_verity_out = (stx.stx_attributes & STATX_ATTR_VERITY) != 0;
+  if (size_out)
+    *size_out = stx.stx_size;
+
+  return steal_fd (&fd);
+}
+
+static char *
+sha512_file_at (int dirfd, const char *name, const char *path, gsize *digest_len_out, int *fd_out,
+                GError **error)
+{
+  autofd int fd = open_regular_at (dirfd, name, path, NULL, NULL, error);
+  if (fd < 0)
+    return NULL;
+
+  /* If the caller will read the data again, keep it cached for that */
+  g_autofree char *digest
+      = sha512_fd (fd, -1, fd_out ? SHA512_FD_NONE : SHA512_FD_DROP_CACHE, path, digest_len_out,
+                   error);
+  if (digest == NULL)
+    return NULL;
+
   if (fd_out)
     {
       lseek (fd, 0, SEEK_SET);
       *fd_out = steal_fd (&fd);
     }
-  *digest_len_out = digest_len;
   return g_steal_pointer (&digest);
 }
 
+/* Gets how many directories may be kept open while their files wait to
+ * be handled: max, or a quarter of the fd limit if that is lower. The
+ * rest is left for the walk and the files that are being handled. */
+guint
+get_max_open_dirs (guint max)
+{
+  struct rlimit rl;
+  if (getrlimit (RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+    return max;
+  return CLAMP (rl.rlim_cur / 4, 1, max);
+}
+
+/* Cheap check for whether get_verity_digest() can work, without opening
+ * the file */
+gboolean
+file_has_verity (int dirfd, const char *name)
+{
+  struct statx stx;
+  if (statx (dirfd, name, AT_SYMLINK_NOFOLLOW, 0, &stx) < 0)
+    return FALSE;
+  return (stx.stx_attributes & STATX_ATTR_VERITY) != 0;
+}
+
+/* Gets the fs-verity digest of the regular file path (or of fd, if not
+ * -1) from the kernel, which doesn't read the file. This is the content
+ * of a VALIDATOR_TYPE_VERITY blob: the fs-verity hash algorithm (16 bit
+ * little endian) followed by the digest. */
+gboolean
+get_verity_digest (const char *path, int fd, guchar **content_out, gsize *content_len_out,
+                   GError **error)
+{
+#ifdef HAVE_LINUX_FSVERITY_H
+  autofd int path_fd = -1;
+  if (fd == -1)
+    {
+      path_fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      if (path_fd < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open %s: %s",
+                       path, strerror (errno));
+          return FALSE;
+        }
+      fd = path_fd;
+    }
+
+  struct
+  {
+    struct fsverity_digest header;
+    guchar digest[64];
+  } measure = { { 0 } };
+  measure.header.digest_size = sizeof (measure.digest);
+  if (ioctl (fd, FS_IOC_MEASURE_VERITY, &measure) < 0)
+    {
+      if (errno == ENODATA || errno == ENOTTY || errno == EOPNOTSUPP)
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOSYS, "%s doesn't have fs-verity enabled",
+                     path);
+      else
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Can't get fs-verity digest of %s: %s", path, strerror (errno));
+      return FALSE;
+    }
+
+  gsize content_len = 2 + measure.header.digest_size;
+  guchar *content = g_malloc (content_len);
+  content[0] = measure.header.digest_algorithm & 0xff;
+  content[1] = measure.header.digest_algorithm >> 8;
+  memcpy (content + 2, measure.digest, measure.header.digest_size);
+
+  *content_out = content;
+  *content_len_out = content_len;
+  return TRUE;
+#else
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOSYS, "fs-verity is not supported");
+  return FALSE;
+#endif
+}
+
 gboolean
 load_file_data_for_sign (const char *path, struct stat *st, int *type_out, guchar **content_out,
                          gsize *content_len_out, int *fd_out, GError **error)
@@ -326,10 +1023,50 @@ load_file_data_for_sign (const char *path, struct stat *st, int *type_out, gucha
     }
 
   int type = st->st_mode & S_IFMT;
+  if (type_out)
+    *type_out = type;
+
+  return load_file_data_for_sign_at (AT_FDCWD, path, path, type, content_out, content_len_out,
+                                     fd_out, error);
+}
+
+static char *
+read_link_at (int dirfd, const char *name, const char *path, GError **error)
+{
+  gsize size = 256;
+  while (TRUE)
+    {
+      g_autofree char *buf = g_malloc (size);
+      ssize_t len = readlinkat (dirfd, name, buf, size);
+      if (len < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't read link %s: %s", path, strerror (errno));
+          return NULL;
+        }
+
+      if ((gsize)len < size)
+        {
+          buf[len] = 0;
+          return g_steal_pointer (&buf);
+        }
+
+      size *= 2;
+    }
+}
+
+/* Loads the content that is signed for name in dirfd, which is of type
+ * (regular file or symlink) as found when walking. If the file was
+ * replaced by something else since, this fails rather than following a
+ * symlink. path is only used for errors. */
+gboolean
+load_file_data_for_sign_at (int dirfd, const char *name, const char *path, int type,
+                            guchar **content_out, gsize *content_len_out, int *fd_out,
+                            GError **error)
+{
   if (type != S_IFREG && type != S_IFLNK)
     {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Unsupported file tye %s",
-                   path);
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Unsupported file tye %s", path);
       return FALSE;
     }
 
@@ -339,13 +1076,13 @@ load_file_data_for_sign (const char *path, struct stat *st, int *type_out, gucha
 
   if (type == S_IFREG)
     {
-      content = sha512_file (path, &content_len, fd_out ? &fd : NULL, error);
+      content = sha512_file_at (dirfd, name, path, &content_len, fd_out ? &fd : NULL, error);
       if (content == NULL)
         return FALSE;
     }
   else
     {
-      content = g_file_read_link (path, error);
+      content = read_link_at (dirfd, name, path, error);
       if (content == NULL)
         return FALSE;
       content_len = strlen (content);
@@ -353,48 +1090,129 @@ load_file_data_for_sign (const char *path, struct stat *st, int *type_out, gucha
 
   if (fd_out)
     *fd_out = steal_fd (&fd);
-  if (type_out)
-    *type_out = type;
   *content_out = (guchar *)g_steal_pointer (&content);
   *content_len_out = content_len;
 
   return TRUE;
 }
 
+struct _Signer
+{
+  EVP_PKEY *pkey;
+  /* Initialized once, copied for each signature to avoid redoing the
+   * key and provider setup of EVP_DigestSignInit() per file */
+  EVP_MD_CTX *template_ctx;
+  EVP_MD_CTX *ctx;
+  gsize max_signature_len;
+  /* Reused for the blob of each file */
+  guchar *blob;
+  gsize blob_size;
+  /* Header prepended to each signature, v2 ones include the key id */
+  guchar header[VALIDATOR_SIGNATURE_MAGIC_LEN + VALIDATOR_KEY_ID_LEN];
+  gsize header_len;
+};
+
+Signer *
+signer_new (EVP_PKEY *pkey, gboolean with_key_id, GError **error)
+{
+  g_autoptr (Signer) signer = g_new0 (Signer, 1);
+
+  signer->template_ctx = EVP_MD_CTX_new ();
+  signer->ctx = EVP_MD_CTX_new ();
+  if (signer->template_ctx == NULL || signer->ctx == NULL)
+    {
+      fail_ssl (error, "Can't init context");
+      return NULL;
+    }
+
+  if (EVP_DigestSignInit (signer->template_ctx, NULL, NULL, NULL, pkey) == 0)
+    {
+      fail_ssl (error, "Can't initialize signature operation");
+      return NULL;
+    }
+
+  int max_size = EVP_PKEY_get_size (pkey);
+  if (max_size <= 0)
+    {
+      fail_ssl (error, "Error getting signature size");
+      return NULL;
+    }
+  signer->max_signature_len = max_size;
+
+  if (with_key_id)
+    {
+      memcpy (signer->header, VALIDATOR_SIGNATURE_MAGIC_V2, VALIDATOR_SIGNATURE_MAGIC_LEN);
+      if (!get_key_id (pkey, signer->header + VALIDATOR_SIGNATURE_MAGIC_LEN))
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "Can't compute key id for this key type");
+          return NULL;
+        }
+      signer->header_len = VALIDATOR_SIGNATURE_MAGIC_LEN + VALIDATOR_KEY_ID_LEN;
+    }
+  else
+    {
+      memcpy (signer->header, VALIDATOR_SIGNATURE_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN);
+      signer->header_len = VALIDATOR_SIGNATURE_MAGIC_LEN;
+    }
+
+  EVP_PKEY_up_ref (pkey);
+  signer->pkey = pkey;
+
+  return g_steal_pointer (&signer);
+}
+
+void
+signer_free (Signer *signer)
+{
+  EVP_MD_CTX_free (signer->template_ctx);
+  EVP_MD_CTX_free (signer->ctx);
+  g_free (signer->blob);
+  if (signer->pkey)
+    EVP_PKEY_free (signer->pkey);
+  g_free (signer);
+}
+
 gboolean
-sign_data (int type, const char *rel_path, const guchar *content, gsize content_len, EVP_PKEY *pkey,
-           guchar **signature_out, gsize *signature_len_out, GError **error)
+signer_sign (Signer *signer, int type, const char *rel_path, const guchar *content,
+             gsize content_len, guchar **signature_out, gsize *signature_len_out, GError **error)
 {
   gsize to_sign_len;
-  g_autofree guchar *to_sign
-      = make_sign_blob (rel_path, type, content, content_len, &to_sign_len, error);
-  if (to_sign == NULL)
+  if (!make_sign_blob_in (rel_path, type, content, content_len, &signer->blob,
+                          &signer->blob_size, &to_sign_len, error))
     return FALSE;
 
-  g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
-  if (!ctx)
-    return fail_ssl (error, "Can't init context");
-
-  if (EVP_DigestSignInit (ctx, NULL, NULL, NULL, pkey) == 0)
+  if (EVP_MD_CTX_copy_ex (signer->ctx, signer->template_ctx) == 0)
     return fail_ssl (error, "Can't initialize signature operation");
 
-  gsize signature_len = 0;
-  if (EVP_DigestSign (ctx, NULL, &signature_len, to_sign, to_sign_len) == 0)
-    return fail_ssl (error, "Error getting signature size");
-
-  g_autofree guchar *signature = g_malloc (VALIDATOR_SIGNATURE_MAGIC_LEN + signature_len);
-  memcpy (signature, VALIDATOR_SIGNATURE_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN);
-  if (EVP_DigestSign (ctx, signature + VALIDATOR_SIGNATURE_MAGIC_LEN, &signature_len, to_sign,
+  gsize signature_len = signer->max_signature_len;
+  g_autofree guchar *signature = g_malloc (signer->header_len + signature_len);
+  memcpy (signature, signer->header, signer->header_len);
+  gint64 start_time = stats_phase_start ();
+  if (EVP_DigestSign (signer->ctx, signature + signer->header_len, &signature_len, signer->blob,
                       to_sign_len)
       == 0)
     return fail_ssl (error, "Error signing data");
+  stats_phase_end (STATS_PHASE_SIGN, start_time);
 
   *signature_out = g_steal_pointer (&signature);
-  *signature_len_out = VALIDATOR_SIGNATURE_MAGIC_LEN + signature_len;
+  *signature_len_out = signer->header_len + signature_len;
 
   return TRUE;
 }
 
+gboolean
+sign_data (int type, const char *rel_path, const guchar *content, gsize content_len, EVP_PKEY *pkey,
+           guchar **signature_out, gsize *signature_len_out, GError **error)
+{
+  g_autoptr (Signer) signer = signer_new (pkey, FALSE, error);
+  if (signer == NULL)
+    return FALSE;
+
+  return signer_sign (signer, type, rel_path, content, content_len, signature_out,
+                      signature_len_out, error);
+}
+
 gboolean
 has_path_prefix (const char *str, const char *prefix)
 {
@@ -448,13 +1266,92 @@ write_to_fd (int fd, const guchar *content, gsize len)
   return 0;
 }
 
-int
-copy_fd (int from_fd, int to_fd)
+const char *
+copy_method_to_string (CopyMethod method)
+{
+  switch (method)
+    {
+    case COPY_METHOD_REFLINK:
+      return "reflink";
+    case COPY_METHOD_COPY_FILE_RANGE:
+      return "copy_file_range";
+    case COPY_METHOD_SENDFILE:
+      return "sendfile";
+    case COPY_METHOD_READ_WRITE:
+      return "read_write";
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+/* Errors that mean the method is not supported for these files, so the
+ * next one should be tried */
+static gboolean
+copy_method_unsupported (int errsv)
+{
+  return errsv == EXDEV || errsv == EINVAL || errsv == ENOSYS || errsv == EOPNOTSUPP
+         || errsv == ENOTTY || errsv == EBADF;
+}
+
+static int
+copy_fd_reflink (int from_fd, int to_fd)
+{
+  /* A clone is of the whole file, so only use it when copying from the start */
+  if (lseek (from_fd, 0, SEEK_CUR) != 0 || lseek (to_fd, 0, SEEK_CUR) != 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  stats_add (STATS_SYSCALLS, 1);
+  if (ioctl (to_fd, FICLONE, from_fd) < 0)
+    return -1;
+
+  return 0;
+}
+
+/* These return 1 if everything was copied, 0 if the method is not
+ * supported (after possibly copying some data, with the file offsets
+ * updated to match) and -1 on errors. */
+static int
+copy_fd_copy_file_range (int from_fd, int to_fd)
+{
+  while (TRUE)
+    {
+      ssize_t n = TEMP_FAILURE_RETRY (
+          copy_file_range (from_fd, NULL, to_fd, NULL, COPY_FD_CHUNK_SIZE, 0));
+      stats_add (STATS_SYSCALLS, 1);
+      if (n < 0)
+        return copy_method_unsupported (errno) ? 0 : -1;
+      if (n == 0) /* EOF */
+        return 1;
+      stats_add (STATS_BYTES_COPIED, n);
+    }
+}
+
+static int
+copy_fd_sendfile (int from_fd, int to_fd)
+{
+  while (TRUE)
+    {
+      ssize_t n = TEMP_FAILURE_RETRY (sendfile (to_fd, from_fd, NULL, COPY_FD_CHUNK_SIZE));
+      stats_add (STATS_SYSCALLS, 1);
+      if (n < 0)
+        return copy_method_unsupported (errno) ? 0 : -1;
+      if (n == 0) /* EOF */
+        return 1;
+      stats_add (STATS_BYTES_COPIED, n);
+    }
+}
+
+static int
+copy_fd_read_write (int from_fd, int to_fd)
 {
   while (TRUE)
     {
       guchar buf[16 * 1024];
       gssize n = TEMP_FAILURE_RETRY (read (from_fd, buf, sizeof (buf)));
+      stats_add (STATS_SYSCALLS, 1);
       if (n < 0)
         return -1;
 
@@ -463,11 +1360,75 @@ copy_fd (int from_fd, int to_fd)
 
       if (write_to_fd (to_fd, buf, (size_t)n) < 0)
         return -1;
+      stats_add (STATS_BYTES_COPIED, n);
+    }
+
+  return 0;
+}
+
+/* Copies the rest of from_fd to to_fd, trying the cheapest of the
+ * allowed methods first: a reflink shares the data extents, and
+ * copy_file_range() and sendfile() copy without going through userspace,
+ * and the last resort is a plain read/write loop. Fails with EOPNOTSUPP
+ * if none of the allowed methods could be used. */
+int
+copy_fd_with_methods (int from_fd, int to_fd, guint methods, CopyMethod *method_out)
+{
+  CopyMethod method;
+  int res;
+
+  if ((methods & (1 << COPY_METHOD_REFLINK)) && copy_fd_reflink (from_fd, to_fd) == 0)
+    {
+      method = COPY_METHOD_REFLINK;
+      goto out;
+    }
+
+  if (methods & (1 << COPY_METHOD_COPY_FILE_RANGE))
+    {
+      res = copy_fd_copy_file_range (from_fd, to_fd);
+      if (res < 0)
+        return -1;
+      if (res > 0)
+        {
+          method = COPY_METHOD_COPY_FILE_RANGE;
+          goto out;
+        }
     }
 
+  if (methods & (1 << COPY_METHOD_SENDFILE))
+    {
+      res = copy_fd_sendfile (from_fd, to_fd);
+      if (res < 0)
+        return -1;
+      if (res > 0)
+        {
+          method = COPY_METHOD_SENDFILE;
+          goto out;
+        }
+    }
+
+  if ((methods & (1 << COPY_METHOD_READ_WRITE)) == 0)
+    {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+
+  if (copy_fd_read_write (from_fd, to_fd) < 0)
+    return -1;
+  method = COPY_METHOD_READ_WRITE;
+
+out:
+  if (method_out)
+    *method_out = method;
   return 0;
 }
 
+int
+copy_fd (int from_fd, int to_fd, CopyMethod *method_out)
+{
+  return copy_fd_with_methods (from_fd, to_fd, COPY_METHODS_ALL, method_out);
+}
+
 static gboolean
 is_notfound (GError *error)
 {
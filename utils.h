@@ -3,8 +3,22 @@
 #include <openssl/evp.h>
 #include <sys/stat.h>
 
+#include "stats.h"
+
 #define VALIDATOR_SIGNATURE_MAGIC "VALIDTR\001"
 #define VALIDATOR_SIGNATURE_MAGIC_LEN 8
+/* v2 signatures have the key id of the signing key after the magic */
+#define VALIDATOR_SIGNATURE_MAGIC_V2 "VALIDTR\002"
+#define VALIDATOR_KEY_ID_LEN 32
+/* Signature files this size or larger are rejected */
+#define VALIDATOR_MAX_SIGNATURE_SIZE 4096
+/* Regular files signed with their fs-verity digest (see
+ * get_verity_digest()) rather than the sha512 of their data. Not a real
+ * file type, but distinct from all the S_IF* ones */
+#define VALIDATOR_TYPE_VERITY (S_IFREG | 1)
+/* Manifests (see manifest.h), so that their signatures can't be passed
+ * off as those of a regular file and vice versa */
+#define VALIDATOR_TYPE_MANIFEST (S_IFREG | 2)
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FILE, fclose)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (EVP_PKEY, EVP_PKEY_free)
@@ -50,22 +64,95 @@ close_fd (int *fdp)
 
 void oom (void);
 gboolean has_path_prefix (const char *str, const char *prefix);
-void free_keys (GList *keys);
+typedef struct _KeySet KeySet;
+
+KeySet *key_set_new (void);
+KeySet *key_set_ref (KeySet *keys);
+void key_set_unref (KeySet *keys);
+void key_set_add (KeySet *keys, EVP_PKEY *key);
+guint key_set_get_size (KeySet *keys);
+EVP_PKEY *key_set_get_key (KeySet *keys, guint i);
+const guchar *key_set_get_fingerprint (KeySet *keys);
+EVP_PKEY *key_set_lookup (KeySet *keys, const guchar *key_id);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (KeySet, key_set_unref)
+
+gboolean get_key_id (EVP_PKEY *key, guchar *key_id_out);
 EVP_PKEY *load_priv_key (const char *path, GError **error);
 EVP_PKEY *load_pub_key (const char *path, GError **error);
-gboolean load_pub_keys_from_dir (const char *key_dir, GList **out_keys, GError **error);
+gboolean load_pub_keys_from_dir (const char *key_dir, KeySet *keys, GError **error);
+typedef struct _Verifier Verifier;
+
+Verifier *verifier_new (KeySet *keys, GError **error);
+void verifier_free (Verifier *verifier);
+gboolean verifier_verify (Verifier *verifier, const char *rel_path, int type,
+                          const guchar *content, gsize content_len, const char *sig,
+                          gsize sig_size, GError **error);
+gboolean verifier_get_signed_by (Verifier *verifier, guchar *key_id_out);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Verifier, verifier_free)
+
 gboolean validate_data (const char *rel_path, int type, guchar *content, gsize content_size,
-                        char *sig, gsize sig_size, GList *pub_keys, GError **error);
+                        char *sig, gsize sig_size, KeySet *pub_keys, GError **error);
+gboolean load_signature (const char *sig_path, char *buf, gsize buf_size, gsize *len_out,
+                         GError **error);
+gboolean load_signature_at (int dirfd, const char *sig_path, char *buf, gsize buf_size,
+                            gsize *len_out, GError **error);
 guchar *make_sign_blob (const char *rel_path, int type, const guchar *content, gsize content_len,
                         gsize *out_size, GError **error);
+typedef struct _Signer Signer;
+
+Signer *signer_new (EVP_PKEY *pkey, gboolean with_key_id, GError **error);
+void signer_free (Signer *signer);
+gboolean signer_sign (Signer *signer, int type, const char *rel_path, const guchar *content,
+                      gsize content_len, guchar **signature_out, gsize *signature_len_out,
+                      GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Signer, signer_free)
+
 gboolean sign_data (int type, const char *rel_path, const guchar *data, gsize data_len,
                     EVP_PKEY *pkey, guchar **signature_out, gsize *signature_len_out,
                     GError **error);
+typedef enum
+{
+  SHA512_FD_NONE = 0,
+  SHA512_FD_DROP_CACHE = 1 << 0,
+} Sha512Flags;
+
+void set_drop_page_cache (gboolean enabled);
+void drop_page_cache (int fd, off_t offset, off_t len);
+void sha512_add_stats (guint64 bytes, gint64 usec);
+void sha512_get_stats (guint64 *bytes_out, gint64 *usec_out);
+char *sha512_fd (int fd, int to_fd, Sha512Flags flags, const char *path, gsize *digest_len_out,
+                 GError **error);
+int open_regular_at (int dirfd, const char *name, const char *path, gboolean *has_verity_out,
+                     guint64 *size_out, GError **error);
+guint get_max_open_dirs (guint max);
+gboolean file_has_verity (int dirfd, const char *name);
+gboolean get_verity_digest (const char *path, int fd, guchar **content_out,
+                            gsize *content_len_out, GError **error);
 gboolean load_file_data_for_sign (const char *path, struct stat *st, int *type_out,
                                   guchar **content_out, gsize *content_len_out, int *fd_out,
                                   GError **error);
+gboolean load_file_data_for_sign_at (int dirfd, const char *name, const char *path, int type,
+                                     guchar **content_out, gsize *content_len_out, int *fd_out,
+                                     GError **error);
 int write_to_fd (int fd, const guchar *content, gsize len);
-int copy_fd (int from_fd, int to_fd);
+
+typedef enum
+{
+  COPY_METHOD_REFLINK,
+  COPY_METHOD_COPY_FILE_RANGE,
+  COPY_METHOD_SENDFILE,
+  COPY_METHOD_READ_WRITE,
+} CopyMethod;
+
+#define N_COPY_METHODS (COPY_METHOD_READ_WRITE + 1)
+#define COPY_METHODS_ALL ((1 << N_COPY_METHODS) - 1)
+
+const char *copy_method_to_string (CopyMethod method);
+int copy_fd_with_methods (int from_fd, int to_fd, guint methods, CopyMethod *method_out);
+int copy_fd (int from_fd, int to_fd, CopyMethod *method_out);
 
 gboolean keyfile_get_boolean_with_default (GKeyFile *keyfile, const char *section,
                                            const char *value, gboolean default_value,
@@ -21,99 +21,442 @@
 #include "config.h"
 #include "main.h"
 
+#include "jobs.h"
+#include "manifest.h"
+#include "probes.h"
+#include "uring.h"
+#include "walk.h"
+
+#include <fcntl.h>
+
+typedef struct
+{
+  WalkDir *dir;
+  char *name;
+  char *rel_path; /* NULL if not inside the relative dir */
+  int type;
+  gboolean has_sig;
+} ValidateJob;
+
+static void
+validate_job_free (ValidateJob *job)
+{
+  walk_dir_unref (job->dir);
+  g_free (job->name);
+  g_free (job->rel_path);
+  g_free (job);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ValidateJob, validate_job_free)
+
+static ValidateJob *
+validate_job_new (WalkDir *dir, const char *name, int type, const char *rel_path,
+                  gboolean has_sig)
+{
+  ValidateJob *job = g_new0 (ValidateJob, 1);
+  job->dir = walk_dir_ref (dir);
+  job->name = g_strdup (name);
+  job->rel_path = g_strdup (rel_path);
+  job->type = type;
+  job->has_sig = has_sig;
+  return job;
+}
+
+/* Loaded files are either checked against the manifest, or with the
+ * verifier. There is one context per worker thread, or one when
+ * validating serially. */
+typedef struct
+{
+  Verifier *verifier;
+  /* Cleared by the failures the loader reports */
+  gboolean loader_success;
+  Manifest *manifest; /* Not owned */
+} ValidateContext;
+
+static void
+validate_context_free (ValidateContext *ctx)
+{
+  if (ctx->verifier)
+    verifier_free (ctx->verifier);
+  g_free (ctx);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ValidateContext, validate_context_free)
+
+/* Where the files found by a walk go. If jobs is non-NULL, files are
+ * queued on it and failures are reported when the jobs are finished.
+ * Otherwise regular files are queued on the loader if there is one
+ * (failures are reported by its callback), and everything else is loaded
+ * directly. With a schedule, regular files are collected on it first. */
+typedef struct
+{
+  ValidateContext *ctx;
+  Jobs *jobs;
+  UringLoader *loader;
+  Schedule *schedule;
+} ValidateWalk;
+
 static gboolean
-validate (const char *path, const char *relative_to)
+set_no_signature_error (const char *path, GError **error)
 {
-  struct stat st;
-  gboolean success = TRUE;
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "No signature for '%s'", path);
+  return FALSE;
+}
 
-  int res = lstat (path, &st);
-  if (res < 0)
+static gboolean
+set_signature_error (const char *path, GError *sig_error, GError **error)
+{
+  if (g_error_matches (sig_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
     {
-      g_printerr ("Can't access '%s': %s\n", path, strerror (errno));
-      return FALSE;
+      set_no_signature_error (path, error);
+      g_error_free (sig_error);
     }
+  else
+    g_propagate_prefixed_error (error, sig_error, "Failed to load '%s.sig': ", path);
+  return FALSE;
+}
 
-  int type = st.st_mode & S_IFMT;
-  if (type == S_IFREG || type == S_IFLNK)
-    {
-      g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+static gboolean
+set_invalid_error (const char *path, const char *rel_path, const GError *verify_error,
+                   GError **error)
+{
+  if (verify_error)
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                 "Signature of '%s' is invalid (as %s): %s", path, rel_path,
+                 verify_error->message);
+  else
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Signature of '%s' is invalid (as %s)",
+                 path, rel_path);
+  return FALSE;
+}
 
-      g_autofree char *signature = NULL;
-      gsize signature_len = 0;
+static gboolean
+set_not_relative_error (const char *path, GError **error)
+{
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File '%s' not inside relative dir", path);
+  return FALSE;
+}
+
+/* If cache_record is non-NULL the file is added to the cache once
+ * validated */
+static gboolean
+validate_loaded (ValidateContext *ctx, const char *path, int type, const char *rel_path,
+                 const guchar *content, gsize content_len, const char *signature,
+                 gsize signature_len, ValidationCacheRecord *cache_record, GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
 
-      g_autoptr (GError) error = NULL;
-      if (!g_file_get_contents (sig_path, &signature, &signature_len, &error))
+  if (ctx->manifest)
+    {
+      if (!manifest_check (ctx->manifest, rel_path, type, content, content_len, &local_error))
         {
-          if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-            g_printerr ("No signature for '%s'\n", path);
+          if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+                         "No signature for '%s' in manifest (as %s)", path, rel_path);
           else
-            g_printerr ("Failed to load '%s': %s\n", sig_path, error->message);
+            set_invalid_error (path, rel_path, local_error, error);
           return FALSE;
         }
 
-      g_autofree guchar *content = NULL;
-      gsize content_len = 0;
-      if (!load_file_data_for_sign (path, &st, NULL, &content, &content_len, NULL, &error))
-        {
-          g_printerr ("Failed to load '%s': %s\n", path, error->message);
-          return FALSE;
-        }
+      g_info ("%s is valid (as %s)", path, rel_path);
+      return TRUE;
+    }
+
+  if (!verifier_verify (ctx->verifier, rel_path, type, content, content_len, signature,
+                        signature_len, &local_error))
+    return set_invalid_error (path, rel_path, local_error, error);
+
+  g_info ("%s is valid (as %s)", path, rel_path);
+  if (cache_record)
+    validation_cache_add (opt_validation_cache, cache_record, content, content_len);
+  return TRUE;
+}
 
-      g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt_path_prefix);
-      if (rel_path == NULL)
+/* Files with fs-verity enabled are checked against the digest the kernel
+ * keeps for them, without reading them. If they weren't signed that way
+ * this returns FALSE, and they are checked as usual. */
+static gboolean
+validate_verity (ValidateContext *ctx, int dirfd, const char *name, const char *path,
+                 const char *rel_path, const char *signature, gsize signature_len)
+{
+  if (!file_has_verity (dirfd, name))
+    return FALSE;
+
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+  g_autoptr (GError) local_error = NULL;
+  autofd int fd = open_regular_at (dirfd, name, path, NULL, NULL, &local_error);
+  if (fd < 0 || !get_verity_digest (path, fd, &content, &content_len, &local_error))
+    {
+      g_debug ("Not using fs-verity: %s", local_error->message);
+      return FALSE;
+    }
+
+  gboolean valid;
+  if (ctx->manifest)
+    valid = manifest_check (ctx->manifest, rel_path, VALIDATOR_TYPE_VERITY, content, content_len,
+                            NULL);
+  else
+    valid = verifier_verify (ctx->verifier, rel_path, VALIDATOR_TYPE_VERITY, content,
+                             content_len, signature, signature_len, NULL);
+  if (!valid)
+    {
+      g_debug ("%s is not signed for its fs-verity digest", path);
+      return FALSE;
+    }
+
+  g_info ("%s is valid (as %s, fs-verity)", path, rel_path);
+  return TRUE;
+}
+
+/* Validates name in dir, as found by the walk. has_sig is FALSE if it is
+ * already known that there is no signature file. */
+static gboolean
+validate_file (ValidateContext *ctx, WalkDir *dir, const char *name, const char *path, int type,
+               const char *rel_path, gboolean has_sig, GError **error)
+{
+  int dirfd = walk_dir_get_fd (dir);
+  g_autofree char *sig_name = g_strconcat (name, ".sig", NULL);
+
+  char signature[VALIDATOR_MAX_SIGNATURE_SIZE];
+  gsize signature_len = 0;
+
+  g_autoptr (GError) local_error = NULL;
+  if (ctx->manifest == NULL && !has_sig)
+    return set_no_signature_error (path, error);
+  if (ctx->manifest == NULL
+      && !load_signature_at (dirfd, sig_name, signature, sizeof (signature), &signature_len,
+                             &local_error))
+    return set_signature_error (path, g_steal_pointer (&local_error), error);
+
+  if (rel_path == NULL)
+    return set_not_relative_error (path, error);
+
+  /* Only the digests of regular files are worth caching */
+  ValidationCacheRecord cache_record;
+  gboolean use_cache = opt_validation_cache && ctx->manifest == NULL && type == S_IFREG;
+  if (use_cache)
+    {
+      struct stat st;
+      if (fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
         {
-          g_printerr ("File '%s' not inside relative dir\n", path);
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't access '%s': %s", path, strerror (errno));
           return FALSE;
         }
-
-      g_autoptr (GError) validate_error = NULL;
-      if (!validate_data (rel_path, type, content, content_len, signature, signature_len,
-                          opt_public_keys, &validate_error))
+      validation_cache_record_init (&cache_record, &st, opt_public_keys, rel_path, signature,
+                                    signature_len);
+      if (validation_cache_lookup (opt_validation_cache, &cache_record))
         {
-          if (validate_error)
-            g_printerr ("Signature of '%s' is invalid (as %s): %s\n", path, rel_path,
-                        validate_error->message);
-          else
-            g_printerr ("Signature of '%s' is invalid (as %s)\n", path, rel_path);
-          return FALSE;
+          g_info ("%s is valid (as %s, cached)", path, rel_path);
+          return TRUE;
         }
+    }
 
-      g_info ("%s is valid (as %s)", path, rel_path);
+  if (type == S_IFREG
+      && validate_verity (ctx, dirfd, name, path, rel_path, signature, signature_len))
+    return TRUE;
+
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+  if (!load_file_data_for_sign_at (dirfd, name, path, type, &content, &content_len, NULL,
+                                   &local_error))
+    {
+      g_propagate_prefixed_error (error, g_steal_pointer (&local_error), "Failed to load '%s': ",
+                                  path);
+      return FALSE;
+    }
+
+  return validate_loaded (ctx, path, type, rel_path, content, content_len, signature,
+                          signature_len, use_cache ? &cache_record : NULL, error);
+}
+
+/* Called by the io_uring loader once both the signature and the digest
+ * of a regular file are loaded */
+static void
+validate_uring_loaded (UringLoadResult *result, gpointer user_data)
+{
+  ValidateContext *ctx = user_data;
+  g_autoptr (ValidateJob) job = result->data;
+  g_autoptr (GError) error = NULL;
+
+  if (result->signature_error)
+    set_signature_error (result->path, g_steal_pointer (&result->signature_error), &error);
+  else if (result->digest_error)
+    g_propagate_prefixed_error (&error, g_steal_pointer (&result->digest_error),
+                                "Failed to load '%s': ", result->path);
+  else if (job->rel_path == NULL)
+    set_not_relative_error (result->path, &error);
+  else
+    validate_loaded (ctx, result->path, S_IFREG, job->rel_path, result->digest,
+                     result->digest_len, result->signature, result->signature_len, NULL, &error);
+
+  PROBE2 (file__done, result->path, error == NULL);
+
+  if (error)
+    {
+      jobs_report_error (NULL, result->path, g_steal_pointer (&error));
+      ctx->loader_success = FALSE;
+    }
+}
+
+static gboolean
+validate_job (const char *path, gpointer job_data, gpointer worker_data, GError **error)
+{
+  ValidateJob *job = job_data;
+  ValidateContext *ctx = worker_data;
+
+  PROBE2 (file__start, path, PROBE_FILE_SIZE (file__start, walk_dir_get_fd (job->dir), job->name));
+  gboolean valid = validate_file (ctx, job->dir, job->name, path, job->type, job->rel_path,
+                                  job->has_sig, error);
+  PROBE2 (file__done, path, valid);
+  return valid;
+}
+
+/* Validates or queues the file of job, which this takes ownership of */
+static gboolean
+validate_job_dispatch (ValidateJob *job, const char *path, ValidateWalk *walk)
+{
+  g_autoptr (ValidateJob) owned = job;
+  int dirfd = walk_dir_get_fd (job->dir);
+
+  if (walk->jobs)
+    {
+      jobs_push (walk->jobs, path, g_steal_pointer (&owned));
+      return TRUE;
+    }
+
+  /* The loader would read files with fs-verity, which is avoidable, and
+   * only a signature that exists is worth loading */
+  if (walk->loader && job->has_sig && job->type == S_IFREG && !file_has_verity (dirfd, job->name))
+    {
+      PROBE2 (file__start, path, PROBE_FILE_SIZE (file__start, dirfd, job->name));
+      uring_loader_add (walk->loader, dirfd, job->name, path, g_steal_pointer (&owned));
+      return TRUE;
+    }
+
+  g_autoptr (GError) error = NULL;
+  PROBE2 (file__start, path, PROBE_FILE_SIZE (file__start, dirfd, job->name));
+  gboolean valid = validate_file (walk->ctx, job->dir, job->name, path, job->type,
+                                  job->rel_path, job->has_sig, &error);
+  PROBE2 (file__done, path, valid);
+  if (!valid)
+    {
+      jobs_report_error (NULL, path, g_steal_pointer (&error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+validate_scheduled (WalkDir *dir, const char *name, const char *path, gpointer data,
+                    gpointer user_data)
+{
+  return validate_job_dispatch (data, path, user_data);
+}
+
+static gpointer
+validate_worker_new (gpointer user_data, GError **error)
+{
+  g_autoptr (ValidateContext) ctx = g_new0 (ValidateContext, 1);
+
+  ctx->manifest = user_data;
+  ctx->verifier = verifier_new (opt_public_keys, error);
+  if (ctx->verifier == NULL)
+    return NULL;
+
+  return g_steal_pointer (&ctx);
+}
+
+/* Validates name in parent, which is found at path. type is 0 if not yet
+ * known, and ino is as from readdir. rel_path is the relative path it is
+ * validated as, or NULL if it is not inside relative_to (which a child
+ * still might be). has_sig is FALSE if it is known to have no signature
+ * file. */
+static gboolean
+validate (WalkDir *parent, const char *name, const char *path, int type, guint64 ino,
+          const char *rel_path, gboolean has_sig, const char *relative_to, ValidateWalk *walk)
+{
+  Jobs *jobs = walk->jobs;
+
+  gboolean success = TRUE;
+  g_autoptr (GError) error = NULL;
+
+  if (!walk_get_type (parent, name, path, &type, &error))
+    {
+      jobs_report_error (jobs, path, g_steal_pointer (&error));
+      return FALSE;
+    }
+
+  if (type == S_IFREG || type == S_IFLNK)
+    {
+      ValidateJob *job = validate_job_new (parent, name, type, rel_path, has_sig);
+      stats_add (STATS_FILES, 1);
+
+      /* A toplevel file is not worth scheduling */
+      if (walk->schedule && type == S_IFREG && parent != NULL)
+        schedule_add (walk->schedule, parent, name, path, ino, job);
+      else if (!validate_job_dispatch (job, path, walk))
+        return FALSE;
     }
   else if (type == S_IFDIR)
     {
-      g_autoptr (GError) dir_error = NULL;
-      g_autoptr (GDir) dir = g_dir_open (path, 0, &dir_error);
+      g_autoptr (WalkDir) dir = walk_dir_open (parent, name, path, &error);
       if (dir == NULL)
         {
-          if (g_error_matches (dir_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+          if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
             return TRUE;
 
-          g_printerr ("Failed to open dir '%s': %s\n", path, strerror (errno));
+          jobs_report_error (jobs, path, g_steal_pointer (&error));
           return FALSE;
         }
 
-      const char *child;
-      while ((child = g_dir_read_name (dir)) != NULL)
+      g_autoptr (WalkEntries) entries = walk_dir_read_entries (dir, &error);
+      if (entries == NULL)
         {
-          if (g_str_has_suffix (child, ".sig"))
-            continue; /* Skip existing signatures */
+          jobs_report_error (jobs, path, g_steal_pointer (&error));
+          return FALSE;
+        }
 
-          g_autofree char *child_path = g_build_filename (path, child, NULL);
-          if (!validate (child_path, relative_to))
+      for (gsize i = 0; i < entries->n_entries; i++)
+        {
+          WalkEntry *child = &entries->entries[i];
+          g_autofree char *child_path = walk_child_path (path, child->name);
+          if (g_strcmp0 (child_path, opt_manifest) == 0)
+            continue;
+
+          g_autofree char *child_rel_path
+              = rel_path ? walk_child_path (rel_path, child->name)
+                         : opt_get_relative_path (child_path, relative_to, opt_path_prefix);
+          if (!validate (dir, child->name, child_path, child->type, child->ino, child_rel_path,
+                         child->has_sig, relative_to, walk))
             success = FALSE;
         }
     }
   else
     {
-      g_printerr ("Can't validate '%s' due to unsupported file type'\n", path);
+      g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Can't validate '%s' due to unsupported file type'", path);
+      jobs_report_error (jobs, path, g_steal_pointer (&error));
       success = FALSE;
     }
 
   return success;
 }
 
+/* Validates the toplevel path, with relative paths relative to
+ * relative_to */
+static gboolean
+validate_toplevel (const char *path, const char *relative_to, ValidateWalk *walk)
+{
+  g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt_path_prefix);
+  gboolean res = validate (NULL, path, path, 0, 0, rel_path, TRUE, relative_to, walk);
+  if (walk->schedule && !schedule_flush (walk->schedule))
+    res = FALSE;
+  return res;
+}
+
 int
 cmd_validate (int argc, char *argv[])
 {
@@ -122,6 +465,65 @@ cmd_validate (int argc, char *argv[])
   if (argc == 1)
     help_error ("No input files given");
 
+  /* With a manifest, there is only one signature to check */
+  g_autoptr (Manifest) manifest = NULL;
+  if (opt_manifest)
+    {
+      g_autoptr (Verifier) verifier = verifier_new (opt_public_keys, &error);
+      if (verifier)
+        manifest = manifest_load (opt_manifest, verifier, &error);
+      if (manifest == NULL)
+        {
+          g_printerr ("error: %s\n", error->message);
+          return EXIT_FAILURE;
+        }
+    }
+
+  Jobs *jobs = NULL;
+  if (opt_jobs > 1)
+    {
+      jobs = jobs_new (opt_jobs, validate_job, (GDestroyNotify)validate_job_free,
+                       validate_worker_new, (GDestroyNotify)validate_context_free, manifest,
+                       &error);
+      if (jobs == NULL)
+        {
+          g_printerr ("error: %s\n", error->message);
+          return EXIT_FAILURE;
+        }
+    }
+
+  /* Serial validation batches the I/O of regular files with io_uring
+   * when possible */
+  g_autoptr (ValidateContext) ctx = NULL;
+  UringLoader *loader = NULL;
+  if (jobs == NULL)
+    {
+      ctx = g_new0 (ValidateContext, 1);
+      ctx->loader_success = TRUE;
+      ctx->manifest = manifest;
+      ctx->verifier = verifier_new (opt_public_keys, &error);
+      if (ctx->verifier == NULL)
+        {
+          g_printerr ("error: %s\n", error->message);
+          return EXIT_FAILURE;
+        }
+
+      /* The loader always reads signature files, which a manifest
+       * replaces, and always reads the content, which the cache is there
+       * to avoid */
+      if (manifest == NULL && opt_validation_cache == NULL && !opt_no_io_uring)
+        loader = uring_loader_new (validate_uring_loaded, ctx);
+    }
+
+  ValidateWalk walk = { ctx, jobs, loader, NULL };
+  g_autoptr (Schedule) schedule = NULL;
+  if (opt_schedule_mode != SCHEDULE_NONE)
+    {
+      schedule = schedule_new (opt_schedule_mode, validate_scheduled,
+                               (GDestroyNotify)validate_job_free, &walk);
+      walk.schedule = schedule;
+    }
+
   gboolean res = TRUE;
   for (gsize i = 1; i < argc; i++)
     {
@@ -132,20 +534,33 @@ cmd_validate (int argc, char *argv[])
           if (!opt_recursive)
             {
               g_printerr ("error: '%s' is a directory and not in recursive mode\n", path);
+              if (jobs)
+                jobs_finish (jobs);
+              if (loader)
+                uring_loader_finish (loader);
               return EXIT_FAILURE;
             }
 
-          if (!validate (path, opt_path_relative ? opt_path_relative : path))
+          if (!validate_toplevel (path, opt_path_relative ? opt_path_relative : path, &walk))
             res = FALSE;
         }
       else
         {
           g_autofree char *dirname = g_path_get_dirname (path);
 
-          if (!validate (path, opt_path_relative ? opt_path_relative : dirname))
+          if (!validate_toplevel (path, opt_path_relative ? opt_path_relative : dirname, &walk))
             res = FALSE;
         }
     }
 
+  if (jobs && !jobs_finish (jobs))
+    res = FALSE;
+
+  if (loader)
+    uring_loader_finish (loader);
+
+  if (ctx && !ctx->loader_success)
+    res = FALSE;
+
   return res ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,282 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "utils.h"
+
+#include "walk.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+
+struct _WalkDir
+{
+  gint ref_count;
+  DIR *dir;
+  int fd; /* Owned by dir */
+  char *path;
+};
+
+/* Opens the directory name in parent, path is only used for errors */
+WalkDir *
+walk_dir_open (WalkDir *parent, const char *name, const char *path, GError **error)
+{
+  gint64 start_time = stats_phase_start ();
+  int fd = openat (walk_dir_get_fd (parent), name,
+                   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to open dir '%s': %s", path, strerror (errsv));
+      stats_phase_end (STATS_PHASE_WALK, start_time);
+      return NULL;
+    }
+
+  DIR *d = fdopendir (fd);
+  if (d == NULL)
+    {
+      int errsv = errno;
+      close (fd);
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to open dir '%s': %s", path, strerror (errsv));
+      stats_phase_end (STATS_PHASE_WALK, start_time);
+      return NULL;
+    }
+
+  WalkDir *dir = g_new0 (WalkDir, 1);
+  dir->ref_count = 1;
+  dir->dir = d;
+  dir->fd = fd;
+  dir->path = g_strdup (path);
+  stats_phase_end (STATS_PHASE_WALK, start_time);
+  return dir;
+}
+
+WalkDir *
+walk_dir_ref (WalkDir *dir)
+{
+  if (dir)
+    g_atomic_int_inc (&dir->ref_count);
+  return dir;
+}
+
+void
+walk_dir_unref (WalkDir *dir)
+{
+  if (dir == NULL || !g_atomic_int_dec_and_test (&dir->ref_count))
+    return;
+
+  closedir (dir->dir);
+  g_free (dir->path);
+  g_free (dir);
+}
+
+int
+walk_dir_get_fd (WalkDir *dir)
+{
+  return dir ? dir->fd : AT_FDCWD;
+}
+
+static int
+type_from_dtype (unsigned char d_type)
+{
+  switch (d_type)
+    {
+    case DT_REG:
+      return S_IFREG;
+    case DT_LNK:
+      return S_IFLNK;
+    case DT_DIR:
+      return S_IFDIR;
+    case DT_FIFO:
+      return S_IFIFO;
+    case DT_SOCK:
+      return S_IFSOCK;
+    case DT_CHR:
+      return S_IFCHR;
+    case DT_BLK:
+      return S_IFBLK;
+    default:
+      return 0;
+    }
+}
+
+/* Gets the next entry of dir, skipping "." and "..", along with its type
+ * (as in st_mode & S_IFMT) if readdir knows it, or 0 if the caller has to
+ * stat it, and its inode number. Returns FALSE at the end, or with error
+ * set if the directory can't be read. Must only be called from one
+ * thread. */
+gboolean
+walk_dir_next (WalkDir *dir, const char **name_out, int *type_out, guint64 *ino_out,
+               GError **error)
+{
+  /* The walk phase counts directories, reading them only adds time */
+  gint64 start_time = stats_phase_start ();
+  while (TRUE)
+    {
+      errno = 0;
+      struct dirent *dent = readdir (dir->dir);
+      if (dent == NULL)
+        {
+          if (errno != 0)
+            {
+              int errsv = errno;
+              g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                           "Failed to read dir '%s': %s", dir->path, strerror (errsv));
+            }
+          stats_phase_add (STATS_PHASE_WALK, 0, stats_phase_elapsed (start_time));
+          return FALSE;
+        }
+
+      const char *name = dent->d_name;
+      if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
+        continue;
+
+      *name_out = name;
+      *type_out = type_from_dtype (dent->d_type);
+      if (ino_out)
+        *ino_out = dent->d_ino;
+      stats_phase_add (STATS_PHASE_WALK, 0, stats_phase_elapsed (start_time));
+      return TRUE;
+    }
+}
+
+typedef struct
+{
+  gsize name_offset;
+  int type;
+  guint64 ino;
+} RawEntry;
+
+static int
+cmp_entries (const void *a, const void *b)
+{
+  return strcmp (((const WalkEntry *)a)->name, ((const WalkEntry *)b)->name);
+}
+
+static gboolean
+is_sig_name (const char *name)
+{
+  return g_str_has_suffix (name, ".sig");
+}
+
+/* Reads all of dir into a table sorted by name, with the names stored
+ * together in one block. Signatures are paired with the file they are
+ * for, setting has_sig, and are not in the table themselves. */
+WalkEntries *
+walk_dir_read_entries (WalkDir *dir, GError **error)
+{
+  g_autoptr (GString) names = g_string_new ("");
+  g_autoptr (GArray) raw = g_array_new (FALSE, FALSE, sizeof (RawEntry));
+
+  g_autoptr (GError) local_error = NULL;
+  const char *name;
+  int type;
+  guint64 ino;
+  while (walk_dir_next (dir, &name, &type, &ino, &local_error))
+    {
+      RawEntry entry = { names->len, type, ino };
+      g_string_append_len (names, name, strlen (name) + 1);
+      g_array_append_vals (raw, &entry, 1);
+    }
+  if (local_error)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  gsize n_raw = raw->len;
+  g_autofree WalkEntry *all = g_new0 (WalkEntry, n_raw);
+  for (gsize i = 0; i < n_raw; i++)
+    {
+      RawEntry *entry = &g_array_index (raw, RawEntry, i);
+      all[i].name = names->str + entry->name_offset;
+      all[i].type = entry->type;
+      all[i].ino = entry->ino;
+    }
+  qsort (all, n_raw, sizeof (WalkEntry), cmp_entries);
+
+  WalkEntries *entries = g_new0 (WalkEntries, 1);
+  entries->entries = g_new0 (WalkEntry, n_raw);
+  g_autoptr (GString) sig_name = g_string_new ("");
+  for (gsize i = 0; i < n_raw; i++)
+    {
+      if (is_sig_name (all[i].name))
+        continue;
+
+      g_string_assign (sig_name, all[i].name);
+      g_string_append (sig_name, ".sig");
+      WalkEntry key = { sig_name->str };
+
+      WalkEntry *entry = &entries->entries[entries->n_entries++];
+      *entry = all[i];
+      entry->has_sig
+          = bsearch (&key, all + i + 1, n_raw - i - 1, sizeof (WalkEntry), cmp_entries) != NULL;
+    }
+
+  /* The names stay where they are */
+  entries->names = g_string_free (g_steal_pointer (&names), FALSE);
+  return entries;
+}
+
+void
+walk_entries_free (WalkEntries *entries)
+{
+  g_free (entries->entries);
+  g_free (entries->names);
+  g_free (entries);
+}
+
+/* Fills in the type of name in dir if walk_dir_next() didn't know it,
+ * path is only used for errors */
+gboolean
+walk_get_type (WalkDir *dir, const char *name, const char *path, int *type_inout,
+               GError **error)
+{
+  if (*type_inout != 0)
+    return TRUE;
+
+  struct stat st;
+  if (fstatat (walk_dir_get_fd (dir), name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv), "Can't access '%s': %s",
+                   path, strerror (errsv));
+      return FALSE;
+    }
+
+  *type_inout = st.st_mode & S_IFMT;
+  return TRUE;
+}
+
+/* Appends name to the path (or relative path) of its directory, which
+ * is cheaper than g_build_filename() as the parts are known to be
+ * canonical */
+char *
+walk_child_path (const char *path, const char *name)
+{
+  if (*path == 0)
+    return g_strdup (name);
+  if (g_str_has_suffix (path, "/"))
+    return g_strconcat (path, name, NULL);
+  return g_strconcat (path, "/", name, NULL);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/* Trees are walked with an open fd per directory. Entries are opened
+ * relative to the fd of their directory and without following symlinks,
+ * so the kernel doesn't look up their whole path again, and no part of
+ * the path can be swapped for a symlink between finding an entry and
+ * opening it. The type of entries comes from readdir when the
+ * filesystem provides it, so they don't have to be stat:ed.
+ *
+ * Directories are read once into a sorted table of entries, in which
+ * each file is paired with its signature (a "name.sig" entry next to it),
+ * so that files with no signature are known without trying to open it,
+ * and the signatures themselves aren't listed.
+ *
+ * Directories are refcounted, so that entries can be queued (on worker
+ * threads or io_uring) with their directory kept open. A NULL WalkDir
+ * stands for the current directory, for toplevel paths. */
+
+typedef struct _WalkDir WalkDir;
+
+typedef struct
+{
+  const char *name;
+  int type; /* As from walk_dir_next() */
+  guint64 ino;
+  gboolean has_sig;
+} WalkEntry;
+
+typedef struct
+{
+  WalkEntry *entries;
+  gsize n_entries;
+  char *names;
+} WalkEntries;
+
+WalkDir *walk_dir_open (WalkDir *parent, const char *name, const char *path, GError **error);
+WalkDir *walk_dir_ref (WalkDir *dir);
+void walk_dir_unref (WalkDir *dir);
+int walk_dir_get_fd (WalkDir *dir);
+gboolean walk_dir_next (WalkDir *dir, const char **name_out, int *type_out, guint64 *ino_out,
+                        GError **error);
+gboolean walk_get_type (WalkDir *dir, const char *name, const char *path, int *type_inout,
+                        GError **error);
+WalkEntries *walk_dir_read_entries (WalkDir *dir, GError **error);
+void walk_entries_free (WalkEntries *entries);
+char *walk_child_path (const char *path, const char *name);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (WalkDir, walk_dir_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (WalkEntries, walk_entries_free)